@@ -0,0 +1,528 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gsm-autostart-cache.h"
+
+/*
+ * The cache is a serialized GVariant in $XDG_CACHE_HOME, mapped in one
+ * go on startup. For each autostart directory it remembers the
+ * directory's mtime and, per desktop file, the file's mtime, its launch
+ * priority, whether it waits for the settings daemons and whether GsmApp
+ * refused it. A directory whose mtime
+ * hasn't changed isn't listed again, and a file whose mtime hasn't
+ * changed isn't parsed again.
+ *
+ * Version, desktops, dir -> (mtime, [(name, mtime, rejected, cacheable, priority, needs_settings)])
+ */
+#define CACHE_VERSION 3
+#define CACHE_TYPE "(usa{s(xa(sxbbub))})"
+#define CACHE_DIRS_TYPE "a{s(xa(sxbbub))}"
+#define CACHE_DIR_TYPE "(xa(sxbbub))"
+
+#define MAX_PARSE_THREADS 8
+
+typedef struct {
+        char              *name;
+        gint64             mtime;
+        gboolean           rejected;
+        /* Whether a rejection only depends on the file and the desktop.
+         * Exec, TryExec and AutostartCondition depend on the rest of the
+         * system, so a file that's only refused for those is always
+         * checked again */
+        gboolean           cacheable;
+        GsmLaunchPriority  priority;
+        gboolean           needs_settings;
+} CacheEntry;
+
+typedef struct {
+        gint64      mtime;
+        GPtrArray  *entries;
+        GHashTable *by_name;
+} CacheDir;
+
+struct _GsmAutostartCache
+{
+        GObject      parent;
+
+        char        *path;
+        GMappedFile *mapped;
+        GVariant    *old_dirs;
+        /* What this login saw; this is what gets saved */
+        GHashTable  *dirs;
+        gboolean     dirty;
+};
+
+G_DEFINE_TYPE (GsmAutostartCache, gsm_autostart_cache, G_TYPE_OBJECT)
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+        g_free (entry->name);
+        g_free (entry);
+}
+
+static CacheDir *
+cache_dir_new (gint64 mtime)
+{
+        CacheDir *cache_dir;
+
+        cache_dir = g_new0 (CacheDir, 1);
+        cache_dir->mtime = mtime;
+        cache_dir->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) cache_entry_free);
+        cache_dir->by_name = g_hash_table_new (g_str_hash, g_str_equal);
+
+        return cache_dir;
+}
+
+static void
+cache_dir_free (CacheDir *cache_dir)
+{
+        g_hash_table_unref (cache_dir->by_name);
+        g_ptr_array_unref (cache_dir->entries);
+        g_free (cache_dir);
+}
+
+static void
+autostart_entry_free (GsmAutostartEntry *entry)
+{
+        g_free (entry->path);
+        g_free (entry);
+}
+
+static const char *
+get_current_desktops (void)
+{
+        const char *desktops;
+
+        desktops = g_getenv ("XDG_CURRENT_DESKTOP");
+        return desktops != NULL ? desktops : "";
+}
+
+static gboolean
+get_mtime (const char *path,
+           gint64     *mtime)
+{
+        struct stat st;
+
+        if (stat (path, &st) < 0)
+                return FALSE;
+
+        *mtime = (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+        return TRUE;
+}
+
+static void
+gsm_autostart_cache_finalize (GObject *object)
+{
+        GsmAutostartCache *cache = GSM_AUTOSTART_CACHE (object);
+
+        g_free (cache->path);
+        g_clear_pointer (&cache->old_dirs, g_variant_unref);
+        g_clear_pointer (&cache->mapped, g_mapped_file_unref);
+        g_hash_table_unref (cache->dirs);
+
+        G_OBJECT_CLASS (gsm_autostart_cache_parent_class)->finalize (object);
+}
+
+static void
+gsm_autostart_cache_class_init (GsmAutostartCacheClass *klass)
+{
+        GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+        object_class->finalize = gsm_autostart_cache_finalize;
+}
+
+static void
+load_cache (GsmAutostartCache *cache)
+{
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GBytes) bytes = NULL;
+        g_autoptr(GVariant) root = NULL;
+        const char *desktops;
+        guint32 version;
+
+        cache->mapped = g_mapped_file_new (cache->path, FALSE, &error);
+        if (cache->mapped == NULL) {
+                if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                        g_debug ("GsmAutostartCache: can't map %s: %s", cache->path, error->message);
+                return;
+        }
+
+        bytes = g_mapped_file_get_bytes (cache->mapped);
+        root = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (CACHE_TYPE),
+                                                             bytes, FALSE));
+
+        g_variant_get (root, "(u&s@" CACHE_DIRS_TYPE ")", &version, &desktops, &cache->old_dirs);
+
+        if (version != CACHE_VERSION || g_strcmp0 (desktops, get_current_desktops ()) != 0) {
+                g_debug ("GsmAutostartCache: discarding cache for version %u, desktops '%s'",
+                         version, desktops);
+                g_clear_pointer (&cache->old_dirs, g_variant_unref);
+        }
+}
+
+static void
+gsm_autostart_cache_init (GsmAutostartCache *cache)
+{
+        cache->path = g_build_filename (g_get_user_cache_dir (),
+                                        "gnome-session",
+                                        "autostart.cache",
+                                        NULL);
+        cache->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify) cache_dir_free);
+
+        load_cache (cache);
+}
+
+GsmAutostartCache *
+gsm_autostart_cache_new (void)
+{
+        return g_object_new (GSM_TYPE_AUTOSTART_CACHE, NULL);
+}
+
+static gboolean
+shown_in_current_desktop (GKeyFile *keyfile)
+{
+        g_auto(GStrv) only_show_in = NULL;
+        g_auto(GStrv) not_show_in = NULL;
+        g_auto(GStrv) desktops = NULL;
+
+        only_show_in = g_key_file_get_string_list (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                                    "OnlyShowIn", NULL, NULL);
+        not_show_in = g_key_file_get_string_list (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                                   "NotShowIn", NULL, NULL);
+        desktops = g_strsplit (get_current_desktops (), ":", -1);
+
+        for (guint i = 0; desktops[i] != NULL; i++) {
+                if (only_show_in != NULL &&
+                    g_strv_contains ((const char * const *) only_show_in, desktops[i]))
+                        return TRUE;
+                if (not_show_in != NULL &&
+                    g_strv_contains ((const char * const *) not_show_in, desktops[i]))
+                        return FALSE;
+        }
+
+        return only_show_in == NULL;
+}
+
+/* Runs on a worker thread for each file that changed since last time */
+static void
+parse_entry (CacheEntry *entry,
+             const char *dir)
+{
+        g_autoptr(GKeyFile) keyfile = NULL;
+        g_autofree char *path = NULL;
+
+        path = g_build_filename (dir, entry->name, NULL);
+        keyfile = g_key_file_new ();
+
+        entry->priority = GSM_LAUNCH_PRIORITY_APPLICATION;
+        entry->needs_settings = FALSE;
+        entry->cacheable = TRUE;
+
+        if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL))
+                return;
+
+        entry->priority = gsm_launch_queue_priority_from_keyfile (keyfile);
+        entry->needs_settings = gsm_launch_queue_needs_settings_from_keyfile (keyfile);
+
+        /* Anything else GsmApp refuses, like an Exec that isn't in PATH,
+         * can change without the file changing */
+        entry->cacheable = g_key_file_get_boolean (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                                   "Hidden", NULL) ||
+                           (g_key_file_has_key (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                                "X-GNOME-Autostart-enabled", NULL) &&
+                            !g_key_file_get_boolean (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                                     "X-GNOME-Autostart-enabled", NULL)) ||
+                           !shown_in_current_desktop (keyfile);
+}
+
+static void
+parse_entries (GPtrArray  *misses,
+               const char *dir)
+{
+        g_autoptr(GError) error = NULL;
+        GThreadPool *pool;
+        guint n_threads;
+
+        if (misses->len == 0)
+                return;
+
+        n_threads = MIN (misses->len, MIN (g_get_num_processors (), MAX_PARSE_THREADS));
+        if (n_threads > 1)
+                pool = g_thread_pool_new ((GFunc) parse_entry, (gpointer) dir,
+                                          n_threads, FALSE, &error);
+        else
+                pool = NULL;
+
+        if (pool == NULL) {
+                if (error != NULL)
+                        g_debug ("GsmAutostartCache: parsing serially: %s", error->message);
+                g_ptr_array_foreach (misses, (GFunc) parse_entry, (gpointer) dir);
+                return;
+        }
+
+        for (guint i = 0; i < misses->len; i++)
+                g_thread_pool_push (pool, g_ptr_array_index (misses, i), NULL);
+
+        /* waits for the queue to drain */
+        g_thread_pool_free (pool, FALSE, TRUE);
+}
+
+static GHashTable *
+get_old_entries (GsmAutostartCache *cache,
+                 const char        *dir,
+                 gint64            *old_mtime,
+                 GPtrArray         *names)
+{
+        g_autoptr(GVariant) old_dir = NULL;
+        g_autoptr(GVariantIter) iter = NULL;
+        GHashTable *old_entries;
+        CacheEntry entry;
+        const char *name;
+        guint32 priority;
+
+        old_entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                             (GDestroyNotify) cache_entry_free);
+        *old_mtime = -1;
+
+        if (cache->old_dirs == NULL)
+                return old_entries;
+
+        old_dir = g_variant_lookup_value (cache->old_dirs, dir, G_VARIANT_TYPE (CACHE_DIR_TYPE));
+        if (old_dir == NULL)
+                return old_entries;
+
+        g_variant_get (old_dir, "(xa(sxbbub))", old_mtime, &iter);
+        while (g_variant_iter_next (iter, "(&sxbbub)", &name, &entry.mtime,
+                                    &entry.rejected, &entry.cacheable, &priority,
+                                    &entry.needs_settings)) {
+                CacheEntry *copy;
+
+                copy = g_memdup2 (&entry, sizeof (entry));
+                copy->name = g_strdup (name);
+                copy->priority = MIN (priority, GSM_LAUNCH_PRIORITY_APPLICATION);
+                g_hash_table_replace (old_entries, copy->name, copy);
+                g_ptr_array_add (names, g_strdup (name));
+        }
+
+        return old_entries;
+}
+
+/**
+ * gsm_autostart_cache_scan:
+ * @dir: an autostart directory
+ *
+ * Lists the desktop files in @dir, only reading the directory and the
+ * files that changed since the last login.
+ *
+ * Returns: (transfer container) (element-type GsmAutostartEntry): the
+ *   entries, or %NULL if @dir doesn't exist
+ */
+GPtrArray *
+gsm_autostart_cache_scan (GsmAutostartCache *cache,
+                          const char        *dir)
+{
+        g_autoptr(GHashTable) old_entries = NULL;
+        g_autoptr(GPtrArray) names = NULL;
+        g_autoptr(GPtrArray) misses = NULL;
+        GPtrArray *result;
+        CacheDir *cache_dir;
+        gint64 dir_mtime;
+        gint64 old_mtime;
+
+        g_return_val_if_fail (GSM_IS_AUTOSTART_CACHE (cache), NULL);
+
+        if (!get_mtime (dir, &dir_mtime))
+                return NULL;
+
+        names = g_ptr_array_new_with_free_func (g_free);
+        old_entries = get_old_entries (cache, dir, &old_mtime, names);
+
+        if (old_mtime != dir_mtime) {
+                GDir *d;
+                const char *name;
+
+                cache->dirty = TRUE;
+                g_ptr_array_set_size (names, 0);
+
+                d = g_dir_open (dir, 0, NULL);
+                if (d == NULL)
+                        return NULL;
+
+                while ((name = g_dir_read_name (d)) != NULL) {
+                        if (g_str_has_suffix (name, ".desktop"))
+                                g_ptr_array_add (names, g_strdup (name));
+                }
+
+                g_dir_close (d);
+        }
+
+        cache_dir = cache_dir_new (dir_mtime);
+        g_hash_table_replace (cache->dirs, g_strdup (dir), cache_dir);
+
+        misses = g_ptr_array_new ();
+
+        for (guint i = 0; i < names->len; i++) {
+                const char *name = g_ptr_array_index (names, i);
+                g_autofree char *path = NULL;
+                CacheEntry *entry;
+                gint64 mtime;
+
+                path = g_build_filename (dir, name, NULL);
+                if (!get_mtime (path, &mtime)) {
+                        cache->dirty = TRUE;
+                        continue;
+                }
+
+                entry = g_hash_table_lookup (old_entries, name);
+                if (entry != NULL && entry->mtime == mtime) {
+                        g_hash_table_steal (old_entries, name);
+                } else {
+                        entry = g_new0 (CacheEntry, 1);
+                        entry->name = g_strdup (name);
+                        entry->mtime = mtime;
+                        g_ptr_array_add (misses, entry);
+                        cache->dirty = TRUE;
+                }
+
+                g_ptr_array_add (cache_dir->entries, entry);
+                g_hash_table_insert (cache_dir->by_name, entry->name, entry);
+        }
+
+        g_debug ("GsmAutostartCache: %s: %u entries, %u changed",
+                 dir, cache_dir->entries->len, misses->len);
+
+        parse_entries (misses, dir);
+
+        result = g_ptr_array_new_full (cache_dir->entries->len,
+                                       (GDestroyNotify) autostart_entry_free);
+
+        for (guint i = 0; i < cache_dir->entries->len; i++) {
+                CacheEntry *entry = g_ptr_array_index (cache_dir->entries, i);
+                GsmAutostartEntry *autostart_entry;
+
+                autostart_entry = g_new0 (GsmAutostartEntry, 1);
+                autostart_entry->path = g_build_filename (dir, entry->name, NULL);
+                autostart_entry->priority = entry->priority;
+                autostart_entry->needs_settings = entry->needs_settings;
+                autostart_entry->rejected = entry->rejected && entry->cacheable;
+                g_ptr_array_add (result, autostart_entry);
+        }
+
+        return result;
+}
+
+/**
+ * gsm_autostart_cache_mark_rejected:
+ * @path: a desktop file returned by gsm_autostart_cache_scan()
+ *
+ * Remembers that no app could be created for @path. If the file alone
+ * decides that, because it's hidden, disabled or not shown in this
+ * desktop, the next login skips it until the file changes.
+ */
+void
+gsm_autostart_cache_mark_rejected (GsmAutostartCache *cache,
+                                   const char        *path)
+{
+        g_autofree char *dir = NULL;
+        g_autofree char *name = NULL;
+        CacheDir *cache_dir;
+        CacheEntry *entry;
+
+        g_return_if_fail (GSM_IS_AUTOSTART_CACHE (cache));
+
+        dir = g_path_get_dirname (path);
+        cache_dir = g_hash_table_lookup (cache->dirs, dir);
+        if (cache_dir == NULL)
+                return;
+
+        name = g_path_get_basename (path);
+        entry = g_hash_table_lookup (cache_dir->by_name, name);
+        if (entry == NULL || entry->rejected)
+                return;
+
+        entry->rejected = TRUE;
+        cache->dirty = TRUE;
+}
+
+void
+gsm_autostart_cache_save (GsmAutostartCache *cache)
+{
+        g_autoptr(GVariant) root = NULL;
+        g_autoptr(GError) error = NULL;
+        g_autofree char *dirname = NULL;
+        GVariantBuilder dirs;
+        GHashTableIter iter;
+        const char *dir;
+        CacheDir *cache_dir;
+
+        g_return_if_fail (GSM_IS_AUTOSTART_CACHE (cache));
+
+        if (!cache->dirty)
+                return;
+
+        g_variant_builder_init (&dirs, G_VARIANT_TYPE (CACHE_DIRS_TYPE));
+
+        g_hash_table_iter_init (&iter, cache->dirs);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &dir, (gpointer *) &cache_dir)) {
+                GVariantBuilder entries;
+
+                g_variant_builder_init (&entries, G_VARIANT_TYPE ("a(sxbbub)"));
+                for (guint i = 0; i < cache_dir->entries->len; i++) {
+                        CacheEntry *entry = g_ptr_array_index (cache_dir->entries, i);
+
+                        g_variant_builder_add (&entries, "(sxbbub)",
+                                               entry->name, entry->mtime,
+                                               entry->rejected, entry->cacheable,
+                                               (guint32) entry->priority,
+                                               entry->needs_settings);
+                }
+
+                g_variant_builder_add (&dirs, "{s(xa(sxbbub))}", dir,
+                                       cache_dir->mtime, &entries);
+        }
+
+        root = g_variant_ref_sink (g_variant_new ("(us" CACHE_DIRS_TYPE ")",
+                                                  CACHE_VERSION,
+                                                  get_current_desktops (),
+                                                  &dirs));
+
+        dirname = g_path_get_dirname (cache->path);
+        if (g_mkdir_with_parents (dirname, 0700) < 0) {
+                g_warning ("Failed to create %s: %s", dirname, g_strerror (errno));
+                return;
+        }
+
+        /* replaces the file, so the old mapping stays valid */
+        if (!g_file_set_contents (cache->path,
+                                  g_variant_get_data (root),
+                                  g_variant_get_size (root),
+                                  &error)) {
+                g_warning ("Failed to save autostart cache: %s", error->message);
+                return;
+        }
+
+        cache->dirty = FALSE;
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GSM_AUTOSTART_CACHE_H__
+#define __GSM_AUTOSTART_CACHE_H__
+
+#include <glib-object.h>
+
+#include "gsm-launch-queue.h"
+
+G_BEGIN_DECLS
+
+typedef struct {
+        char              *path;
+        GsmLaunchPriority  priority;
+        gboolean           needs_settings;
+        /* gsm_app_new_for_path() refused this file last time and nothing
+         * it depends on has changed since */
+        gboolean           rejected;
+} GsmAutostartEntry;
+
+#define GSM_TYPE_AUTOSTART_CACHE (gsm_autostart_cache_get_type ())
+G_DECLARE_FINAL_TYPE (GsmAutostartCache, gsm_autostart_cache, GSM, AUTOSTART_CACHE, GObject)
+
+GsmAutostartCache *gsm_autostart_cache_new           (void);
+
+GPtrArray *        gsm_autostart_cache_scan          (GsmAutostartCache *cache,
+                                                      const char        *dir);
+void               gsm_autostart_cache_mark_rejected (GsmAutostartCache *cache,
+                                                      const char        *path);
+void               gsm_autostart_cache_save          (GsmAutostartCache *cache);
+
+G_END_DECLS
+
+#endif /* __GSM_AUTOSTART_CACHE_H__ */
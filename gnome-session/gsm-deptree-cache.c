@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gsm-deptree-cache.h"
+
+/*
+ * Resolving the session graph through librc means loading the deptree,
+ * which OpenRC rebuilds by sourcing every init script whenever it thinks
+ * something changed. The graph itself only depends on the user init
+ * scripts, their conf.d files and the runlevels, so we keep the resolved
+ * graph for each runlevel in $XDG_CACHE_HOME, together with the mtimes of
+ * everything it was resolved from, and reuse it until one of them changes.
+ *
+ * Version, runlevel, target, [(path, mtime)], graph
+ */
+#define CACHE_VERSION 1
+#define CACHE_TYPE "(ussa(sx)" GSM_DEPTREE_GRAPH_TYPE ")"
+#define FINGERPRINT_TYPE "a(sx)"
+
+#define SYSTEM_USER_DIR "/etc/user"
+
+static char *
+get_cache_path (const char *runlevel)
+{
+        g_autofree char *name = g_strdup_printf ("deptree-%s.cache", runlevel);
+
+        return g_build_filename (g_get_user_cache_dir (), "gnome-session", name, NULL);
+}
+
+char *
+gsm_deptree_cache_get_stats_path (void)
+{
+        return g_build_filename (g_get_user_state_dir (),
+                                 "gnome-session",
+                                 "deptree-cache.ini",
+                                 NULL);
+}
+
+static gboolean
+get_mtime (const char *path,
+           gint64     *mtime)
+{
+        struct stat st;
+
+        if (stat (path, &st) < 0)
+                return FALSE;
+
+        *mtime = (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+        return TRUE;
+}
+
+static void
+add_path (GPtrArray  *paths,
+          const char *path)
+{
+        g_ptr_array_add (paths, g_strdup (path));
+}
+
+/* A directory's own mtime covers scripts being added or removed, and
+ * stat() follows the gsd-* symlinks to the script they share. */
+static void
+add_dir (GPtrArray  *paths,
+         const char *dir)
+{
+        g_autoptr(GDir) d = NULL;
+        const char *name;
+
+        d = g_dir_open (dir, 0, NULL);
+        if (d == NULL)
+                return;
+
+        add_path (paths, dir);
+        while ((name = g_dir_read_name (d)) != NULL)
+                g_ptr_array_add (paths, g_build_filename (dir, name, NULL));
+}
+
+static int
+compare_paths (gconstpointer a,
+               gconstpointer b)
+{
+        return strcmp (*(const char **) a, *(const char **) b);
+}
+
+static GVariant *
+compute_fingerprint (const char *runlevel)
+{
+        g_autoptr(GPtrArray) paths = NULL;
+        g_autofree char *user_dir = NULL;
+        g_autofree char *runlevel_dir = NULL;
+        g_autofree char *default_dir = NULL;
+        g_autofree char *init_dir = NULL;
+        g_autofree char *conf_dir = NULL;
+        GVariantBuilder builder;
+
+        paths = g_ptr_array_new_with_free_func (g_free);
+
+        user_dir = g_build_filename (g_get_user_config_dir (), "rc", NULL);
+        init_dir = g_build_filename (user_dir, "init.d", NULL);
+        conf_dir = g_build_filename (user_dir, "conf.d", NULL);
+        runlevel_dir = g_build_filename (user_dir, "runlevels", runlevel, NULL);
+        default_dir = g_build_filename (user_dir, "runlevels", "default", NULL);
+
+        add_path (paths, "/etc/rc.conf");
+        add_dir (paths, SYSTEM_USER_DIR "/init.d");
+        add_dir (paths, SYSTEM_USER_DIR "/conf.d");
+        add_dir (paths, init_dir);
+        add_dir (paths, conf_dir);
+        add_dir (paths, runlevel_dir);
+        add_dir (paths, default_dir);
+
+        g_ptr_array_sort (paths, compare_paths);
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE (FINGERPRINT_TYPE));
+        for (guint i = 0; i < paths->len; i++) {
+                const char *path = g_ptr_array_index (paths, i);
+                gint64 mtime;
+
+                if (get_mtime (path, &mtime))
+                        g_variant_builder_add (&builder, "(sx)", path, mtime);
+        }
+
+        return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/*
+ * Hits are counted as bytes appended to a file per runlevel, so a login
+ * that reuses the graph costs one write rather than rewriting the stats.
+ */
+char *
+gsm_deptree_cache_get_hits_path (const char *runlevel)
+{
+        g_autofree char *name = g_strdup_printf ("deptree-%s.hits", runlevel);
+
+        return g_build_filename (g_get_user_state_dir (), "gnome-session", name, NULL);
+}
+
+static void
+record_hit (const char *runlevel)
+{
+        g_autofree char *path = NULL;
+        int fd;
+
+        path = gsm_deptree_cache_get_hits_path (runlevel);
+        fd = g_open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                g_debug ("GsmDeptreeCache: can't open %s: %s", path, g_strerror (errno));
+                return;
+        }
+
+        if (write (fd, "+", 1) < 0)
+                g_debug ("GsmDeptreeCache: can't count hit: %s", g_strerror (errno));
+        close (fd);
+}
+
+static void
+record_miss (const char *runlevel,
+             const char *miss_reason)
+{
+        g_autoptr(GKeyFile) keyfile = NULL;
+        g_autoptr(GError) error = NULL;
+        g_autofree char *path = NULL;
+        g_autofree char *dirname = NULL;
+
+        path = gsm_deptree_cache_get_stats_path ();
+        keyfile = g_key_file_new ();
+        if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, &error) &&
+            !g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                g_debug ("GsmDeptreeCache: discarding stats in %s: %s", path, error->message);
+        g_clear_error (&error);
+
+        g_key_file_set_uint64 (keyfile, runlevel, "Misses",
+                               g_key_file_get_uint64 (keyfile, runlevel, "Misses", NULL) + 1);
+        g_key_file_set_string (keyfile, runlevel, "LastMiss", miss_reason);
+        g_key_file_set_int64 (keyfile, runlevel, "LastMissTime",
+                              g_get_real_time () / G_USEC_PER_SEC);
+
+        dirname = g_path_get_dirname (path);
+        if (g_mkdir_with_parents (dirname, 0700) < 0) {
+                g_debug ("GsmDeptreeCache: can't create %s: %s", dirname, g_strerror (errno));
+                return;
+        }
+
+        if (!g_key_file_save_to_file (keyfile, path, &error))
+                g_debug ("GsmDeptreeCache: can't save stats: %s", error->message);
+}
+
+/**
+ * gsm_deptree_cache_lookup:
+ * @runlevel: the runlevel the graph was resolved for
+ * @target: the service the graph was resolved for
+ * @fingerprint: (out): the current state of the scripts, to pass to
+ *   gsm_deptree_cache_store() if the lookup misses
+ *
+ * Returns: the cached graph, or %NULL if there is none or it is stale.
+ */
+GVariant *
+gsm_deptree_cache_lookup (const char  *runlevel,
+                          const char  *target,
+                          GVariant   **fingerprint)
+{
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GMappedFile) mapped = NULL;
+        g_autoptr(GBytes) bytes = NULL;
+        g_autoptr(GVariant) root = NULL;
+        g_autoptr(GVariant) cached_fingerprint = NULL;
+        g_autoptr(GVariant) graph = NULL;
+        g_autofree char *path = NULL;
+        const char *cached_runlevel;
+        const char *cached_target;
+        const char *miss_reason = NULL;
+        guint32 version;
+
+        *fingerprint = compute_fingerprint (runlevel);
+
+        path = get_cache_path (runlevel);
+        mapped = g_mapped_file_new (path, FALSE, &error);
+        if (mapped == NULL) {
+                if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                        g_debug ("GsmDeptreeCache: can't map %s: %s", path, error->message);
+                miss_reason = "missing";
+                goto out;
+        }
+
+        bytes = g_mapped_file_get_bytes (mapped);
+        root = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (CACHE_TYPE),
+                                                             bytes, FALSE));
+        if (!g_variant_is_normal_form (root)) {
+                miss_reason = "corrupt";
+                goto out;
+        }
+
+        g_variant_get (root, "(u&s&s@" FINGERPRINT_TYPE "@" GSM_DEPTREE_GRAPH_TYPE ")",
+                       &version, &cached_runlevel, &cached_target,
+                       &cached_fingerprint, &graph);
+
+        if (version != CACHE_VERSION ||
+            g_strcmp0 (cached_runlevel, runlevel) != 0 ||
+            g_strcmp0 (cached_target, target) != 0)
+                miss_reason = "version";
+        else if (!g_variant_equal (cached_fingerprint, *fingerprint))
+                miss_reason = "changed";
+
+out:
+        if (miss_reason != NULL) {
+                g_debug ("GsmDeptreeCache: miss for %s (%s)", runlevel, miss_reason);
+                record_miss (runlevel, miss_reason);
+                return NULL;
+        }
+
+        g_debug ("GsmDeptreeCache: hit for %s", runlevel);
+        record_hit (runlevel);
+        return g_steal_pointer (&graph);
+}
+
+/**
+ * gsm_deptree_cache_store:
+ * @fingerprint: what gsm_deptree_cache_lookup() returned, taken before
+ *   @graph was resolved
+ * @graph: the resolved graph, of type %GSM_DEPTREE_GRAPH_TYPE
+ */
+void
+gsm_deptree_cache_store (const char *runlevel,
+                         const char *target,
+                         GVariant   *fingerprint,
+                         GVariant   *graph)
+{
+        g_autoptr(GVariant) root = NULL;
+        g_autoptr(GError) error = NULL;
+        g_autofree char *path = NULL;
+        g_autofree char *dirname = NULL;
+
+        g_return_if_fail (g_variant_is_of_type (graph, G_VARIANT_TYPE (GSM_DEPTREE_GRAPH_TYPE)));
+
+        root = g_variant_ref_sink (g_variant_new ("(uss@" FINGERPRINT_TYPE "@" GSM_DEPTREE_GRAPH_TYPE ")",
+                                                  CACHE_VERSION, runlevel, target,
+                                                  fingerprint, graph));
+
+        path = get_cache_path (runlevel);
+        dirname = g_path_get_dirname (path);
+        if (g_mkdir_with_parents (dirname, 0700) < 0) {
+                g_warning ("Failed to create %s: %s", dirname, g_strerror (errno));
+                return;
+        }
+
+        if (!g_file_set_contents (path,
+                                  g_variant_get_data (root),
+                                  g_variant_get_size (root),
+                                  &error))
+                g_warning ("Failed to save dependency tree cache: %s", error->message);
+}
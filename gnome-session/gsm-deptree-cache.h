@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GSM_DEPTREE_CACHE_H__
+#define __GSM_DEPTREE_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Services in start order, each with the services in the graph it needs */
+#define GSM_DEPTREE_GRAPH_TYPE "a(sas)"
+
+GVariant *      gsm_deptree_cache_lookup         (const char  *runlevel,
+                                                  const char  *target,
+                                                  GVariant   **fingerprint);
+void            gsm_deptree_cache_store          (const char  *runlevel,
+                                                  const char  *target,
+                                                  GVariant    *fingerprint,
+                                                  GVariant    *graph);
+
+char *          gsm_deptree_cache_get_stats_path (void);
+char *          gsm_deptree_cache_get_hits_path  (const char  *runlevel);
+
+G_END_DECLS
+
+#endif /* __GSM_DEPTREE_CACHE_H__ */
@@ -0,0 +1,232 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gsm-latency-history.h"
+
+/* How many replies we remember per client and phase */
+#define MAX_SAMPLES 20
+/* Below this we don't trust the percentile and use the default timeout */
+#define MIN_SAMPLES 3
+
+struct _GsmLatencyHistory
+{
+        GObject     parent;
+
+        char       *path;
+        GKeyFile   *keyfile;
+        gboolean    dirty;
+};
+
+G_DEFINE_TYPE (GsmLatencyHistory, gsm_latency_history, G_TYPE_OBJECT)
+
+static const char *kind_keys[GSM_LATENCY_N_KINDS] = {
+        [GSM_LATENCY_QUERY_END_SESSION] = "QueryEndSession",
+        [GSM_LATENCY_END_SESSION] = "EndSession",
+};
+
+static void
+gsm_latency_history_finalize (GObject *object)
+{
+        GsmLatencyHistory *history = GSM_LATENCY_HISTORY (object);
+
+        g_free (history->path);
+        g_key_file_free (history->keyfile);
+
+        G_OBJECT_CLASS (gsm_latency_history_parent_class)->finalize (object);
+}
+
+static void
+gsm_latency_history_class_init (GsmLatencyHistoryClass *klass)
+{
+        GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+        object_class->finalize = gsm_latency_history_finalize;
+}
+
+static void
+gsm_latency_history_init (GsmLatencyHistory *history)
+{
+        g_autoptr(GError) error = NULL;
+
+        history->path = g_build_filename (g_get_user_state_dir (),
+                                          "gnome-session",
+                                          "client-latency.ini",
+                                          NULL);
+        history->keyfile = g_key_file_new ();
+
+        if (!g_key_file_load_from_file (history->keyfile, history->path,
+                                        G_KEY_FILE_NONE, &error) &&
+            !g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                g_warning ("Failed to load client latency history: %s", error->message);
+}
+
+GsmLatencyHistory *
+gsm_latency_history_new (void)
+{
+        return g_object_new (GSM_TYPE_LATENCY_HISTORY, NULL);
+}
+
+/**
+ * gsm_latency_history_record:
+ * @app_id: the app the client belongs to
+ * @latency_ms: how long the client took to reply, or how long we waited
+ *   for it before giving up
+ *
+ * Adds a sample, dropping the oldest one once there are too many.
+ */
+void
+gsm_latency_history_record (GsmLatencyHistory *history,
+                            const char        *app_id,
+                            GsmLatencyKind     kind,
+                            guint              latency_ms)
+{
+        g_autofree gint *samples = NULL;
+        gsize n_samples = 0;
+        gint *updated;
+        gsize n_updated;
+
+        g_return_if_fail (GSM_IS_LATENCY_HISTORY (history));
+
+        if (app_id == NULL || app_id[0] == '\0')
+                return;
+
+        samples = g_key_file_get_integer_list (history->keyfile, app_id,
+                                               kind_keys[kind], &n_samples, NULL);
+
+        n_updated = MIN (n_samples + 1, MAX_SAMPLES);
+        updated = g_newa (gint, n_updated);
+        for (gsize i = 0; i < n_updated - 1; i++)
+                updated[i] = samples[n_samples - (n_updated - 1) + i];
+        updated[n_updated - 1] = (gint) MIN (latency_ms, G_MAXINT);
+
+        g_key_file_set_integer_list (history->keyfile, app_id,
+                                     kind_keys[kind], updated, n_updated);
+        history->dirty = TRUE;
+}
+
+static int
+compare_ints (gconstpointer a,
+              gconstpointer b)
+{
+        return *(const gint *) a - *(const gint *) b;
+}
+
+/**
+ * gsm_latency_history_get_p99:
+ *
+ * Returns: %TRUE and sets @p99_ms if there is enough history for @app_id
+ */
+gboolean
+gsm_latency_history_get_p99 (GsmLatencyHistory *history,
+                             const char        *app_id,
+                             GsmLatencyKind     kind,
+                             guint             *p99_ms)
+{
+        g_autofree gint *samples = NULL;
+        gsize n_samples = 0;
+        gsize index;
+
+        g_return_val_if_fail (GSM_IS_LATENCY_HISTORY (history), FALSE);
+
+        if (app_id == NULL || app_id[0] == '\0')
+                return FALSE;
+
+        samples = g_key_file_get_integer_list (history->keyfile, app_id,
+                                               kind_keys[kind], &n_samples, NULL);
+        if (samples == NULL || n_samples < MIN_SAMPLES)
+                return FALSE;
+
+        qsort (samples, n_samples, sizeof (gint), compare_ints);
+
+        /* Nearest rank; with our sample count this is the slowest reply or
+         * close to it, which is what we want a deadline to cover. */
+        index = (n_samples * 99 + 99) / 100 - 1;
+        *p99_ms = (guint) MAX (samples[index], 0);
+
+        return TRUE;
+}
+
+void
+gsm_latency_history_save (GsmLatencyHistory *history)
+{
+        g_autoptr(GError) error = NULL;
+        g_autofree char *dir = NULL;
+
+        g_return_if_fail (GSM_IS_LATENCY_HISTORY (history));
+
+        if (!history->dirty)
+                return;
+
+        dir = g_path_get_dirname (history->path);
+        if (g_mkdir_with_parents (dir, 0700) < 0) {
+                g_warning ("Failed to create %s: %m", dir);
+                return;
+        }
+
+        if (!g_key_file_save_to_file (history->keyfile, history->path, &error)) {
+                g_warning ("Failed to save client latency history: %s", error->message);
+                return;
+        }
+
+        history->dirty = FALSE;
+}
+
+/**
+ * gsm_latency_history_to_variant:
+ *
+ * Returns: (transfer floating): an a{s(uuu)} of app id to the number of
+ *   EndSession samples, QueryEndSession p99 and EndSession p99 in
+ *   milliseconds, with 0 meaning there isn't enough history yet
+ */
+GVariant *
+gsm_latency_history_to_variant (GsmLatencyHistory *history)
+{
+        GVariantBuilder builder;
+        g_auto(GStrv) app_ids = NULL;
+
+        g_return_val_if_fail (GSM_IS_LATENCY_HISTORY (history), NULL);
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(uuu)}"));
+
+        app_ids = g_key_file_get_groups (history->keyfile, NULL);
+        for (guint i = 0; app_ids[i] != NULL; i++) {
+                g_autofree gint *samples = NULL;
+                gsize n_samples = 0;
+                guint query_p99 = 0;
+                guint end_p99 = 0;
+
+                samples = g_key_file_get_integer_list (history->keyfile, app_ids[i],
+                                                       kind_keys[GSM_LATENCY_END_SESSION],
+                                                       &n_samples, NULL);
+
+                gsm_latency_history_get_p99 (history, app_ids[i],
+                                             GSM_LATENCY_QUERY_END_SESSION, &query_p99);
+                gsm_latency_history_get_p99 (history, app_ids[i],
+                                             GSM_LATENCY_END_SESSION, &end_p99);
+
+                g_variant_builder_add (&builder, "{s(uuu)}", app_ids[i],
+                                       (guint32) n_samples, query_p99, end_p99);
+        }
+
+        return g_variant_builder_end (&builder);
+}
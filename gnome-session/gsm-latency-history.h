@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GSM_LATENCY_HISTORY_H__
+#define __GSM_LATENCY_HISTORY_H__
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+        GSM_LATENCY_QUERY_END_SESSION,
+        GSM_LATENCY_END_SESSION,
+        GSM_LATENCY_N_KINDS
+} GsmLatencyKind;
+
+#define GSM_TYPE_LATENCY_HISTORY (gsm_latency_history_get_type ())
+G_DECLARE_FINAL_TYPE (GsmLatencyHistory, gsm_latency_history, GSM, LATENCY_HISTORY, GObject)
+
+GsmLatencyHistory *gsm_latency_history_new        (void);
+
+void               gsm_latency_history_record     (GsmLatencyHistory *history,
+                                                   const char        *app_id,
+                                                   GsmLatencyKind     kind,
+                                                   guint              latency_ms);
+gboolean           gsm_latency_history_get_p99    (GsmLatencyHistory *history,
+                                                   const char        *app_id,
+                                                   GsmLatencyKind     kind,
+                                                   guint             *p99_ms);
+void               gsm_latency_history_save       (GsmLatencyHistory *history);
+GVariant *         gsm_latency_history_to_variant (GsmLatencyHistory *history);
+
+G_END_DECLS
+
+#endif /* __GSM_LATENCY_HISTORY_H__ */
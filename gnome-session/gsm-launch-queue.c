@@ -0,0 +1,582 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "gsm-launch-queue.h"
+#include "gsm-pressure.h"
+
+/* Launches in flight at once, unless GNOME_SESSION_AUTOSTART_JOBS says otherwise */
+#define DEFAULT_MAX_JOBS 4
+#define MAX_MAX_JOBS     16
+
+/* Most autostart apps never register a client, so a launch gives its
+ * slot back after this long even if we don't hear from it */
+#define SETTLE_TIMEOUT_MS 250
+
+/* Non-session apps are held back while the avg10 CPU or IO pressure is
+ * above these, re-checking every THROTTLE_POLL_MS, but for no more than
+ * THROTTLE_MAX_MS over a whole run */
+#define THROTTLE_CPU_PRESSURE 40.0
+#define THROTTLE_IO_PRESSURE  30.0
+#define THROTTLE_POLL_MS      100
+#define THROTTLE_MAX_MS       2000
+
+struct _GsmLaunchQueue
+{
+        GObject                  parent;
+
+        GsmLaunchQueueStartFunc  start_func;
+        gpointer                 user_data;
+
+        guint                    max_jobs;
+        GHashTable              *priorities;
+        GQueue                   pending[GSM_LAUNCH_N_PRIORITIES];
+        /* Apps held until the settings daemons are up */
+        GHashTable              *needs_settings;
+        GQueue                   held;
+        gboolean                 settings_ready;
+        GHashTable              *in_flight;
+        GHashTable              *launch_times;
+        GHashTable              *latencies;
+
+        GTask                   *task;
+        gulong                   cancelled_id;
+        guint                    throttle_id;
+        /* Pressure no longer holds launches back after this */
+        gint64                   throttle_deadline;
+};
+
+G_DEFINE_TYPE (GsmLaunchQueue, gsm_launch_queue, G_TYPE_OBJECT)
+
+static void pump (GsmLaunchQueue *queue);
+
+static guint
+get_max_jobs (void)
+{
+        const char *jobs_string;
+        guint jobs = DEFAULT_MAX_JOBS;
+
+        jobs_string = g_getenv ("GNOME_SESSION_AUTOSTART_JOBS");
+        if (jobs_string != NULL)
+                jobs = (guint) atoi (jobs_string);
+
+        return CLAMP (jobs, 1, MAX_MAX_JOBS);
+}
+
+static void
+clear_pending (GsmLaunchQueue *queue)
+{
+        for (guint i = 0; i < GSM_LAUNCH_N_PRIORITIES; i++)
+                g_queue_clear_full (&queue->pending[i], g_object_unref);
+        g_queue_clear_full (&queue->held, g_object_unref);
+}
+
+static void
+remove_source (gpointer id)
+{
+        g_source_remove (GPOINTER_TO_UINT (id));
+}
+
+static void
+gsm_launch_queue_dispose (GObject *object)
+{
+        GsmLaunchQueue *queue = GSM_LAUNCH_QUEUE (object);
+
+        clear_pending (queue);
+        g_clear_handle_id (&queue->throttle_id, g_source_remove);
+        g_clear_pointer (&queue->in_flight, g_hash_table_unref);
+
+        G_OBJECT_CLASS (gsm_launch_queue_parent_class)->dispose (object);
+}
+
+static void
+gsm_launch_queue_finalize (GObject *object)
+{
+        GsmLaunchQueue *queue = GSM_LAUNCH_QUEUE (object);
+
+        g_hash_table_unref (queue->priorities);
+        g_hash_table_unref (queue->needs_settings);
+        g_hash_table_unref (queue->launch_times);
+        g_hash_table_unref (queue->latencies);
+
+        G_OBJECT_CLASS (gsm_launch_queue_parent_class)->finalize (object);
+}
+
+static void
+gsm_launch_queue_class_init (GsmLaunchQueueClass *klass)
+{
+        GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+        object_class->dispose = gsm_launch_queue_dispose;
+        object_class->finalize = gsm_launch_queue_finalize;
+}
+
+static void
+gsm_launch_queue_init (GsmLaunchQueue *queue)
+{
+        queue->max_jobs = get_max_jobs ();
+        queue->priorities = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        queue->needs_settings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        /* app id -> settle timeout source id */
+        queue->in_flight = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                  remove_source);
+        queue->launch_times = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        queue->latencies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        for (guint i = 0; i < GSM_LAUNCH_N_PRIORITIES; i++)
+                g_queue_init (&queue->pending[i]);
+        g_queue_init (&queue->held);
+}
+
+GsmLaunchQueue *
+gsm_launch_queue_new (GsmLaunchQueueStartFunc start_func,
+                      gpointer                user_data)
+{
+        GsmLaunchQueue *queue;
+
+        queue = g_object_new (GSM_TYPE_LAUNCH_QUEUE, NULL);
+        queue->start_func = start_func;
+        queue->user_data = user_data;
+
+        return queue;
+}
+
+/**
+ * gsm_launch_queue_priority_from_keyfile:
+ * @keyfile: a loaded autostart desktop file
+ *
+ * Maps the legacy X-GNOME-Autostart-Phase key to a launch priority. The
+ * shell-adjacent phases go first, apps without the key go last.
+ */
+GsmLaunchPriority
+gsm_launch_queue_priority_from_keyfile (GKeyFile *keyfile)
+{
+        g_autofree char *phase = NULL;
+
+        phase = g_key_file_get_string (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                       "X-GNOME-Autostart-Phase", NULL);
+        if (phase == NULL)
+                return GSM_LAUNCH_PRIORITY_APPLICATION;
+
+        if (g_str_equal (phase, "EarlyInitialization") ||
+            g_str_equal (phase, "PreDisplayServer") ||
+            g_str_equal (phase, "DisplayServer") ||
+            g_str_equal (phase, "Initialization") ||
+            g_str_equal (phase, "WindowManager") ||
+            g_str_equal (phase, "Panel"))
+                return GSM_LAUNCH_PRIORITY_SESSION;
+
+        if (g_str_equal (phase, "Desktop"))
+                return GSM_LAUNCH_PRIORITY_DESKTOP;
+
+        return GSM_LAUNCH_PRIORITY_APPLICATION;
+}
+
+/**
+ * gsm_launch_queue_needs_settings_from_keyfile:
+ * @keyfile: a loaded autostart desktop file
+ *
+ * Whether the app asked, with X-GNOME-Autostart-Needs-Settings, not to be
+ * started before the settings daemons are up. Apps without the key can
+ * start as soon as the shell is.
+ */
+gboolean
+gsm_launch_queue_needs_settings_from_keyfile (GKeyFile *keyfile)
+{
+        return g_key_file_get_boolean (keyfile, G_KEY_FILE_DESKTOP_GROUP,
+                                       "X-GNOME-Autostart-Needs-Settings", NULL);
+}
+
+GsmLaunchPriority
+gsm_launch_queue_read_priority (const char *path,
+                                gboolean   *needs_settings)
+{
+        g_autoptr(GKeyFile) keyfile = NULL;
+
+        *needs_settings = FALSE;
+
+        keyfile = g_key_file_new ();
+        if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL))
+                return GSM_LAUNCH_PRIORITY_APPLICATION;
+
+        *needs_settings = gsm_launch_queue_needs_settings_from_keyfile (keyfile);
+        return gsm_launch_queue_priority_from_keyfile (keyfile);
+}
+
+void
+gsm_launch_queue_set_priority (GsmLaunchQueue    *queue,
+                               const char        *app_id,
+                               GsmLaunchPriority  priority)
+{
+        g_return_if_fail (GSM_IS_LAUNCH_QUEUE (queue));
+        g_return_if_fail (priority < GSM_LAUNCH_N_PRIORITIES);
+
+        g_hash_table_insert (queue->priorities, g_strdup (app_id), GUINT_TO_POINTER (priority));
+}
+
+/**
+ * gsm_launch_queue_set_needs_settings:
+ *
+ * Holds @app_id back until gsm_launch_queue_settings_ready() is called.
+ */
+void
+gsm_launch_queue_set_needs_settings (GsmLaunchQueue *queue,
+                                     const char     *app_id)
+{
+        g_return_if_fail (GSM_IS_LAUNCH_QUEUE (queue));
+
+        g_hash_table_add (queue->needs_settings, g_strdup (app_id));
+}
+
+static void
+push_pending (GsmLaunchQueue *queue,
+              GsmApp         *app)
+{
+        gpointer priority = GUINT_TO_POINTER (GSM_LAUNCH_PRIORITY_APPLICATION);
+
+        g_hash_table_lookup_extended (queue->priorities, gsm_app_peek_app_id (app),
+                                      NULL, &priority);
+        g_queue_push_tail (&queue->pending[GPOINTER_TO_UINT (priority)], app);
+}
+
+void
+gsm_launch_queue_push (GsmLaunchQueue *queue,
+                       GsmApp         *app)
+{
+        g_return_if_fail (GSM_IS_LAUNCH_QUEUE (queue));
+
+        if (!queue->settings_ready &&
+            g_hash_table_contains (queue->needs_settings, gsm_app_peek_app_id (app))) {
+                g_queue_push_tail (&queue->held, g_object_ref (app));
+                return;
+        }
+
+        push_pending (queue, g_object_ref (app));
+}
+
+static gboolean
+system_is_busy (void)
+{
+        double cpu, io;
+
+        /* Without PSI we can't tell, so don't hold anything back */
+        if (!gsm_pressure_read ("cpu", &cpu))
+                cpu = 0.0;
+        if (!gsm_pressure_read ("io", &io))
+                io = 0.0;
+
+        if (cpu < THROTTLE_CPU_PRESSURE && io < THROTTLE_IO_PRESSURE)
+                return FALSE;
+
+        g_debug ("GsmLaunchQueue: system busy (cpu %.1f%%, io %.1f%%), holding launches", cpu, io);
+        return TRUE;
+}
+
+typedef struct {
+        GsmLaunchQueue *queue;
+        char           *app_id;
+} SettleData;
+
+static void
+settle_data_free (SettleData *data)
+{
+        g_free (data->app_id);
+        g_free (data);
+}
+
+static gboolean
+settle_timeout_cb (SettleData *data)
+{
+        GsmLaunchQueue *queue = data->queue;
+        g_autofree char *app_id = NULL;
+
+        g_debug ("GsmLaunchQueue: %s settled", data->app_id);
+
+        /* Removing the entry would remove this source, which is about to
+         * go away anyway */
+        g_hash_table_steal_extended (queue->in_flight, data->app_id,
+                                     (gpointer *) &app_id, NULL);
+        pump (queue);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+launch (GsmLaunchQueue *queue,
+        GsmApp         *app)
+{
+        const char *app_id;
+        SettleData *data;
+        gint64 *launched;
+        guint id;
+
+        app_id = gsm_app_peek_app_id (app);
+
+        launched = g_new (gint64, 1);
+        *launched = g_get_monotonic_time ();
+        g_hash_table_insert (queue->launch_times, g_strdup (app_id), launched);
+
+        if (!queue->start_func (app, queue->user_data)) {
+                g_hash_table_remove (queue->launch_times, app_id);
+                return;
+        }
+
+        data = g_new0 (SettleData, 1);
+        data->queue = queue;
+        data->app_id = g_strdup (app_id);
+        id = g_timeout_add_full (G_PRIORITY_DEFAULT, SETTLE_TIMEOUT_MS,
+                                 (GSourceFunc) settle_timeout_cb,
+                                 data, (GDestroyNotify) settle_data_free);
+        g_hash_table_insert (queue->in_flight, g_strdup (app_id), GUINT_TO_POINTER (id));
+}
+
+static gboolean
+on_throttle_timeout (GsmLaunchQueue *queue)
+{
+        queue->throttle_id = 0;
+        pump (queue);
+
+        return G_SOURCE_REMOVE;
+}
+
+static GsmApp *
+peek_next (GsmLaunchQueue     *queue,
+           GsmLaunchPriority  *priority)
+{
+        for (guint i = 0; i < GSM_LAUNCH_N_PRIORITIES; i++) {
+                if (!g_queue_is_empty (&queue->pending[i])) {
+                        *priority = i;
+                        return g_queue_peek_head (&queue->pending[i]);
+                }
+        }
+
+        return NULL;
+}
+
+/* The run's task holds a reference on us, so it has to be completed
+ * for the queue to go away */
+static GTask *
+steal_task (GsmLaunchQueue *queue)
+{
+        g_cancellable_disconnect (g_task_get_cancellable (queue->task),
+                                  queue->cancelled_id);
+        queue->cancelled_id = 0;
+
+        return g_steal_pointer (&queue->task);
+}
+
+static void
+pump (GsmLaunchQueue *queue)
+{
+        GsmLaunchPriority priority;
+
+        if (queue->task != NULL &&
+            g_cancellable_is_cancelled (g_task_get_cancellable (queue->task))) {
+                g_autoptr(GTask) task = steal_task (queue);
+
+                g_task_return_error_if_cancelled (task);
+                clear_pending (queue);
+                g_clear_handle_id (&queue->throttle_id, g_source_remove);
+                return;
+        }
+
+        if (queue->throttle_id != 0)
+                return;
+
+        while (g_hash_table_size (queue->in_flight) < queue->max_jobs &&
+               peek_next (queue, &priority) != NULL) {
+                g_autoptr(GsmApp) app = NULL;
+
+                if (priority != GSM_LAUNCH_PRIORITY_SESSION && system_is_busy ()) {
+                        gint64 now = g_get_monotonic_time ();
+
+                        if (queue->throttle_deadline == 0)
+                                queue->throttle_deadline = now + THROTTLE_MAX_MS * G_TIME_SPAN_MILLISECOND;
+
+                        if (now < queue->throttle_deadline) {
+                                queue->throttle_id = g_timeout_add (THROTTLE_POLL_MS,
+                                                                    (GSourceFunc) on_throttle_timeout,
+                                                                    queue);
+                                return;
+                        }
+
+                        g_debug ("GsmLaunchQueue: held for too long, launching anyway");
+                }
+
+                app = g_queue_pop_head (&queue->pending[priority]);
+                launch (queue, app);
+        }
+
+        if (queue->task != NULL && peek_next (queue, &priority) == NULL &&
+            g_queue_is_empty (&queue->held)) {
+                g_autoptr(GTask) task = steal_task (queue);
+
+                g_task_return_boolean (task, TRUE);
+        }
+}
+
+static gboolean
+on_cancelled_idle (gpointer user_data)
+{
+        pump (GSM_LAUNCH_QUEUE (user_data));
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Apps held for the settings daemons may mean nothing else calls pump()
+ * again. It can't run from here, as it disconnects this handler. */
+static void
+on_cancelled (GCancellable   *cancellable,
+              GsmLaunchQueue *queue)
+{
+        g_idle_add_full (G_PRIORITY_DEFAULT, on_cancelled_idle,
+                         g_object_ref (queue), g_object_unref);
+}
+
+/**
+ * gsm_launch_queue_run_async:
+ *
+ * Launches the pushed apps in priority order, at most
+ * GNOME_SESSION_AUTOSTART_JOBS at a time. Completes once every app has
+ * been launched, without waiting for them to register; apps held for the
+ * settings daemons are included.
+ */
+void
+gsm_launch_queue_run_async (GsmLaunchQueue      *queue,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+        g_return_if_fail (GSM_IS_LAUNCH_QUEUE (queue));
+        g_return_if_fail (queue->task == NULL);
+
+        queue->task = g_task_new (queue, cancellable, callback, user_data);
+        g_task_set_source_tag (queue->task, gsm_launch_queue_run_async);
+        g_task_set_check_cancellable (queue->task, TRUE);
+        if (cancellable != NULL)
+                queue->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (on_cancelled),
+                                                             queue, NULL);
+        queue->throttle_deadline = 0;
+
+        g_debug ("GsmLaunchQueue: launching %u apps (%u waiting for settings), %u at a time",
+                 g_queue_get_length (&queue->pending[GSM_LAUNCH_PRIORITY_SESSION]) +
+                 g_queue_get_length (&queue->pending[GSM_LAUNCH_PRIORITY_DESKTOP]) +
+                 g_queue_get_length (&queue->pending[GSM_LAUNCH_PRIORITY_APPLICATION]),
+                 g_queue_get_length (&queue->held),
+                 queue->max_jobs);
+
+        pump (queue);
+}
+
+gboolean
+gsm_launch_queue_run_finish (GsmLaunchQueue  *queue,
+                             GAsyncResult    *result,
+                             GError         **error)
+{
+        g_return_val_if_fail (g_task_is_valid (result, queue), FALSE);
+
+        return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gsm_launch_queue_settings_ready:
+ *
+ * Called once the settings daemons are up. Queues the apps that were held
+ * back for them; from now on such apps aren't held anymore.
+ */
+void
+gsm_launch_queue_settings_ready (GsmLaunchQueue *queue)
+{
+        GsmApp *app;
+
+        g_return_if_fail (GSM_IS_LAUNCH_QUEUE (queue));
+
+        if (queue->settings_ready)
+                return;
+        queue->settings_ready = TRUE;
+
+        g_debug ("GsmLaunchQueue: settings ready, releasing %u held apps",
+                 g_queue_get_length (&queue->held));
+
+        while ((app = g_queue_pop_head (&queue->held)) != NULL)
+                push_pending (queue, app);
+
+        if (queue->task != NULL)
+                pump (queue);
+}
+
+/**
+ * gsm_launch_queue_app_registered:
+ *
+ * Called when a client for @app_id registers. Records the time from
+ * launch to registration and frees the app's launch slot early.
+ */
+void
+gsm_launch_queue_app_registered (GsmLaunchQueue *queue,
+                                 const char     *app_id)
+{
+        gint64 *launched;
+        guint latency_ms;
+
+        g_return_if_fail (GSM_IS_LAUNCH_QUEUE (queue));
+
+        if (app_id == NULL)
+                return;
+
+        launched = g_hash_table_lookup (queue->launch_times, app_id);
+        if (launched == NULL)
+                return;
+
+        latency_ms = (guint) ((g_get_monotonic_time () - *launched) / 1000);
+        g_debug ("GsmLaunchQueue: %s registered %u ms after launch", app_id, latency_ms);
+
+        g_hash_table_insert (queue->latencies, g_strdup (app_id), GUINT_TO_POINTER (latency_ms));
+        g_hash_table_remove (queue->launch_times, app_id);
+
+        if (g_hash_table_remove (queue->in_flight, app_id))
+                pump (queue);
+}
+
+/**
+ * gsm_launch_queue_get_latencies:
+ *
+ * Returns: (transfer floating): an a{su} of app id to the milliseconds
+ *   from launch until the app registered a client
+ */
+GVariant *
+gsm_launch_queue_get_latencies (GsmLaunchQueue *queue)
+{
+        GVariantBuilder builder;
+        GHashTableIter iter;
+        const char *app_id;
+        gpointer latency;
+
+        g_return_val_if_fail (GSM_IS_LAUNCH_QUEUE (queue), NULL);
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+
+        g_hash_table_iter_init (&iter, queue->latencies);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &app_id, &latency))
+                g_variant_builder_add (&builder, "{su}", app_id, GPOINTER_TO_UINT (latency));
+
+        return g_variant_builder_end (&builder);
+}
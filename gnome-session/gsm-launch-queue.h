@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GSM_LAUNCH_QUEUE_H__
+#define __GSM_LAUNCH_QUEUE_H__
+
+#include <gio/gio.h>
+
+#include "gsm-app.h"
+
+G_BEGIN_DECLS
+
+/* Launch order, from X-GNOME-Autostart-Phase; lower values go first */
+typedef enum {
+        GSM_LAUNCH_PRIORITY_SESSION,
+        GSM_LAUNCH_PRIORITY_DESKTOP,
+        GSM_LAUNCH_PRIORITY_APPLICATION,
+        GSM_LAUNCH_N_PRIORITIES
+} GsmLaunchPriority;
+
+typedef gboolean (*GsmLaunchQueueStartFunc) (GsmApp   *app,
+                                             gpointer  user_data);
+
+#define GSM_TYPE_LAUNCH_QUEUE (gsm_launch_queue_get_type ())
+G_DECLARE_FINAL_TYPE (GsmLaunchQueue, gsm_launch_queue, GSM, LAUNCH_QUEUE, GObject)
+
+GsmLaunchQueue    *gsm_launch_queue_new                (GsmLaunchQueueStartFunc  start_func,
+                                                        gpointer                 user_data);
+
+GsmLaunchPriority  gsm_launch_queue_priority_from_keyfile (GKeyFile *keyfile);
+gboolean           gsm_launch_queue_needs_settings_from_keyfile (GKeyFile *keyfile);
+GsmLaunchPriority  gsm_launch_queue_read_priority      (const char              *path,
+                                                        gboolean                *needs_settings);
+void               gsm_launch_queue_set_priority       (GsmLaunchQueue          *queue,
+                                                        const char              *app_id,
+                                                        GsmLaunchPriority        priority);
+void               gsm_launch_queue_set_needs_settings (GsmLaunchQueue          *queue,
+                                                        const char              *app_id);
+void               gsm_launch_queue_settings_ready     (GsmLaunchQueue          *queue);
+
+void               gsm_launch_queue_push               (GsmLaunchQueue          *queue,
+                                                        GsmApp                  *app);
+void               gsm_launch_queue_run_async          (GsmLaunchQueue          *queue,
+                                                        GCancellable            *cancellable,
+                                                        GAsyncReadyCallback      callback,
+                                                        gpointer                 user_data);
+gboolean           gsm_launch_queue_run_finish         (GsmLaunchQueue          *queue,
+                                                        GAsyncResult            *result,
+                                                        GError                 **error);
+
+void               gsm_launch_queue_app_registered     (GsmLaunchQueue          *queue,
+                                                        const char              *app_id);
+GVariant *         gsm_launch_queue_get_latencies      (GsmLaunchQueue          *queue);
+
+G_END_DECLS
+
+#endif /* __GSM_LAUNCH_QUEUE_H__ */
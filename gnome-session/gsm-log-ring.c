@@ -0,0 +1,470 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A log handler that keeps the caller off the I/O path: messages are
+ * copied into a fixed ring of records without taking a lock, and a
+ * background thread writes the ones that pass the per-domain level and
+ * rate limit to stdout and syslog. Everything, including debug messages
+ * nobody asked for, stays in the ring and is dumped to
+ * $XDG_STATE_HOME/gnome-session/leader.log on shutdown or crash.
+ *
+ * GNOME_SESSION_DEBUG=1 lowers the default level to debug, and
+ * GNOME_SESSION_LOG_LEVELS=domain=level,... sets it per log domain.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syslog.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "gsm-log-ring.h"
+
+/* A power of two, so slots keep lining up when the tickets wrap */
+#define RING_SIZE        1024
+#define RING_MASK        (RING_SIZE - 1)
+#define DOMAIN_MAX       32
+#define MESSAGE_MAX      256
+
+#define FLUSH_INTERVAL_MS 200
+
+/* At most this many messages per domain and second reach syslog */
+#define RATE_LIMIT_BURST 100
+
+#define DEFAULT_DOMAIN "gnome-session"
+
+typedef struct {
+        /* ticket + 1 once the record is complete, ticket while being written */
+        guint           seq;
+        gint64          time;
+        GLogLevelFlags  level;
+        gboolean        emitted;
+        char            domain[DOMAIN_MAX];
+        char            message[MESSAGE_MAX];
+} LogRecord;
+
+typedef struct {
+        GLogLevelFlags  threshold;
+        gint64          window_start;
+        guint           count;
+        guint           suppressed;
+} DomainState;
+
+G_STATIC_ASSERT ((RING_SIZE & RING_MASK) == 0);
+
+static LogRecord ring[RING_SIZE];
+static guint write_ticket;
+static guint read_ticket;
+static guint lost;
+
+static GThread *flush_thread;
+static GMutex flush_mutex;
+static GCond flush_cond;
+static gboolean flush_wakeup;
+static gboolean flush_stopping;
+
+/* Only touched by the flush thread once it runs */
+static GHashTable *domains;
+static GLogLevelFlags default_threshold = G_LOG_LEVEL_INFO;
+
+static int dump_fd = -1;
+
+static const char *
+level_to_string (GLogLevelFlags level)
+{
+        switch (level & G_LOG_LEVEL_MASK) {
+        case G_LOG_LEVEL_ERROR:
+                return "ERROR";
+        case G_LOG_LEVEL_CRITICAL:
+                return "CRITICAL";
+        case G_LOG_LEVEL_WARNING:
+                return "WARNING";
+        case G_LOG_LEVEL_MESSAGE:
+                return "MESSAGE";
+        case G_LOG_LEVEL_INFO:
+                return "INFO";
+        default:
+                return "DEBUG";
+        }
+}
+
+static int
+level_to_priority (GLogLevelFlags level)
+{
+        switch (level & G_LOG_LEVEL_MASK) {
+        case G_LOG_LEVEL_ERROR:
+                return LOG_ERR;
+        case G_LOG_LEVEL_CRITICAL:
+                return LOG_CRIT;
+        case G_LOG_LEVEL_WARNING:
+                return LOG_WARNING;
+        case G_LOG_LEVEL_MESSAGE:
+                return LOG_NOTICE;
+        case G_LOG_LEVEL_INFO:
+                return LOG_INFO;
+        default:
+                return LOG_DEBUG;
+        }
+}
+
+static GLogLevelFlags
+parse_level (const char *level)
+{
+        if (g_ascii_strcasecmp (level, "error") == 0)
+                return G_LOG_LEVEL_ERROR;
+        if (g_ascii_strcasecmp (level, "critical") == 0)
+                return G_LOG_LEVEL_CRITICAL;
+        if (g_ascii_strcasecmp (level, "warning") == 0)
+                return G_LOG_LEVEL_WARNING;
+        if (g_ascii_strcasecmp (level, "message") == 0)
+                return G_LOG_LEVEL_MESSAGE;
+        if (g_ascii_strcasecmp (level, "info") == 0)
+                return G_LOG_LEVEL_INFO;
+        if (g_ascii_strcasecmp (level, "debug") == 0)
+                return G_LOG_LEVEL_DEBUG;
+
+        return 0;
+}
+
+static DomainState *
+get_domain (const char *domain)
+{
+        DomainState *state;
+
+        state = g_hash_table_lookup (domains, domain);
+        if (state == NULL) {
+                state = g_new0 (DomainState, 1);
+                state->threshold = default_threshold;
+                g_hash_table_insert (domains, g_strdup (domain), state);
+        }
+
+        return state;
+}
+
+static void
+load_levels (void)
+{
+        const char *debug_string;
+        const char *levels;
+        g_auto(GStrv) items = NULL;
+
+        domains = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        debug_string = g_getenv ("GNOME_SESSION_DEBUG");
+        if (debug_string != NULL && atoi (debug_string) == 1)
+                default_threshold = G_LOG_LEVEL_DEBUG;
+
+        levels = g_getenv ("GNOME_SESSION_LOG_LEVELS");
+        if (levels == NULL)
+                return;
+
+        items = g_strsplit (levels, ",", -1);
+        for (guint i = 0; items[i] != NULL; i++) {
+                g_auto(GStrv) pair = g_strsplit (items[i], "=", 2);
+                GLogLevelFlags threshold;
+
+                if (pair[0] == NULL || pair[1] == NULL)
+                        continue;
+
+                threshold = parse_level (g_strstrip (pair[1]));
+                if (threshold == 0)
+                        continue;
+
+                get_domain (g_strstrip (pair[0]))->threshold = threshold;
+        }
+}
+
+static void
+write_out (const LogRecord *record)
+{
+        printf ("%s: %s\n", record->domain, record->message);
+        syslog (level_to_priority (record->level), "%s: %s", record->domain, record->message);
+}
+
+/* Called by the flush thread for each record, in order */
+static void
+emit (const LogRecord *record)
+{
+        DomainState *state;
+
+        if (record->emitted)
+                return;
+
+        state = get_domain (record->domain);
+        if ((record->level & G_LOG_LEVEL_MASK) > state->threshold)
+                return;
+
+        if (record->time - state->window_start >= G_USEC_PER_SEC) {
+                if (state->suppressed > 0) {
+                        syslog (LOG_NOTICE, "%s: %u messages suppressed",
+                                record->domain, state->suppressed);
+                }
+                state->window_start = record->time;
+                state->count = 0;
+                state->suppressed = 0;
+        }
+
+        if (++state->count > RATE_LIMIT_BURST &&
+            (record->level & G_LOG_LEVEL_MASK) > G_LOG_LEVEL_WARNING) {
+                state->suppressed++;
+                return;
+        }
+
+        write_out (record);
+}
+
+static void
+drain (void)
+{
+        guint n_lost;
+
+        for (;;) {
+                LogRecord *slot = &ring[read_ticket & RING_MASK];
+                LogRecord copy;
+                guint seq;
+                gint ahead;
+
+                if (read_ticket == (guint) g_atomic_int_get (&write_ticket))
+                        break;
+
+                /* Compared as a difference, so this still works once the
+                 * tickets wrap */
+                seq = g_atomic_int_get (&slot->seq);
+                ahead = (gint) (seq - (read_ticket + 1));
+                if (ahead < 0)
+                        break; /* still being written */
+
+                if (ahead == 0) {
+                        memcpy (&copy, slot, sizeof (copy));
+                        if (g_atomic_int_get (&slot->seq) == seq)
+                                emit (&copy);
+                        else
+                                g_atomic_int_inc (&lost);
+                } else {
+                        /* overwritten by a writer that lapped us */
+                        g_atomic_int_inc (&lost);
+                }
+
+                g_atomic_int_set (&read_ticket, read_ticket + 1);
+        }
+
+        n_lost = g_atomic_int_and (&lost, 0);
+        if (n_lost > 0)
+                syslog (LOG_NOTICE, "%u log messages lost, the log ring overflowed", n_lost);
+
+        fflush (stdout);
+}
+
+static gpointer
+flush_thread_func (gpointer data)
+{
+        g_mutex_lock (&flush_mutex);
+        while (!flush_stopping) {
+                gint64 end_time;
+
+                end_time = g_get_monotonic_time () + FLUSH_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+                while (!flush_wakeup && !flush_stopping) {
+                        if (!g_cond_wait_until (&flush_cond, &flush_mutex, end_time))
+                                break;
+                }
+                flush_wakeup = FALSE;
+
+                g_mutex_unlock (&flush_mutex);
+                drain ();
+                g_mutex_lock (&flush_mutex);
+        }
+        g_mutex_unlock (&flush_mutex);
+
+        return NULL;
+}
+
+/* Only uses write(2), since this may run in a signal handler */
+static void
+dump_ring (void)
+{
+        guint end;
+
+        if (dump_fd < 0)
+                return;
+
+        end = g_atomic_int_get (&write_ticket);
+        for (guint ticket = end - RING_SIZE; ticket != end; ticket++) {
+                const LogRecord *record = &ring[ticket & RING_MASK];
+                const char *level;
+                guint seq;
+                ssize_t unused;
+
+                /* 0 is a slot that was never written */
+                seq = g_atomic_int_get (&record->seq);
+                if (seq == 0 || seq != ticket + 1)
+                        continue;
+
+                level = level_to_string (record->level);
+                unused = write (dump_fd, level, strlen (level));
+                unused = write (dump_fd, " ", 1);
+                unused = write (dump_fd, record->domain, strnlen (record->domain, DOMAIN_MAX));
+                unused = write (dump_fd, ": ", 2);
+                unused = write (dump_fd, record->message, strnlen (record->message, MESSAGE_MAX));
+                unused = write (dump_fd, "\n", 1);
+                (void) unused;
+        }
+}
+
+static void
+crash_handler (int signum)
+{
+        static const char header[] = "--- crashed, last messages follow ---\n";
+        ssize_t unused;
+
+        if (dump_fd >= 0) {
+                unused = write (dump_fd, header, sizeof (header) - 1);
+                (void) unused;
+        }
+        dump_ring ();
+
+        signal (signum, SIG_DFL);
+        raise (signum);
+}
+
+static void
+open_dump_file (void)
+{
+        g_autofree char *dir = NULL;
+        g_autofree char *path = NULL;
+        g_autofree char *old_path = NULL;
+
+        dir = g_build_filename (g_get_user_state_dir (), "gnome-session", NULL);
+        if (g_mkdir_with_parents (dir, 0700) < 0)
+                return;
+
+        path = g_build_filename (dir, "leader.log", NULL);
+        old_path = g_build_filename (dir, "leader.log.old", NULL);
+
+        /* keep the previous login's log around, it may be a crash */
+        g_rename (path, old_path);
+
+        dump_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+}
+
+static void
+log_handler (const char     *log_domain,
+             GLogLevelFlags  log_level,
+             const char     *message,
+             gpointer        user_data)
+{
+        LogRecord *slot;
+        guint ticket;
+
+        ticket = g_atomic_int_add (&write_ticket, 1);
+        slot = &ring[ticket & RING_MASK];
+
+        g_atomic_int_set (&slot->seq, ticket);
+        slot->time = g_get_monotonic_time ();
+        slot->level = log_level;
+        slot->emitted = FALSE;
+        g_strlcpy (slot->domain, log_domain != NULL ? log_domain : DEFAULT_DOMAIN, DOMAIN_MAX);
+        g_strlcpy (slot->message, message, MESSAGE_MAX);
+
+        /* We are about to abort, nothing will flush this for us */
+        if (log_level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_ERROR)) {
+                write_out (slot);
+                slot->emitted = TRUE;
+        }
+
+        g_atomic_int_set (&slot->seq, ticket + 1);
+
+        if ((log_level & G_LOG_LEVEL_MASK) <= G_LOG_LEVEL_WARNING && flush_thread != NULL) {
+                g_mutex_lock (&flush_mutex);
+                flush_wakeup = TRUE;
+                g_cond_signal (&flush_cond);
+                g_mutex_unlock (&flush_mutex);
+        }
+}
+
+/**
+ * gsm_log_ring_init:
+ * @ident: the syslog identifier
+ *
+ * Routes all GLib logging through the ring. Debug messages are always
+ * recorded, so g_log_set_debug_enabled() is turned on. The ring is shut
+ * down when the process exits, whichever way it does.
+ */
+void
+gsm_log_ring_init (const char *ident)
+{
+        struct sigaction sa = { 0 };
+
+        openlog (ident, LOG_PID, LOG_USER);
+        load_levels ();
+        open_dump_file ();
+
+        sa.sa_handler = crash_handler;
+        sigemptyset (&sa.sa_mask);
+        sa.sa_flags = SA_RESETHAND;
+        sigaction (SIGSEGV, &sa, NULL);
+        sigaction (SIGBUS, &sa, NULL);
+        sigaction (SIGILL, &sa, NULL);
+        sigaction (SIGFPE, &sa, NULL);
+        sigaction (SIGABRT, &sa, NULL);
+
+        g_log_set_default_handler (log_handler, NULL);
+        g_log_set_debug_enabled (TRUE);
+
+        flush_thread = g_thread_new ("log-flush", flush_thread_func, NULL);
+        atexit (gsm_log_ring_shutdown);
+}
+
+/**
+ * gsm_log_ring_shutdown:
+ *
+ * Writes out what is still pending and dumps the whole ring to the log
+ * file.
+ */
+void
+gsm_log_ring_shutdown (void)
+{
+        if (flush_thread == NULL)
+                return;
+
+        g_mutex_lock (&flush_mutex);
+        flush_stopping = TRUE;
+        g_cond_signal (&flush_cond);
+        g_mutex_unlock (&flush_mutex);
+
+        g_clear_pointer (&flush_thread, g_thread_join);
+
+        g_log_set_default_handler (g_log_default_handler, NULL);
+
+        drain ();
+        dump_ring ();
+
+        if (dump_fd >= 0) {
+                close (dump_fd);
+                dump_fd = -1;
+        }
+
+        g_clear_pointer (&domains, g_hash_table_unref);
+        closelog ();
+}
@@ -43,6 +43,8 @@
 
 #include "gsm-manager.h"
 #include "org.gnome.SessionManager.h"
+#include "org.gnome.SessionManager.Diagnostics.h"
+#include "org.gnome.SessionManager.Startup.h"
 
 #include <systemd/sd-journal.h>
 
@@ -50,8 +52,15 @@
 
 #include "gsm-app.h"
 #include "gsm-client.h"
+#include "gsm-autostart-cache.h"
 #include "gsm-inhibitor.h"
+#include "gsm-latency-history.h"
+#include "gsm-launch-queue.h"
+#ifdef USE_OPENRC
+#include "gsm-openrc.h"
+#endif
 #include "gsm-presence.h"
+#include "gsm-pressure.h"
 #include "gsm-session-save.h"
 #include "gsm-shell.h"
 #include "gsm-store.h"
@@ -72,6 +81,28 @@
 #define KEY_DISABLE_LOG_OUT       "disable-log-out"
 #define KEY_DISABLE_USER_SWITCHING "disable-user-switching"
 
+/* Deadlines for clients to answer QueryEndSession and EndSession. Clients
+ * we know nothing about get the default; for the others we allow their
+ * p99 reply time from earlier logouts plus a margin, within the bounds.
+ * The defaults are also the maximum, so we never wait longer than we
+ * used to. */
+#define QUERY_END_SESSION_TIMEOUT_DEFAULT 1000
+#define QUERY_END_SESSION_TIMEOUT_MIN     250
+#define QUERY_END_SESSION_TIMEOUT_MAX     QUERY_END_SESSION_TIMEOUT_DEFAULT
+#define END_SESSION_TIMEOUT_DEFAULT       10000
+#define END_SESSION_TIMEOUT_MIN           500
+#define END_SESSION_TIMEOUT_MAX           END_SESSION_TIMEOUT_DEFAULT
+#define END_SESSION_TIMEOUT_MARGIN        250
+
+/* A forced logout doesn't wait for EndSession replies beyond this */
+#define FORCED_LOGOUT_GRACE_MS            100
+
+/* How long autostart apps needing the settings daemons wait for them */
+#define SETTINGS_READY_TIMEOUT_SECONDS 30
+
+/* Overall bound on reboot/shutdown, from query-end-session to exit */
+#define SHUTDOWN_PIPELINE_TIMEOUT_SECONDS 15
+
 typedef enum
 {
         GSM_MANAGER_LOGOUT_NONE,
@@ -80,15 +111,47 @@ typedef enum
         GSM_MANAGER_LOGOUT_SHUTDOWN,
 } GsmManagerLogoutType;
 
+/* What a reboot or shutdown waits for before we exit; they run side by
+ * side */
+typedef enum
+{
+        SHUTDOWN_LEG_PREPARE,   /* logind taking its delay inhibitor */
+        SHUTDOWN_LEG_CLIENTS,   /* the end-session phase */
+        SHUTDOWN_LEG_SERVICES,  /* stopping the session services */
+        SHUTDOWN_N_LEGS
+} ShutdownLeg;
+
+static const char *shutdown_leg_names[SHUTDOWN_N_LEGS] = {
+        "prepare", "clients", "services"
+};
+
 struct _GsmManager
 {
         GObject                 parent;
 
         gboolean                systemd_initialized;
         GsmStore               *clients;
+        GHashTable             *clients_by_bus_name;
+        GHashTable             *client_bus_names;
         GsmStore               *inhibitors;
         GsmInhibitorFlag        inhibited_actions;
+        /* Indexes over the inhibitors store, kept in sync by the store's
+         * added/removed handlers */
+        GHashTable             *inhibitors_by_id;
+        GHashTable             *inhibitors_by_cookie;
+        GHashTable             *inhibitors_by_client_id;
+        guint                   inhibitor_flag_counts[32];
+        /* While non-zero, inhibitor changes only mark the derived state
+         * dirty; it is recomputed once when the count drops back to 0 */
+        guint                   state_freeze_count;
+        gboolean                inhibitors_changed : 1;
+        gboolean                inhibitors_removed : 1;
         GsmStore               *apps;
+        GsmAutostartCache      *autostart_cache;
+        GsmLaunchQueue         *launch_queue;
+        GCancellable           *launch_cancellable;
+        guint                   settings_timeout_id;
+        gboolean                settings_ready : 1;
         GsmPresence            *presence;
         GsmSessionSave         *session_save;
         char                   *session_name;
@@ -97,9 +160,20 @@ struct _GsmManager
         GsmManagerPhase         phase;
         guint                   phase_timeout_id;
         GsmManagerLogoutMode    logout_mode;
-        GSList                 *query_clients;
+        /* Clients we are waiting on for an end-session reply, mapped to
+         * the monotonic time the request was sent */
+        GHashTable             *query_clients;
+        GsmLatencyHistory      *latency_history;
         /* This is the action that will be done just before we exit */
         GsmManagerLogoutType    logout_type;
+        /* Forced logout that skipped the query-end-session phase */
+        gboolean                fast_logout : 1;
+        /* Reboot or shutdown waiting on the legs still at 0 in
+         * shutdown_leg_done, which are monotonic times */
+        gboolean                shutdown_pipelined : 1;
+        gint64                  shutdown_started;
+        gint64                  shutdown_leg_done[SHUTDOWN_N_LEGS];
+        guint                   shutdown_timeout_id;
 
         GSList                 *pending_end_session_tasks;
         GCancellable           *end_session_cancellable;
@@ -111,7 +185,17 @@ struct _GsmManager
         GsmSystem              *system;
         GDBusConnection        *connection;
         GsmExportedManager     *skeleton;
+        GsmExportedDiagnostics *diagnostics;
+        GsmExportedStartup     *startup;
         gboolean                dbus_disconnected : 1;
+#ifdef USE_OPENRC
+        /* session-services.conf, how each session service gets started */
+        GKeyFile               *session_services;
+        guint                   deferred_id;
+        gint64                  deferred_wait_start;
+        gint64                  deferred_idle_since;
+        gboolean                deferred_started : 1;
+#endif
 
         GsmShell               *shell;
         gulong                  shell_end_session_dialog_canceled_id;
@@ -130,6 +214,8 @@ static void     gsm_manager_class_init  (GsmManagerClass *klass);
 static void     gsm_manager_init        (GsmManager      *manager);
 
 static gboolean _log_out_is_locked_down     (GsmManager *manager);
+static void     freeze_state_updates        (GsmManager *manager);
+static void     thaw_state_updates          (GsmManager *manager);
 
 static void     on_client_end_session_response (GsmClient  *client,
                                                 gboolean    is_ok,
@@ -138,6 +224,7 @@ static void     on_client_end_session_response (GsmClient  *client,
 
 static void     show_shell_end_session_dialog (GsmManager                   *manager,
                                                GsmShellEndSessionDialogType  type);
+static void     disconnect_shell_dialog_signals (GsmManager *manager);
 static gpointer manager_object = NULL;
 
 G_DEFINE_TYPE (GsmManager, gsm_manager, G_TYPE_OBJECT)
@@ -165,36 +252,206 @@ gsm_manager_error_quark (void)
 }
 
 #ifdef USE_OPENRC
-static gboolean
-async_run_cmd(gchar** argv, GError **error)
+static void
+on_openrc_action_done (GObject      *source_object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+        g_autoptr(GError) error = NULL;
+
+        if (!gsm_openrc_services_action_finish (result, &error))
+                g_warning ("GsmManager: OpenRC service action failed: %s", error->message);
+}
+
+/* Kills the session services right away rather than waiting for the
+ * gnome-session-shutdown service we start on the way out. Our own service
+ * is left for that, so its supervisor doesn't restart us meanwhile. */
+static void
+kill_session_services (void)
+{
+        char *argv[] = { LIBEXECDIR "/gnome-session-ctl", "--shutdown", "--force", NULL, NULL, NULL };
+        const char *service = g_getenv ("RC_SVCNAME");
+        g_autoptr(GError) error = NULL;
+
+        if (service != NULL) {
+                argv[3] = "--keep";
+                argv[4] = (char *) service;
+        }
+
+        g_debug ("GsmManager: killing the session services");
+        if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_DEFAULT, NULL, NULL, NULL, &error))
+                g_warning ("GsmManager: failed to kill the session services: %s", error->message);
+}
+
+/* supervise-daemon would start us again if we just exited, so have
+ * OpenRC stop our service instead. The supervisor SIGTERMs us, removes its
+ * pidfile and the service is marked stopped once we're gone. Only our own
+ * service is stopped; the session teardown deals with the rest. */
+static void
+on_own_service_stopped (GPid     pid,
+                        gint     status,
+                        gpointer user_data)
 {
-        return g_spawn_async(NULL,
-                             argv,
-                             NULL,
-                             G_SPAWN_DEFAULT,
-                             NULL,
-                             NULL,
-                             NULL,
-                             error);
+        g_spawn_close_pid (pid);
+        gsm_quit ();
 }
 
 static gboolean
-openrc_unit_action (const char       *unit,
-                    const char       *action,
-                    GError          **error)
+stop_own_service (void)
 {
-        g_autofree char *service = rc_service_resolve(unit);
-        if (!service)
-        {
-                g_debug("Couldn't resolve service '%s'", unit);
+        const char *service = g_getenv ("RC_SVCNAME");
+        char *argv[] = { NULL, "-U", "--nodeps", "stop", NULL };
+        g_autoptr(GError) error = NULL;
+        gboolean ret;
+        GPid pid;
+
+        if (service == NULL)
+                return FALSE;
+
+        argv[0] = rc_service_resolve (service);
+        if (argv[0] == NULL)
                 return FALSE;
+
+        g_debug ("GsmManager: stopping %s", service);
+        ret = g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                             NULL, NULL, &pid, &error);
+        if (ret)
+                g_child_watch_add (pid, on_own_service_stopped, NULL);
+        else
+                g_warning ("GsmManager: failed to stop %s: %s", service, error->message);
+        free (argv[0]);
+
+        return ret;
+}
+#endif
+
+#ifdef USE_OPENRC
+static GKeyFile *
+load_session_services (void)
+{
+        g_autoptr(GError) error = NULL;
+        GKeyFile *keyfile;
+
+        keyfile = g_key_file_new ();
+        if (!g_key_file_load_from_file (keyfile, DATA_DIR "/session-services.conf",
+                                        G_KEY_FILE_NONE, &error))
+                g_warning ("GsmManager: failed to load session services: %s", error->message);
+
+        return keyfile;
+}
+
+/* Class=deferred services are started once the session is running and
+ * the system has been quiet for DEFERRED_IDLE_MS in a row: CPU and IO
+ * pressure below these, or without PSI, the load average. If it never
+ * quiets down they are started after DEFERRED_MAX_WAIT_MS anyway. */
+#define DEFERRED_CPU_PRESSURE 10.0
+#define DEFERRED_IO_PRESSURE  10.0
+#define DEFERRED_LOAD_PER_CPU 0.5
+#define DEFERRED_POLL_MS      500
+#define DEFERRED_IDLE_MS      3000
+#define DEFERRED_MAX_WAIT_MS  60000
+
+static gboolean
+system_is_idle (void)
+{
+        double cpu, io, load;
+
+        if (gsm_pressure_read ("cpu", &cpu)) {
+                if (!gsm_pressure_read ("io", &io))
+                        io = 0.0;
+                return cpu < DEFERRED_CPU_PRESSURE && io < DEFERRED_IO_PRESSURE;
         }
-        gchar *argv[] = { service, "-U", action, NULL };
-        gboolean res = async_run_cmd(argv, error);
-        return res;
+
+        if (gsm_pressure_read_load (&load))
+                return load < DEFERRED_LOAD_PER_CPU;
+
+        return TRUE;
+}
+
+static void
+start_deferred_services (GsmManager *manager)
+{
+        g_autoptr(GPtrArray) services = NULL;
+        g_auto(GStrv) groups = NULL;
+
+        manager->deferred_started = TRUE;
+
+        services = g_ptr_array_new_with_free_func (g_free);
+        groups = g_key_file_get_groups (manager->session_services, NULL);
+        for (guint i = 0; groups[i] != NULL; i++) {
+                g_autofree char *class = NULL;
+
+                class = g_key_file_get_string (manager->session_services, groups[i], "Class", NULL);
+                if (g_strcmp0 (class, "deferred") != 0)
+                        continue;
+
+                gsm_openrc_trace (GSM_OPENRC_TRACE_REQUEST, groups[i], "deferred");
+                g_ptr_array_add (services, g_strdup (groups[i]));
+        }
+
+        if (services->len == 0)
+                return;
+
+        g_debug ("GsmManager: starting %u deferred services", services->len);
+        g_ptr_array_add (services, NULL);
+        gsm_openrc_services_action_async ((const char * const *) services->pdata, "start", NULL,
+                                          on_openrc_action_done, NULL);
+}
+
+static gboolean
+on_deferred_poll (gpointer user_data)
+{
+        GsmManager *manager = user_data;
+        gint64 now;
+
+        /* Logging out; try again if that gets cancelled */
+        if (manager->phase != GSM_MANAGER_PHASE_RUNNING) {
+                manager->deferred_id = 0;
+                return G_SOURCE_REMOVE;
+        }
+
+        now = g_get_monotonic_time ();
+
+        if (system_is_idle ()) {
+                if (manager->deferred_idle_since == 0)
+                        manager->deferred_idle_since = now;
+                if (now - manager->deferred_idle_since < DEFERRED_IDLE_MS * 1000)
+                        return G_SOURCE_CONTINUE;
+        } else {
+                manager->deferred_idle_since = 0;
+                if (now - manager->deferred_wait_start < DEFERRED_MAX_WAIT_MS * 1000)
+                        return G_SOURCE_CONTINUE;
+                g_debug ("GsmManager: system still busy, starting deferred services anyway");
+        }
+
+        manager->deferred_id = 0;
+        start_deferred_services (manager);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_deferred_services (GsmManager *manager)
+{
+        if (manager->deferred_started || manager->deferred_id != 0)
+                return;
+
+        manager->deferred_wait_start = g_get_monotonic_time ();
+        manager->deferred_idle_since = 0;
+        manager->deferred_id = g_timeout_add (DEFERRED_POLL_MS, on_deferred_poll, manager);
 }
 #endif
 
+static void
+notify_service_manager (const char *state)
+{
+#ifdef USE_OPENRC
+        gsm_openrc_notify (state);
+#else
+        sd_notify (0, state);
+#endif
+}
+
 static gboolean
 start_app_or_warn (GsmManager *manager,
                    GsmApp     *app)
@@ -209,9 +466,20 @@ start_app_or_warn (GsmManager *manager,
                 g_warning ("Failed to start app: %s", error->message);
                 g_clear_error (&error);
         }
+#ifdef USE_OPENRC
+        gsm_openrc_trace (res ? GSM_OPENRC_TRACE_START : GSM_OPENRC_TRACE_FAIL,
+                          gsm_app_peek_app_id (app), NULL);
+#endif
         return res;
 }
 
+static gboolean
+launch_queue_start_app (GsmApp   *app,
+                        gpointer  user_data)
+{
+        return start_app_or_warn (GSM_MANAGER (user_data), app);
+}
+
 static gboolean
 _debug_client (const char *id,
                GsmClient  *client,
@@ -229,16 +497,132 @@ debug_clients (GsmManager *manager)
                            manager);
 }
 
+static void
+index_inhibitor (GsmManager   *manager,
+                 GsmInhibitor *inhibitor)
+{
+        const char *id;
+        const char *client_id;
+        GsmInhibitorFlag flags;
+
+        id = gsm_inhibitor_peek_id (inhibitor);
+
+        g_hash_table_insert (manager->inhibitors_by_id,
+                             g_strdup (id), g_object_ref (inhibitor));
+        g_hash_table_insert (manager->inhibitors_by_cookie,
+                             GUINT_TO_POINTER (gsm_inhibitor_peek_cookie (inhibitor)),
+                             inhibitor);
+
+        flags = gsm_inhibitor_peek_flags (inhibitor);
+        for (guint i = 0; i < G_N_ELEMENTS (manager->inhibitor_flag_counts); i++) {
+                if (flags & (1u << i))
+                        manager->inhibitor_flag_counts[i]++;
+        }
+
+        client_id = gsm_inhibitor_peek_client_id (inhibitor);
+        if (! IS_STRING_EMPTY (client_id)) {
+                GHashTable *ids;
+
+                ids = g_hash_table_lookup (manager->inhibitors_by_client_id, client_id);
+                if (ids == NULL) {
+                        ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+                        g_hash_table_insert (manager->inhibitors_by_client_id,
+                                             g_strdup (client_id), ids);
+                }
+                g_hash_table_add (ids, g_strdup (id));
+        }
+}
+
+static void
+unindex_inhibitor (GsmManager *manager,
+                   const char *id)
+{
+        GsmInhibitor *inhibitor;
+        const char *client_id;
+        GsmInhibitorFlag flags;
+        guint cookie;
+
+        inhibitor = g_hash_table_lookup (manager->inhibitors_by_id, id);
+        if (inhibitor == NULL)
+                return;
+
+        cookie = gsm_inhibitor_peek_cookie (inhibitor);
+        if (g_hash_table_lookup (manager->inhibitors_by_cookie, GUINT_TO_POINTER (cookie)) == inhibitor)
+                g_hash_table_remove (manager->inhibitors_by_cookie, GUINT_TO_POINTER (cookie));
+
+        flags = gsm_inhibitor_peek_flags (inhibitor);
+        for (guint i = 0; i < G_N_ELEMENTS (manager->inhibitor_flag_counts); i++) {
+                if ((flags & (1u << i)) && manager->inhibitor_flag_counts[i] > 0)
+                        manager->inhibitor_flag_counts[i]--;
+        }
+
+        client_id = gsm_inhibitor_peek_client_id (inhibitor);
+        if (! IS_STRING_EMPTY (client_id)) {
+                GHashTable *ids;
+
+                ids = g_hash_table_lookup (manager->inhibitors_by_client_id, client_id);
+                if (ids != NULL) {
+                        g_hash_table_remove (ids, id);
+                        if (g_hash_table_size (ids) == 0)
+                                g_hash_table_remove (manager->inhibitors_by_client_id, client_id);
+                }
+        }
+
+        /* drops the last index reference, so do this last */
+        g_hash_table_remove (manager->inhibitors_by_id, id);
+}
+
+static GsmInhibitorFlag
+get_inhibited_flags (GsmManager *manager)
+{
+        GsmInhibitorFlag flags = 0;
+
+        for (guint i = 0; i < G_N_ELEMENTS (manager->inhibitor_flag_counts); i++) {
+                if (manager->inhibitor_flag_counts[i] > 0)
+                        flags |= (1u << i);
+        }
+
+        return flags;
+}
+
 static gboolean
-_find_by_cookie (const char   *id,
-                 GsmInhibitor *inhibitor,
-                 guint        *cookie_ap)
+has_inhibitor_with_flags (GsmManager       *manager,
+                          GsmInhibitorFlag  flags)
 {
-        guint cookie_b;
+        return (get_inhibited_flags (manager) & flags) != 0;
+}
 
-        cookie_b = gsm_inhibitor_peek_cookie (inhibitor);
+static void
+remove_inhibitors_for_client (GsmManager *manager,
+                              const char *client_id)
+{
+        g_autoptr(GHashTable) ids = NULL;
+        g_autofree char *key = NULL;
+        GHashTableIter iter;
+        const char *id;
 
-        return (*cookie_ap == cookie_b);
+        if (IS_STRING_EMPTY (client_id))
+                return;
+
+        /* Take the set out of the index first: removing from the store
+         * re-enters unindex_inhibitor() for each entry. */
+        if (! g_hash_table_steal_extended (manager->inhibitors_by_client_id, client_id,
+                                           (gpointer *) &key, (gpointer *) &ids))
+                return;
+
+        g_hash_table_iter_init (&iter, ids);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL)) {
+                GsmInhibitor *inhibitor;
+
+                inhibitor = g_hash_table_lookup (manager->inhibitors_by_id, id);
+                if (inhibitor != NULL) {
+                        g_debug ("GsmManager: removing JIT inhibitor for %s for reason '%s'",
+                                 client_id,
+                                 gsm_inhibitor_peek_reason (inhibitor));
+                }
+
+                gsm_store_remove (manager->inhibitors, id);
+        }
 }
 
 static const char *
@@ -270,23 +654,135 @@ gsm_manager_quit (GsmManager *manager)
         switch (manager->logout_type) {
         case GSM_MANAGER_LOGOUT_LOGOUT:
         case GSM_MANAGER_LOGOUT_NONE:
-                gsm_quit ();
                 break;
         case GSM_MANAGER_LOGOUT_REBOOT:
                 gsm_system_complete_shutdown (manager->system);
-                gsm_quit ();
                 break;
         case GSM_MANAGER_LOGOUT_SHUTDOWN:
                 gsm_system_complete_shutdown (manager->system);
-                gsm_quit ();
                 break;
         default:
                 g_assert_not_reached ();
                 break;
         }
+
+#ifdef USE_OPENRC
+        /* We quit on the SIGTERM from our supervisor, or once the stop
+         * is done if nothing was supervising us */
+        if (stop_own_service ())
+                return;
+#endif
+
+        gsm_quit ();
 }
 
 static gboolean do_query_end_session_exit (GsmManager *manager);
+static gboolean shutdown_leg_done (GsmManager  *manager,
+                                   ShutdownLeg  leg);
+
+static void
+add_query_client (GsmManager *manager,
+                  GsmClient  *client)
+{
+        gint64 *requested;
+
+        requested = g_new (gint64, 1);
+        *requested = g_get_monotonic_time ();
+        g_hash_table_insert (manager->query_clients, client, requested);
+}
+
+static GsmLatencyKind
+current_latency_kind (GsmManager *manager)
+{
+        if (manager->phase == GSM_MANAGER_PHASE_QUERY_END_SESSION)
+                return GSM_LATENCY_QUERY_END_SESSION;
+        return GSM_LATENCY_END_SESSION;
+}
+
+/* Only for real replies: a timeout says nothing about how long the client
+ * takes, and would just push its next deadline up. */
+static void
+record_end_session_latency (GsmManager *manager,
+                            GsmClient  *client,
+                            gint64      requested)
+{
+        gsm_latency_history_record (manager->latency_history,
+                                    gsm_client_peek_app_id (client),
+                                    current_latency_kind (manager),
+                                    (guint) ((g_get_monotonic_time () - requested) / 1000));
+}
+
+static gboolean
+remove_query_client (GsmManager *manager,
+                     GsmClient  *client)
+{
+        gint64 *requested;
+
+        requested = g_hash_table_lookup (manager->query_clients, client);
+        if (requested == NULL)
+                return FALSE;
+
+        record_end_session_latency (manager, client, *requested);
+        g_hash_table_remove (manager->query_clients, client);
+
+        return TRUE;
+}
+
+static guint
+get_end_session_deadline (GsmManager *manager)
+{
+        GsmLatencyKind kind;
+        GHashTableIter iter;
+        GsmClient *client;
+        guint default_ms, min_ms, max_ms;
+        guint deadline = 0;
+
+        kind = current_latency_kind (manager);
+        if (kind == GSM_LATENCY_QUERY_END_SESSION) {
+                default_ms = QUERY_END_SESSION_TIMEOUT_DEFAULT;
+                min_ms = QUERY_END_SESSION_TIMEOUT_MIN;
+                max_ms = QUERY_END_SESSION_TIMEOUT_MAX;
+        } else {
+                default_ms = END_SESSION_TIMEOUT_DEFAULT;
+                min_ms = END_SESSION_TIMEOUT_MIN;
+                max_ms = END_SESSION_TIMEOUT_MAX;
+        }
+
+        g_hash_table_iter_init (&iter, manager->query_clients);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &client, NULL)) {
+                guint p99;
+                guint client_deadline;
+
+                if (gsm_latency_history_get_p99 (manager->latency_history,
+                                                 gsm_client_peek_app_id (client),
+                                                 kind, &p99))
+                        client_deadline = p99 + p99 / 4 + END_SESSION_TIMEOUT_MARGIN;
+                else
+                        client_deadline = default_ms;
+
+                deadline = MAX (deadline, client_deadline);
+        }
+
+        deadline = CLAMP (deadline, min_ms, max_ms);
+
+        if (kind == GSM_LATENCY_QUERY_END_SESSION)
+                gsm_exported_diagnostics_set_query_end_session_timeout (manager->diagnostics, deadline);
+        else
+                gsm_exported_diagnostics_set_end_session_timeout (manager->diagnostics, deadline);
+
+        g_debug ("GsmManager: giving %u clients %u ms to reply",
+                 g_hash_table_size (manager->query_clients), deadline);
+
+        return deadline;
+}
+
+static void
+save_latency_history (GsmManager *manager)
+{
+        gsm_latency_history_save (manager->latency_history);
+        gsm_exported_diagnostics_set_client_latencies (manager->diagnostics,
+                                                       gsm_latency_history_to_variant (manager->latency_history));
+}
 
 static void
 end_phase (GsmManager *manager)
@@ -296,8 +792,7 @@ end_phase (GsmManager *manager)
         g_debug ("GsmManager: ending phase %s",
                  phase_num_to_name (manager->phase));
 
-        g_slist_free (manager->query_clients);
-        manager->query_clients = NULL;
+        g_hash_table_remove_all (manager->query_clients);
 
         g_clear_handle_id (&manager->phase_timeout_id, g_source_remove);
 
@@ -312,10 +807,15 @@ end_phase (GsmManager *manager)
                 }
                 break;
         case GSM_MANAGER_PHASE_QUERY_END_SESSION:
+                save_latency_history (manager);
                 if (!do_query_end_session_exit (manager))
                         start_next_phase = FALSE;
                 break;
         case GSM_MANAGER_PHASE_END_SESSION:
+                save_latency_history (manager);
+                if (manager->shutdown_pipelined &&
+                    !shutdown_leg_done (manager, SHUTDOWN_LEG_CLIENTS))
+                        start_next_phase = FALSE;
                 break;
         case GSM_MANAGER_PHASE_EXIT:
                 start_next_phase = FALSE;
@@ -342,24 +842,86 @@ _start_app (const char *id,
                 goto out;
         }
 
-        if (!start_app_or_warn (manager, app))
-                goto out;
+        gsm_launch_queue_push (manager->launch_queue, app);
 
  out:
         return FALSE;
 }
 
+static void
+on_autostart_apps_launched (GObject      *source,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+        GsmManager *manager = user_data;
+        g_autoptr(GError) error = NULL;
+
+        if (!gsm_launch_queue_run_finish (GSM_LAUNCH_QUEUE (source), result, &error)) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        return;
+                g_warning ("Failed to launch autostart apps: %s", error->message);
+        }
+
+        end_phase (manager);
+}
+
+static void
+settings_ready (GsmManager *manager)
+{
+        if (manager->settings_ready)
+                return;
+        manager->settings_ready = TRUE;
+
+        g_clear_handle_id (&manager->settings_timeout_id, g_source_remove);
+        gsm_launch_queue_settings_ready (manager->launch_queue);
+}
+
+static gboolean
+on_settings_ready_timeout (gpointer user_data)
+{
+        GsmManager *manager = user_data;
+
+        manager->settings_timeout_id = 0;
+
+        g_warning ("GsmManager: settings daemons not reported up after %d seconds, starting the apps waiting for them",
+                   SETTINGS_READY_TIMEOUT_SECONDS);
+        settings_ready (manager);
+
+        return G_SOURCE_REMOVE;
+}
+
 static void
 do_phase_startup (GsmManager *manager)
 {
-        if (manager->session_save && gsm_session_save_restore (manager->session_save))
+        if (manager->session_save && gsm_session_save_restore (manager->session_save)) {
                 g_info ("Restored from save, skipping normal autostart apps.");
-        else
-                gsm_store_foreach (manager->apps,
-                                   (GsmStoreFunc)_start_app,
-                                   manager);
+                end_phase (manager);
+                return;
+        }
 
-        end_phase (manager);
+        /* everything has been added by now */
+        if (manager->autostart_cache != NULL) {
+                gsm_autostart_cache_save (manager->autostart_cache);
+                g_clear_object (&manager->autostart_cache);
+        }
+
+        gsm_store_foreach (manager->apps,
+                           (GsmStoreFunc)_start_app,
+                           manager);
+
+        /* Apps that need the settings daemons wait for the leader to tell us
+         * they're up, but not forever */
+        if (!manager->settings_ready)
+                manager->settings_timeout_id = g_timeout_add_seconds (SETTINGS_READY_TIMEOUT_SECONDS,
+                                                                      on_settings_ready_timeout,
+                                                                      manager);
+
+        /* the phase ends once every app has been launched; they are paced
+         * so the burst doesn't starve the shell */
+        gsm_launch_queue_run_async (manager->launch_queue,
+                                    manager->launch_cancellable,
+                                    on_autostart_apps_launched,
+                                    manager);
 }
 
 typedef struct {
@@ -388,7 +950,7 @@ _client_end_session (const char           *id,
                 /* FIXME: what should we do if we can't communicate with client? */
         } else {
                 g_debug ("GsmManager: adding client to end-session clients: %s", gsm_client_peek_id (client));
-                data->manager->query_clients = g_slist_prepend (data->manager->query_clients, client);
+                add_query_client (data->manager, client);
         }
 
         return FALSE;
@@ -415,17 +977,33 @@ complete_end_session_tasks (GsmManager *manager)
 static gboolean
 on_end_session_timeout (GsmManager *manager)
 {
+        GHashTableIter iter;
+        GsmClient *client;
+
         manager->phase_timeout_id = 0;
 
-        for (GSList *l = manager->query_clients; l != NULL; l = l->next) {
+        g_hash_table_iter_init (&iter, manager->query_clients);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &client, NULL)) {
                 g_warning ("Client '%s' failed to reply before timeout",
-                           gsm_client_peek_id (l->data));
+                           gsm_client_peek_id (client));
         }
 
         end_phase (manager);
         return FALSE;
 }
 
+static gboolean
+on_forced_end_session_timeout (GsmManager *manager)
+{
+        manager->phase_timeout_id = 0;
+
+        g_debug ("GsmManager: not waiting for %u clients in forced logout",
+                 g_hash_table_size (manager->query_clients));
+
+        end_phase (manager);
+        return FALSE;
+}
+
 static void
 do_phase_end_session (GsmManager *manager)
 {
@@ -443,13 +1021,18 @@ do_phase_end_session (GsmManager *manager)
         g_clear_handle_id (&manager->phase_timeout_id, g_source_remove);
 
         if (gsm_store_size (manager->clients) > 0) {
-                manager->phase_timeout_id = g_timeout_add_seconds (10,
-                                                                   (GSourceFunc)on_end_session_timeout,
-                                                                   manager);
-
                 gsm_store_foreach (manager->clients,
                                    (GsmStoreFunc)_client_end_session,
                                    &data);
+
+                if (manager->fast_logout)
+                        manager->phase_timeout_id = g_timeout_add (FORCED_LOGOUT_GRACE_MS,
+                                                                   (GSourceFunc)on_forced_end_session_timeout,
+                                                                   manager);
+                else
+                        manager->phase_timeout_id = g_timeout_add (get_end_session_deadline (manager),
+                                                                   (GSourceFunc)on_end_session_timeout,
+                                                                   manager);
         } else {
                 end_phase (manager);
         }
@@ -485,6 +1068,11 @@ do_phase_exit (GsmManager *manager)
                                    NULL);
         }
 
+#ifdef USE_OPENRC
+        if (manager->fast_logout)
+                kill_session_services ();
+#endif
+
         end_phase (manager);
 }
 
@@ -508,32 +1096,29 @@ _client_query_end_session (const char           *id,
                 /* FIXME: what should we do if we can't communicate with client? */
         } else {
                 g_debug ("GsmManager: adding client to query clients: %s", gsm_client_peek_id (client));
-                data->manager->query_clients = g_slist_prepend (data->manager->query_clients, client);
+                add_query_client (data->manager, client);
         }
 
         return FALSE;
 }
 
-static gboolean
-inhibitor_has_flag (gpointer      key,
-                    GsmInhibitor *inhibitor,
-                    gpointer      data)
+/* JIT inhibitors are the ones created on behalf of a client */
+static void
+remove_jit_inhibitors (GsmManager *manager)
 {
-        guint flag;
-        guint flags;
+        g_auto(GStrv) client_ids = NULL;
 
-        flag = GPOINTER_TO_UINT (data);
-
-        flags = gsm_inhibitor_peek_flags (inhibitor);
+        client_ids = (GStrv) g_hash_table_get_keys_as_array (manager->inhibitors_by_client_id, NULL);
+        for (guint i = 0; client_ids[i] != NULL; i++)
+                client_ids[i] = g_strdup (client_ids[i]);
 
-        return (flags & flag);
+        for (guint i = 0; client_ids[i] != NULL; i++)
+                remove_inhibitors_for_client (manager, client_ids[i]);
 }
 
 static gboolean
 gsm_manager_is_logout_inhibited (GsmManager *manager)
 {
-        GsmInhibitor *inhibitor;
-
         if (manager->logout_mode == GSM_MANAGER_LOGOUT_MODE_FORCE) {
                 return FALSE;
         }
@@ -542,31 +1127,17 @@ gsm_manager_is_logout_inhibited (GsmManager *manager)
                 return FALSE;
         }
 
-        inhibitor = (GsmInhibitor *)gsm_store_find (manager->inhibitors,
-                                                    (GsmStoreFunc)inhibitor_has_flag,
-                                                    GUINT_TO_POINTER (GSM_INHIBITOR_FLAG_LOGOUT));
-        if (inhibitor == NULL) {
-                return FALSE;
-        }
-        return TRUE;
+        return has_inhibitor_with_flags (manager, GSM_INHIBITOR_FLAG_LOGOUT);
 }
 
 static gboolean
 gsm_manager_is_idle_inhibited (GsmManager *manager)
 {
-        GsmInhibitor *inhibitor;
-
         if (manager->inhibitors == NULL) {
                 return FALSE;
         }
 
-        inhibitor = (GsmInhibitor *)gsm_store_find (manager->inhibitors,
-                                                    (GsmStoreFunc)inhibitor_has_flag,
-                                                    GUINT_TO_POINTER (GSM_INHIBITOR_FLAG_IDLE));
-        if (inhibitor == NULL) {
-                return FALSE;
-        }
-        return TRUE;
+        return has_inhibitor_with_flags (manager, GSM_INHIBITOR_FLAG_IDLE);
 }
 
 static gboolean
@@ -587,21 +1158,6 @@ _client_cancel_end_session (const char *id,
         return FALSE;
 }
 
-static gboolean
-inhibitor_is_jit (gpointer      key,
-                  GsmInhibitor *inhibitor,
-                  GsmManager   *manager)
-{
-        gboolean    matches;
-        const char *id;
-
-        id = gsm_inhibitor_peek_client_id (inhibitor);
-
-        matches = (id != NULL && id[0] != '\0');
-
-        return matches;
-}
-
 static void
 cancel_end_session (GsmManager *manager)
 {
@@ -617,13 +1173,13 @@ cancel_end_session (GsmManager *manager)
 
         gsm_manager_set_phase (manager, GSM_MANAGER_PHASE_RUNNING);
         manager->logout_mode = GSM_MANAGER_LOGOUT_MODE_NORMAL;
+        manager->fast_logout = FALSE;
+        manager->shutdown_pipelined = FALSE;
+        g_clear_handle_id (&manager->shutdown_timeout_id, g_source_remove);
 
         manager->logout_type = GSM_MANAGER_LOGOUT_NONE;
 
-        /* clear all JIT inhibitors */
-        gsm_store_foreach_remove (manager->inhibitors,
-                                  (GsmStoreFunc)inhibitor_is_jit,
-                                  (gpointer)manager);
+        remove_jit_inhibitors (manager);
 
         gsm_store_foreach (manager->clients,
                            (GsmStoreFunc)_client_cancel_end_session,
@@ -719,7 +1275,7 @@ _generate_unique_cookie (GsmManager *manager)
 
         do {
                 cookie = generate_cookie ();
-        } while (gsm_store_find (manager->inhibitors, (GsmStoreFunc)_find_by_cookie, &cookie) != NULL);
+        } while (g_hash_table_contains (manager->inhibitors_by_cookie, GUINT_TO_POINTER (cookie)));
 
         return cookie;
 }
@@ -727,17 +1283,19 @@ _generate_unique_cookie (GsmManager *manager)
 static gboolean
 _on_query_end_session_timeout (GsmManager *manager)
 {
-        GSList *l;
+        GHashTableIter iter;
+        GsmClient *client;
 
         manager->phase_timeout_id = 0;
 
         g_debug ("GsmManager: query end session timed out");
 
-        for (l = manager->query_clients; l != NULL; l = l->next) {
+        g_hash_table_iter_init (&iter, manager->query_clients);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &client, NULL)) {
                 GsmInhibitor *inhibitor;
 
                 g_warning ("Client '%s' failed to reply before timeout",
-                           gsm_client_peek_id (l->data));
+                           gsm_client_peek_id (client));
 
                 /* Don't add "not responding" inhibitors if logout is forced
                  */
@@ -746,18 +1304,17 @@ _on_query_end_session_timeout (GsmManager *manager)
                 }
 
                 /* Add JIT inhibit for unresponsive client */
-                inhibitor = gsm_inhibitor_new_for_client (gsm_client_peek_id (l->data),
-                                                          gsm_client_peek_app_id (l->data),
+                inhibitor = gsm_inhibitor_new_for_client (gsm_client_peek_id (client),
+                                                          gsm_client_peek_app_id (client),
                                                           GSM_INHIBITOR_FLAG_LOGOUT,
                                                           _("Not responding"),
-                                                          gsm_client_peek_bus_name (l->data),
+                                                          gsm_client_peek_bus_name (client),
                                                           _generate_unique_cookie (manager));
                 gsm_store_add (manager->inhibitors, gsm_inhibitor_peek_id (inhibitor), G_OBJECT (inhibitor));
                 g_object_unref (inhibitor);
         }
 
-        g_slist_free (manager->query_clients);
-        manager->query_clients = NULL;
+        g_hash_table_remove_all (manager->query_clients);
 
         query_end_session_complete (manager);
 
@@ -785,7 +1342,9 @@ do_phase_query_end_session (GsmManager *manager)
                            (GsmStoreFunc)_client_query_end_session,
                            &data);
 
-        manager->phase_timeout_id = g_timeout_add_seconds (1, (GSourceFunc)_on_query_end_session_timeout, manager);
+        manager->phase_timeout_id = g_timeout_add (get_end_session_deadline (manager),
+                                                   (GSourceFunc)_on_query_end_session_timeout,
+                                                   manager);
 }
 
 static void
@@ -804,23 +1363,26 @@ start_phase (GsmManager *manager)
         g_debug ("GsmManager: starting phase %s\n",
                  phase_num_to_name (manager->phase));
 
+#ifdef USE_OPENRC
+        gsm_openrc_trace (GSM_OPENRC_TRACE_PHASE, phase_num_to_name (manager->phase), NULL);
+#endif
+
         /* reset state */
-        g_slist_free (manager->query_clients);
-        manager->query_clients = NULL;
+        g_hash_table_remove_all (manager->query_clients);
 
         g_clear_handle_id (&manager->phase_timeout_id, g_source_remove);
 
         switch (manager->phase) {
         case GSM_MANAGER_PHASE_INITIALIZATION:
-                sd_notify (0, "READY=1\nSTATUS=Waiting for session to start");
+                notify_service_manager ("READY=1\nSTATUS=Waiting for session to start");
                 break;
         case GSM_MANAGER_PHASE_APPLICATION:
-                sd_notify (0, "STATUS=Starting applications");
+                notify_service_manager ("STATUS=Starting applications");
                 gsm_exported_manager_emit_session_running (manager->skeleton);
                 do_phase_startup (manager);
                 break;
         case GSM_MANAGER_PHASE_RUNNING:
-                sd_notify (0, "STATUS=Running");
+                notify_service_manager ("STATUS=Running");
                 sd_journal_send ("MESSAGE_ID=%s", GSM_MANAGER_STARTUP_SUCCEEDED_MSGID,
                                  "PRIORITY=%d", 5,
                                  "MESSAGE=Entering running state",
@@ -831,18 +1393,21 @@ start_phase (GsmManager *manager)
                 g_object_unref (manager->end_session_cancellable);
                 manager->end_session_cancellable = g_cancellable_new ();
                 update_idle (manager);
+#ifdef USE_OPENRC
+                schedule_deferred_services (manager);
+#endif
                 break;
         case GSM_MANAGER_PHASE_QUERY_END_SESSION:
-                sd_notify (0, "STATUS=Querying end of session");
+                notify_service_manager ("STATUS=Querying end of session");
                 do_phase_query_end_session (manager);
                 break;
         case GSM_MANAGER_PHASE_END_SESSION:
-                sd_notify (0, "STOPPING=1\nSTATUS=Logging out");
+                notify_service_manager ("STOPPING=1\nSTATUS=Logging out");
                 gsm_exported_manager_emit_session_over (manager->skeleton);
                 do_phase_end_session (manager);
                 break;
         case GSM_MANAGER_PHASE_EXIT:
-                sd_notify (0, "STOPPING=1\nSTATUS=Quitting");
+                notify_service_manager ("STOPPING=1\nSTATUS=Quitting");
                 do_phase_exit (manager);
                 break;
         default:
@@ -899,26 +1464,12 @@ _gsm_manager_set_active_session (GsmManager *manager,
 }
 
 static gboolean
-inhibitor_has_client_id (gpointer      key,
-                         GsmInhibitor *inhibitor,
-                         const char   *client_id_a)
+listify_store_ids (char       *id,
+                   GObject    *object,
+                   GPtrArray **array)
 {
-        gboolean    matches;
-        const char *client_id_b;
-
-        client_id_b = gsm_inhibitor_peek_client_id (inhibitor);
-
-        matches = FALSE;
-        if (! IS_STRING_EMPTY (client_id_a) && ! IS_STRING_EMPTY (client_id_b)) {
-                matches = (strcmp (client_id_a, client_id_b) == 0);
-                if (matches) {
-                        g_debug ("GsmManager: removing JIT inhibitor for %s for reason '%s'",
-                                 gsm_inhibitor_peek_client_id (inhibitor),
-                                 gsm_inhibitor_peek_reason (inhibitor));
-                }
-        }
-
-        return matches;
+        g_ptr_array_add (*array, g_strdup (id));
+        return FALSE;
 }
 
 static void
@@ -933,9 +1484,7 @@ _disconnect_client (GsmManager *manager,
         g_object_ref (client);
 
         /* remove any inhibitors for this client */
-        gsm_store_foreach_remove (manager->inhibitors,
-                                  (GsmStoreFunc)inhibitor_has_client_id,
-                                  (gpointer)gsm_client_peek_id (client));
+        remove_inhibitors_for_client (manager, gsm_client_peek_id (client));
 
         switch (manager->phase) {
         case GSM_MANAGER_PHASE_QUERY_END_SESSION:
@@ -953,7 +1502,7 @@ _disconnect_client (GsmManager *manager,
                                                 manager);
                 break;
         case GSM_MANAGER_PHASE_END_SESSION:
-                if (! g_slist_find (manager->query_clients, client)) {
+                if (! g_hash_table_contains (manager->query_clients, client)) {
                         /* the client sent its EndSessionResponse and we already
                          * processed it.
                          */
@@ -980,35 +1529,36 @@ _disconnect_client (GsmManager *manager,
         g_object_unref (client);
 }
 
-typedef struct {
-        const char *service_name;
-        GsmManager *manager;
-} RemoveClientData;
-
-static gboolean
-_disconnect_dbus_client (const char       *id,
-                         GsmClient        *client,
-                         RemoveClientData *data)
+/*
+ * Disconnects and removes the clients with the given ids as one batch:
+ * the inhibitor and idle state they affect is only recomputed once at
+ * the end, however many of them go away.
+ */
+static void
+disconnect_clients (GsmManager *manager,
+                    GPtrArray  *client_ids)
 {
-        const char *name;
+        freeze_state_updates (manager);
 
-        /* If no service name, then we simply disconnect all clients */
-        if (!data->service_name) {
-                _disconnect_client (data->manager, client);
-                return TRUE;
-        }
+        for (guint i = 0; i < client_ids->len; i++) {
+                const char *id = g_ptr_array_index (client_ids, i);
+                GsmClient *client;
 
-        name = gsm_client_peek_bus_name (client);
-        if (IS_STRING_EMPTY (name)) {
-                return FALSE;
-        }
+                client = (GsmClient *) gsm_store_lookup (manager->clients, id);
+                if (client == NULL)
+                        continue;
 
-        if (strcmp (data->service_name, name) == 0) {
-                _disconnect_client (data->manager, client);
-                return TRUE;
+                _disconnect_client (manager, client);
+                gsm_store_remove (manager->clients, id);
         }
 
-        return FALSE;
+        thaw_state_updates (manager);
+
+        if (manager->phase >= GSM_MANAGER_PHASE_QUERY_END_SESSION
+            && gsm_store_size (manager->clients) == 0) {
+                g_debug ("GsmManager: last client disconnected - exiting");
+                end_phase (manager);
+        }
 }
 
 /**
@@ -1024,21 +1574,29 @@ static void
 remove_clients_for_connection (GsmManager *manager,
                                const char *service_name)
 {
-        RemoveClientData data;
+        g_autoptr(GPtrArray) client_ids = NULL;
 
-        data.service_name = service_name;
-        data.manager = manager;
+        client_ids = g_ptr_array_new_with_free_func (g_free);
 
-        /* disconnect dbus clients for name */
-        gsm_store_foreach_remove (manager->clients,
-                                  (GsmStoreFunc)_disconnect_dbus_client,
-                                  &data);
+        if (service_name == NULL) {
+                gsm_store_foreach (manager->clients,
+                                   (GsmStoreFunc) listify_store_ids,
+                                   &client_ids);
+        } else {
+                GHashTable *ids;
+                GHashTableIter iter;
+                const char *id;
 
-        if (manager->phase >= GSM_MANAGER_PHASE_QUERY_END_SESSION
-            && gsm_store_size (manager->clients) == 0) {
-                g_debug ("GsmManager: last client disconnected - exiting");
-                end_phase (manager);
+                ids = g_hash_table_lookup (manager->clients_by_bus_name, service_name);
+                if (ids == NULL)
+                        return;
+
+                g_hash_table_iter_init (&iter, ids);
+                while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL))
+                        g_ptr_array_add (client_ids, g_strdup (id));
         }
+
+        disconnect_clients (manager, client_ids);
 }
 
 gboolean
@@ -1053,14 +1611,13 @@ static void
 on_client_disconnected (GsmClient  *client,
                         GsmManager *manager)
 {
+        g_autoptr(GPtrArray) client_ids = NULL;
+
         g_debug ("GsmManager: disconnect client");
-        _disconnect_client (manager, client);
-        gsm_store_remove (manager->clients, gsm_client_peek_id (client));
-        if (manager->phase >= GSM_MANAGER_PHASE_QUERY_END_SESSION
-            && gsm_store_size (manager->clients) == 0) {
-                g_debug ("GsmManager: last client disconnected - exiting");
-                end_phase (manager);
-        }
+
+        client_ids = g_ptr_array_new_with_free_func (g_free);
+        g_ptr_array_add (client_ids, g_strdup (gsm_client_peek_id (client)));
+        disconnect_clients (manager, client_ids);
 }
 
 static void
@@ -1076,7 +1633,7 @@ on_client_end_session_response (GsmClient  *client,
 
         g_debug ("GsmManager: Response from end session request: is-ok=%d reason=%s", is_ok, reason ?: "(none)");
 
-        manager->query_clients = g_slist_remove (manager->query_clients, client);
+        remove_query_client (manager, client);
 
         if (!is_ok && manager->logout_mode != GSM_MANAGER_LOGOUT_MODE_FORCE) {
                 GsmInhibitor *inhibitor;
@@ -1091,18 +1648,16 @@ on_client_end_session_response (GsmClient  *client,
                 gsm_store_add (manager->inhibitors, gsm_inhibitor_peek_id (inhibitor), G_OBJECT (inhibitor));
                 g_object_unref (inhibitor);
         } else {
-                gsm_store_foreach_remove (manager->inhibitors,
-                                          (GsmStoreFunc)inhibitor_has_client_id,
-                                          (gpointer)gsm_client_peek_id (client));
+                remove_inhibitors_for_client (manager, gsm_client_peek_id (client));
         }
 
         if (manager->phase == GSM_MANAGER_PHASE_QUERY_END_SESSION) {
-                if (manager->query_clients == NULL)
+                if (g_hash_table_size (manager->query_clients) == 0)
                         query_end_session_complete (manager);
         } else if (manager->phase == GSM_MANAGER_PHASE_END_SESSION) {
                 /* we can continue to the next step if all clients have replied
                  * and if there's no inhibitor */
-                if (manager->query_clients != NULL || gsm_manager_is_logout_inhibited (manager))
+                if (g_hash_table_size (manager->query_clients) > 0 || gsm_manager_is_logout_inhibited (manager))
                         return;
 
                 end_phase (manager);
@@ -1115,11 +1670,36 @@ on_store_client_added (GsmStore   *store,
                        GsmManager *manager)
 {
         GsmClient *client;
+        const char *bus_name;
 
         g_debug ("GsmManager: Client added: %s", id);
 
         client = (GsmClient *)gsm_store_lookup (store, id);
 
+        gsm_launch_queue_app_registered (manager->launch_queue,
+                                         gsm_client_peek_app_id (client));
+        gsm_exported_diagnostics_set_launch_latencies (manager->diagnostics,
+                                                       gsm_launch_queue_get_latencies (manager->launch_queue));
+#ifdef USE_OPENRC
+        if (gsm_client_peek_app_id (client) != NULL)
+                gsm_openrc_trace (GSM_OPENRC_TRACE_READY, gsm_client_peek_app_id (client), NULL);
+#endif
+
+        bus_name = gsm_client_peek_bus_name (client);
+        if (! IS_STRING_EMPTY (bus_name)) {
+                GHashTable *ids;
+
+                ids = g_hash_table_lookup (manager->clients_by_bus_name, bus_name);
+                if (ids == NULL) {
+                        ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+                        g_hash_table_insert (manager->clients_by_bus_name,
+                                             g_strdup (bus_name), ids);
+                }
+                g_hash_table_add (ids, g_strdup (id));
+                g_hash_table_insert (manager->client_bus_names,
+                                     g_strdup (id), g_strdup (bus_name));
+        }
+
         g_signal_connect (client,
                           "end-session-response",
                           G_CALLBACK (on_client_end_session_response),
@@ -1134,8 +1714,23 @@ on_store_client_removed (GsmStore   *store,
                          const char *id,
                          GsmManager *manager)
 {
+        const char *bus_name;
+
         g_debug ("GsmManager: Client removed: %s", id);
 
+        bus_name = g_hash_table_lookup (manager->client_bus_names, id);
+        if (bus_name != NULL) {
+                GHashTable *ids;
+
+                ids = g_hash_table_lookup (manager->clients_by_bus_name, bus_name);
+                if (ids != NULL) {
+                        g_hash_table_remove (ids, id);
+                        if (g_hash_table_size (ids) == 0)
+                                g_hash_table_remove (manager->clients_by_bus_name, bus_name);
+                }
+                g_hash_table_remove (manager->client_bus_names, id);
+        }
+
         gsm_exported_manager_emit_client_removed (manager->skeleton, id);
 }
 
@@ -1193,6 +1788,33 @@ update_inhibited_actions (GsmManager *manager,
                                                     manager->inhibited_actions);
 }
 
+static void
+freeze_state_updates (GsmManager *manager)
+{
+        manager->state_freeze_count++;
+}
+
+static void
+thaw_state_updates (GsmManager *manager)
+{
+        g_return_if_fail (manager->state_freeze_count > 0);
+
+        if (--manager->state_freeze_count > 0)
+                return;
+
+        if (manager->inhibitors_changed) {
+                manager->inhibitors_changed = FALSE;
+                update_inhibited_actions (manager, get_inhibited_flags (manager));
+                update_idle (manager);
+        }
+
+        if (manager->inhibitors_removed) {
+                manager->inhibitors_removed = FALSE;
+                if (manager->phase >= GSM_MANAGER_PHASE_QUERY_END_SESSION)
+                        end_session_or_show_shell_dialog (manager);
+        }
+}
+
 static void
 on_inhibitor_vanished (GsmInhibitor *inhibitor,
                        GsmManager   *manager)
@@ -1211,43 +1833,41 @@ on_store_inhibitor_added (GsmStore   *store,
         g_debug ("GsmManager: Inhibitor added: %s", id);
 
         i = GSM_INHIBITOR (gsm_store_lookup (store, id));
+        index_inhibitor (manager, i);
+
+        g_signal_connect_object (i, "vanished", G_CALLBACK (on_inhibitor_vanished), manager, 0);
+
+        if (manager->state_freeze_count > 0) {
+                manager->inhibitors_changed = TRUE;
+                gsm_exported_manager_emit_inhibitor_added (manager->skeleton, id);
+                return;
+        }
 
         new_inhibited_actions = manager->inhibited_actions | gsm_inhibitor_peek_flags (i);
         update_inhibited_actions (manager, new_inhibited_actions);
 
-        g_signal_connect_object (i, "vanished", G_CALLBACK (on_inhibitor_vanished), manager, 0);
-
         gsm_exported_manager_emit_inhibitor_added (manager->skeleton, id);
 
         update_idle (manager);
 }
 
-static gboolean
-collect_inhibition_flags (const char *id,
-                          GObject    *object,
-                          gpointer    user_data)
-{
-        GsmInhibitorFlag *new_inhibited_actions = user_data;
-
-        *new_inhibited_actions |= gsm_inhibitor_peek_flags (GSM_INHIBITOR (object));
-
-        return FALSE;
-}
-
 static void
 on_store_inhibitor_removed (GsmStore   *store,
                             const char *id,
                             GsmManager *manager)
 {
-        GsmInhibitorFlag new_inhibited_actions;
-
         g_debug ("GsmManager: Inhibitor removed: %s", id);
 
-        new_inhibited_actions = 0;
-        gsm_store_foreach (manager->inhibitors,
-                           collect_inhibition_flags,
-                           &new_inhibited_actions);
-        update_inhibited_actions (manager, new_inhibited_actions);
+        unindex_inhibitor (manager, id);
+
+        if (manager->state_freeze_count > 0) {
+                manager->inhibitors_changed = TRUE;
+                manager->inhibitors_removed = TRUE;
+                gsm_exported_manager_emit_inhibitor_removed (manager->skeleton, id);
+                return;
+        }
+
+        update_inhibited_actions (manager, get_inhibited_flags (manager));
 
         gsm_exported_manager_emit_inhibitor_removed (manager->skeleton, id);
 
@@ -1266,7 +1886,22 @@ gsm_manager_dispose (GObject *object)
         g_debug ("GsmManager: disposing manager");
 
         g_clear_object (&manager->end_session_cancellable);
+
+        if (manager->launch_cancellable != NULL) {
+                g_cancellable_cancel (manager->launch_cancellable);
+                g_clear_object (&manager->launch_cancellable);
+        }
+        g_clear_handle_id (&manager->settings_timeout_id, g_source_remove);
+        g_clear_handle_id (&manager->shutdown_timeout_id, g_source_remove);
+        g_clear_object (&manager->launch_queue);
+        g_clear_object (&manager->autostart_cache);
         g_clear_pointer (&manager->session_name, g_free);
+        g_clear_pointer (&manager->query_clients, g_hash_table_unref);
+
+        if (manager->latency_history != NULL) {
+                gsm_latency_history_save (manager->latency_history);
+                g_clear_object (&manager->latency_history);
+        }
 
         if (manager->clients != NULL) {
                 g_signal_handlers_disconnect_by_func (manager->clients,
@@ -1279,6 +1914,9 @@ gsm_manager_dispose (GObject *object)
                 manager->clients = NULL;
         }
 
+        g_clear_pointer (&manager->clients_by_bus_name, g_hash_table_unref);
+        g_clear_pointer (&manager->client_bus_names, g_hash_table_unref);
+
         g_clear_object (&manager->apps);
 
         if (manager->inhibitors != NULL) {
@@ -1293,6 +1931,10 @@ gsm_manager_dispose (GObject *object)
                 manager->inhibitors = NULL;
         }
 
+        g_clear_pointer (&manager->inhibitors_by_client_id, g_hash_table_unref);
+        g_clear_pointer (&manager->inhibitors_by_cookie, g_hash_table_unref);
+        g_clear_pointer (&manager->inhibitors_by_id, g_hash_table_unref);
+
         g_clear_object (&manager->presence);
         g_clear_object (&manager->settings);
         g_clear_object (&manager->session_settings);
@@ -1306,15 +1948,35 @@ gsm_manager_dispose (GObject *object)
                 g_clear_object (&manager->skeleton);
         }
 
+        if (manager->diagnostics != NULL) {
+                g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (manager->diagnostics),
+                                                                    manager->connection);
+                g_clear_object (&manager->diagnostics);
+        }
+
+        if (manager->startup != NULL) {
+                g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (manager->startup),
+                                                                    manager->connection);
+                g_clear_object (&manager->startup);
+        }
+
+#ifdef USE_OPENRC
+        g_clear_handle_id (&manager->deferred_id, g_source_remove);
+        g_clear_pointer (&manager->session_services, g_key_file_unref);
+#endif
+
         g_clear_object (&manager->connection);
 
         G_OBJECT_CLASS (gsm_manager_parent_class)->dispose (object);
 
 #ifdef USE_OPENRC
-	g_debug ("Starting gnome-session-shutdown");
+        {
+                const char *shutdown_services[] = { "gnome-session-shutdown", NULL };
 
-	if (openrc_unit_action ("gnome-session-shutdown", "start", NULL))
-                g_warning ("Failed to start gnome-session-shutdown.");
+                g_debug ("Starting gnome-session-shutdown");
+                gsm_openrc_services_action_async (shutdown_services, "start", NULL,
+                                                  on_openrc_action_done, NULL);
+        }
 #endif
 }
 
@@ -1566,6 +2228,28 @@ gsm_manager_initialized (GsmExportedManager    *skeleton,
         return TRUE;
 }
 
+static gboolean
+gsm_manager_report_milestone (GsmExportedStartup    *startup,
+                              GDBusMethodInvocation *invocation,
+                              const char            *milestone,
+                              GsmManager            *manager)
+{
+        if (g_strcmp0 (milestone, "settings") != 0) {
+                g_dbus_method_invocation_return_error (invocation,
+                                                       G_DBUS_ERROR,
+                                                       G_DBUS_ERROR_INVALID_ARGS,
+                                                       "Unknown milestone %s", milestone);
+                return TRUE;
+        }
+
+        g_debug ("GsmManager: settings daemons are up");
+        settings_ready (manager);
+
+        gsm_exported_startup_complete_report_milestone (startup, invocation);
+
+        return TRUE;
+}
+
 static gboolean
 is_valid_category (int category)
 {
@@ -1649,6 +2333,27 @@ gsm_manager_initialization_error (GsmExportedManager    *skeleton,
         return TRUE;
 }
 
+/* Sends EndSession to every client at once without asking first, and
+ * only gives them FORCED_LOGOUT_GRACE_MS to reply */
+static void
+begin_forced_logout (GsmManager *manager)
+{
+        g_debug ("GsmManager: forced logout, skipping query-end-session");
+
+        g_clear_handle_id (&manager->phase_timeout_id, g_source_remove);
+        g_hash_table_remove_all (manager->query_clients);
+
+        /* A plain logout may have the dialog up already; cancelling it
+         * now would take us back to RUNNING after EndSession went out */
+        disconnect_shell_dialog_signals (manager);
+        gsm_shell_close_end_session_dialog (manager->shell);
+
+        manager->logout_type = GSM_MANAGER_LOGOUT_LOGOUT;
+        manager->fast_logout = TRUE;
+        manager->phase = GSM_MANAGER_PHASE_END_SESSION;
+        start_phase (manager);
+}
+
 gboolean
 gsm_manager_logout (GsmManager *manager,
                     guint logout_mode,
@@ -1696,6 +2401,15 @@ gsm_manager_logout (GsmManager *manager,
 
         manager->logout_mode = logout_mode;
 
+        /* Reboot and shutdown still have to get through logind first */
+        if (logout_mode == GSM_MANAGER_LOGOUT_MODE_FORCE &&
+            (manager->phase == GSM_MANAGER_PHASE_RUNNING ||
+             (manager->phase == GSM_MANAGER_PHASE_QUERY_END_SESSION &&
+              manager->logout_type == GSM_MANAGER_LOGOUT_LOGOUT))) {
+                begin_forced_logout (manager);
+                return TRUE;
+        }
+
         if (manager->phase >= GSM_MANAGER_PHASE_QUERY_END_SESSION) {
                 /* Someone can upgrade a normal logout to a forced logout
                  * while we're busy prompting. In this case, re-evaluate */
@@ -1930,9 +2644,8 @@ gsm_manager_uninhibit (GsmExportedManager    *skeleton,
 
         g_debug ("GsmManager: Uninhibit %u", cookie);
 
-        inhibitor = (GsmInhibitor *)gsm_store_find (manager->inhibitors,
-                                                    (GsmStoreFunc)_find_by_cookie,
-                                                    &cookie);
+        inhibitor = g_hash_table_lookup (manager->inhibitors_by_cookie,
+                                         GUINT_TO_POINTER (cookie));
         if (inhibitor == NULL) {
                 GError *new_error;
 
@@ -1963,21 +2676,12 @@ gsm_manager_is_inhibited (GsmExportedManager    *skeleton,
                           guint                  flags,
                           GsmManager            *manager)
 {
-        GsmInhibitor *inhibitor;
         gboolean is_inhibited;
 
-        if (manager->inhibitors == NULL
-            || gsm_store_size (manager->inhibitors) == 0) {
+        if (manager->inhibitors == NULL) {
                 is_inhibited = FALSE;
         } else {
-                inhibitor = (GsmInhibitor *) gsm_store_find (manager->inhibitors,
-                                                             (GsmStoreFunc)inhibitor_has_flag,
-                                                             GUINT_TO_POINTER (flags));
-                if (inhibitor == NULL) {
-                        is_inhibited = FALSE;
-                } else {
-                        is_inhibited = TRUE;
-                }
+                is_inhibited = has_inhibitor_with_flags (manager, flags);
         }
 
         gsm_exported_manager_complete_is_inhibited (skeleton, invocation, is_inhibited);
@@ -1985,15 +2689,6 @@ gsm_manager_is_inhibited (GsmExportedManager    *skeleton,
         return TRUE;
 }
 
-static gboolean
-listify_store_ids (char       *id,
-                   GObject    *object,
-                   GPtrArray **array)
-{
-        g_ptr_array_add (*array, g_strdup (id));
-        return FALSE;
-}
-
 static gboolean
 gsm_manager_get_inhibitors (GsmExportedManager    *skeleton,
                             GDBusMethodInvocation *invocation,
@@ -2014,6 +2709,35 @@ gsm_manager_get_inhibitors (GsmExportedManager    *skeleton,
         return TRUE;
 }
 
+static gboolean
+gsm_manager_get_pending_clients (GsmExportedDiagnostics *diagnostics,
+                                 GDBusMethodInvocation  *invocation,
+                                 GsmManager             *manager)
+{
+        GVariantBuilder builder;
+        GHashTableIter iter;
+        GsmClient *client;
+        gint64 *requested;
+        gint64 now;
+
+        now = g_get_monotonic_time ();
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssu)"));
+
+        g_hash_table_iter_init (&iter, manager->query_clients);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &client, (gpointer *) &requested)) {
+                g_variant_builder_add (&builder, "(ssu)",
+                                       gsm_client_peek_id (client),
+                                       gsm_client_peek_app_id (client) ?: "",
+                                       (guint) ((now - *requested) / 1000));
+        }
+
+        gsm_exported_diagnostics_complete_get_pending_clients (diagnostics, invocation,
+                                                               g_variant_builder_end (&builder));
+
+        return TRUE;
+}
+
 static gboolean
 gsm_manager_is_session_running (GsmExportedManager    *skeleton,
                                 GDBusMethodInvocation *invocation,
@@ -2046,6 +2770,8 @@ register_manager (GsmManager *manager)
 {
         GDBusConnection *connection;
         GsmExportedManager *skeleton;
+        GsmExportedDiagnostics *diagnostics;
+        GsmExportedStartup *startup;
         GError *error = NULL;
 
         connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
@@ -2069,6 +2795,38 @@ register_manager (GsmManager *manager)
                 exit (1);
         }
 
+        diagnostics = gsm_exported_diagnostics_skeleton_new ();
+        g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (diagnostics),
+                                          connection,
+                                          GSM_MANAGER_DBUS_PATH, &error);
+
+        if (error != NULL) {
+                g_critical ("error exporting diagnostics on session bus: %s", error->message);
+                g_error_free (error);
+
+                exit (1);
+        }
+
+        gsm_exported_diagnostics_set_client_latencies (diagnostics,
+                                                       gsm_latency_history_to_variant (manager->latency_history));
+        g_signal_connect (diagnostics, "handle-get-pending-clients",
+                          G_CALLBACK (gsm_manager_get_pending_clients), manager);
+
+        startup = gsm_exported_startup_skeleton_new ();
+        g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (startup),
+                                          connection,
+                                          GSM_MANAGER_DBUS_PATH, &error);
+
+        if (error != NULL) {
+                g_critical ("error exporting startup on session bus: %s", error->message);
+                g_error_free (error);
+
+                exit (1);
+        }
+
+        g_signal_connect (startup, "handle-report-milestone",
+                          G_CALLBACK (gsm_manager_report_milestone), manager);
+
         g_signal_connect (skeleton, "handle-can-reboot-to-firmware-setup",
                           G_CALLBACK (gsm_manager_can_reboot_to_firmware_setup), manager);
         g_signal_connect (skeleton, "handle-can-shutdown",
@@ -2116,6 +2874,12 @@ register_manager (GsmManager *manager)
 
         manager->connection = connection;
         manager->skeleton = skeleton;
+        manager->diagnostics = diagnostics;
+        manager->startup = startup;
+
+#ifdef USE_OPENRC
+        manager->session_services = load_session_services ();
+#endif
 
         g_signal_connect (manager->system, "notify::active",
                           G_CALLBACK (on_gsm_system_active_changed), manager);
@@ -2148,6 +2912,10 @@ gsm_manager_init (GsmManager *manager)
         manager->lockdown_settings = g_settings_new (LOCKDOWN_SCHEMA);
 
         manager->clients = gsm_store_new ();
+        manager->clients_by_bus_name = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                              g_free, (GDestroyNotify) g_hash_table_unref);
+        manager->client_bus_names = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, g_free);
         g_signal_connect (manager->clients,
                           "added",
                           G_CALLBACK (on_store_client_added),
@@ -2157,6 +2925,12 @@ gsm_manager_init (GsmManager *manager)
                           G_CALLBACK (on_store_client_removed),
                           manager);
 
+        manager->inhibitors_by_id = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, g_object_unref);
+        manager->inhibitors_by_cookie = g_hash_table_new (NULL, NULL);
+        manager->inhibitors_by_client_id = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                  g_free, (GDestroyNotify) g_hash_table_unref);
+
         manager->inhibitors = gsm_store_new ();
         g_signal_connect (manager->inhibitors,
                           "added",
@@ -2169,6 +2943,9 @@ gsm_manager_init (GsmManager *manager)
 
         manager->apps = gsm_store_new ();
 
+        manager->query_clients = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+        manager->latency_history = gsm_latency_history_new ();
+
         manager->presence = gsm_presence_new ();
         g_signal_connect (manager->presence,
                           "status-changed",
@@ -2187,6 +2964,9 @@ gsm_manager_init (GsmManager *manager)
         manager->system = gsm_get_system ();
         manager->shell = gsm_get_shell ();
         manager->end_session_cancellable = g_cancellable_new ();
+
+        manager->launch_queue = gsm_launch_queue_new (launch_queue_start_app, manager);
+        manager->launch_cancellable = g_cancellable_new ();
 }
 
 GsmManager *
@@ -2347,7 +3127,7 @@ gsm_manager_set_phase (GsmManager      *manager,
         return (TRUE);
 }
 
-static void
+static gboolean
 append_app (GsmManager *manager,
             GsmApp     *app)
 {
@@ -2357,75 +3137,315 @@ append_app (GsmManager *manager,
         app_id = gsm_app_peek_app_id (app);
         if (IS_STRING_EMPTY (app_id)) {
                 g_debug ("GsmManager: not adding app: no app-id");
-                return;
+                return FALSE;
         }
 
         dup = (GsmApp *) gsm_store_lookup (manager->apps, app_id);
         if (dup != NULL) {
                 g_debug ("GsmManager: not adding app: app-id '%s' already exists", app_id);
-                return;
+                return FALSE;
         }
 
         gsm_store_add (manager->apps, app_id, G_OBJECT (app));
+        return TRUE;
 }
 
-gboolean
-gsm_manager_add_autostart_app (GsmManager *manager,
-                               const char *path)
+static gboolean
+add_autostart_app (GsmManager        *manager,
+                   const char        *path,
+                   GsmLaunchPriority  priority,
+                   gboolean           needs_settings)
 {
         GsmApp  *app;
         GError *error = NULL;
 
-        g_return_val_if_fail (GSM_IS_MANAGER (manager), FALSE);
-        g_return_val_if_fail (path != NULL, FALSE);
-
         app = gsm_app_new_for_path (path, &error);
         if (app == NULL) {
                 g_warning ("%s", error->message);
                 g_clear_error (&error);
+                if (manager->autostart_cache != NULL)
+                        gsm_autostart_cache_mark_rejected (manager->autostart_cache, path);
                 return FALSE;
         }
 
         g_debug ("GsmManager: read %s", path);
-        append_app (manager, app);
+        if (append_app (manager, app)) {
+                gsm_launch_queue_set_priority (manager->launch_queue,
+                                               gsm_app_peek_app_id (app),
+                                               priority);
+#ifdef USE_OPENRC
+                /* Only the OpenRC session leader reports the milestone */
+                if (needs_settings)
+                        gsm_launch_queue_set_needs_settings (manager->launch_queue,
+                                                             gsm_app_peek_app_id (app));
+#endif
+        }
         g_object_unref (app);
 
         return TRUE;
 }
 
+gboolean
+gsm_manager_add_autostart_app (GsmManager *manager,
+                               const char *path)
+{
+        GsmLaunchPriority priority;
+        gboolean needs_settings;
+
+        g_return_val_if_fail (GSM_IS_MANAGER (manager), FALSE);
+        g_return_val_if_fail (path != NULL, FALSE);
+
+        priority = gsm_launch_queue_read_priority (path, &needs_settings);
+
+        return add_autostart_app (manager, path, priority, needs_settings);
+}
+
 gboolean
 gsm_manager_add_autostart_apps_from_dir (GsmManager *manager,
                                          const char *path)
 {
-        GDir       *dir;
-        const char *name;
+        g_autoptr(GPtrArray) entries = NULL;
 
         g_return_val_if_fail (GSM_IS_MANAGER (manager), FALSE);
         g_return_val_if_fail (path != NULL, FALSE);
 
         g_debug ("GsmManager: *** Adding autostart apps for %s", path);
 
-        dir = g_dir_open (path, 0, NULL);
-        if (dir == NULL) {
+        if (manager->autostart_cache == NULL)
+                manager->autostart_cache = gsm_autostart_cache_new ();
+
+        entries = gsm_autostart_cache_scan (manager->autostart_cache, path);
+        if (entries == NULL) {
                 return FALSE;
         }
 
-        while ((name = g_dir_read_name (dir))) {
-                char *desktop_file;
+        for (guint i = 0; i < entries->len; i++) {
+                GsmAutostartEntry *entry = g_ptr_array_index (entries, i);
+
+                if (entry->rejected) {
+                        g_debug ("GsmManager: skipping %s, unchanged since it was rejected",
+                                 entry->path);
+                        continue;
+                }
+
+                add_autostart_app (manager, entry->path, entry->priority,
+                                   entry->needs_settings);
+        }
+
+        return TRUE;
+}
+
+/*
+ * Reboot and shutdown
+ *
+ * Once the user confirmed, we first need logind to accept the shutdown;
+ * if it refuses, the session goes back to running. After that, the
+ * clients handling EndSession and the session services stopping run side
+ * by side, and we exit once both are done. Only services the clients
+ * can't be using are stopped early: the session target, and with it the
+ * shell and settings daemons, is left for the gnome-session-shutdown
+ * service. The whole thing is bounded by SHUTDOWN_PIPELINE_TIMEOUT_SECONDS.
+ * How long each leg took goes to the log and the startup trace, so the
+ * one on the critical path is easy to spot.
+ */
+
+static void
+finish_shutdown_pipeline (GsmManager *manager)
+{
+        g_autoptr(GString) legs = g_string_new (NULL);
+        const char *critical = NULL;
+        gboolean timed_out = FALSE;
+        gint64 elapsed;
+        gint64 last = 0;
+
+        g_clear_handle_id (&manager->shutdown_timeout_id, g_source_remove);
+        manager->shutdown_pipelined = FALSE;
+
+        for (guint i = 0; i < SHUTDOWN_N_LEGS; i++) {
+                gint64 done = manager->shutdown_leg_done[i];
 
-                if (!g_str_has_suffix (name, ".desktop")) {
+                if (legs->len > 0)
+                        g_string_append (legs, ", ");
+
+                if (done == 0) {
+                        g_string_append_printf (legs, "%s unfinished", shutdown_leg_names[i]);
+                        timed_out = TRUE;
                         continue;
                 }
 
-                desktop_file = g_build_filename (path, name, NULL);
-                gsm_manager_add_autostart_app (manager, desktop_file);
-                g_free (desktop_file);
+                g_string_append_printf (legs, "%s %" G_GINT64_FORMAT " ms",
+                                        shutdown_leg_names[i],
+                                        (done - manager->shutdown_started) / 1000);
+                if (!timed_out && done > last) {
+                        last = done;
+                        critical = shutdown_leg_names[i];
+                }
+        }
+
+        if (timed_out)
+                critical = "the deadline";
+
+        elapsed = g_get_monotonic_time () - manager->shutdown_started;
+        g_message ("GsmManager: ready to %s after %" G_GINT64_FORMAT " ms, waited on %s (%s)",
+                   manager->logout_type == GSM_MANAGER_LOGOUT_REBOOT ? "reboot" :
+                   manager->logout_type == GSM_MANAGER_LOGOUT_SHUTDOWN ? "shut down" : "log out",
+                   elapsed / 1000, critical, legs->str);
+#ifdef USE_OPENRC
+        {
+                g_autofree char *detail = g_strdup_printf ("%" G_GINT64_FORMAT, elapsed);
+
+                gsm_openrc_trace (GSM_OPENRC_TRACE_STEP, "shutdown", detail);
+        }
+#endif
+}
+
+/* Returns whether that was the last one */
+static gboolean
+shutdown_leg_done (GsmManager  *manager,
+                   ShutdownLeg  leg)
+{
+        gint64 elapsed;
+
+        if (manager->shutdown_leg_done[leg] != 0)
+                return FALSE;
+
+        manager->shutdown_leg_done[leg] = g_get_monotonic_time ();
+        elapsed = manager->shutdown_leg_done[leg] - manager->shutdown_started;
+
+        g_debug ("GsmManager: shutdown leg %s done after %" G_GINT64_FORMAT " ms",
+                 shutdown_leg_names[leg], elapsed / 1000);
+#ifdef USE_OPENRC
+        {
+                g_autofree char *step = g_strdup_printf ("shutdown-%s", shutdown_leg_names[leg]);
+                g_autofree char *detail = g_strdup_printf ("%" G_GINT64_FORMAT, elapsed);
+
+                gsm_openrc_trace (GSM_OPENRC_TRACE_STEP, step, detail);
+        }
+#endif
+
+        for (guint i = 0; i < SHUTDOWN_N_LEGS; i++) {
+                if (manager->shutdown_leg_done[i] == 0)
+                        return FALSE;
+        }
+
+        finish_shutdown_pipeline (manager);
+        return TRUE;
+}
+
+/* For the legs other than the end-session phase itself, which only
+ * continues once they're done */
+static void
+complete_shutdown_leg (GsmManager  *manager,
+                       ShutdownLeg  leg)
+{
+        if (!manager->shutdown_pipelined)
+                return;
+
+        if (shutdown_leg_done (manager, leg) &&
+            manager->phase == GSM_MANAGER_PHASE_END_SESSION)
+                end_phase (manager);
+}
+
+static void on_shutdown_prepared (GsmSystem  *system,
+                                  gboolean    success,
+                                  GsmManager *manager);
+
+/* logind refused, or didn't answer; nothing has been ended yet */
+static void
+abort_shutdown_pipeline (GsmManager *manager)
+{
+        g_signal_handlers_disconnect_by_func (manager->system, on_shutdown_prepared, manager);
+        disconnect_shell_dialog_signals (manager);
+        gsm_shell_close_end_session_dialog (manager->shell);
+        /* back to running phase */
+        cancel_end_session (manager);
+}
+
+static gboolean
+on_shutdown_pipeline_timeout (gpointer user_data)
+{
+        GsmManager *manager = user_data;
+
+        manager->shutdown_timeout_id = 0;
+
+        if (manager->shutdown_leg_done[SHUTDOWN_LEG_PREPARE] == 0) {
+                g_warning ("GsmManager: the system didn't get ready to %s within %d seconds",
+                           manager->logout_type == GSM_MANAGER_LOGOUT_REBOOT ? "reboot" : "shut down",
+                           SHUTDOWN_PIPELINE_TIMEOUT_SECONDS);
+                abort_shutdown_pipeline (manager);
+                return G_SOURCE_REMOVE;
+        }
+
+        g_warning ("GsmManager: not ready to exit after %d seconds, going ahead anyway",
+                   SHUTDOWN_PIPELINE_TIMEOUT_SECONDS);
+
+        finish_shutdown_pipeline (manager);
+        if (manager->phase == GSM_MANAGER_PHASE_END_SESSION)
+                end_phase (manager);
+
+        return G_SOURCE_REMOVE;
+}
+
+#ifdef USE_OPENRC
+static void
+on_session_services_stopped (GPid     pid,
+                             gint     wait_status,
+                             gpointer user_data)
+{
+        GsmManager *manager = user_data;
+        g_autoptr(GError) error = NULL;
+
+        g_spawn_close_pid (pid);
+
+        if (!g_spawn_check_wait_status (wait_status, &error))
+                g_warning ("GsmManager: failed to stop the session services: %s", error->message);
+
+        complete_shutdown_leg (manager, SHUTDOWN_LEG_SERVICES);
+}
+
+/* Everything but our own service, the session target and what they need;
+ * the rest goes with the gnome-session-shutdown service we start on the
+ * way out */
+static gboolean
+stop_session_services (GsmManager *manager)
+{
+        g_autoptr(GPtrArray) argv = NULL;
+        g_autoptr(GError) error = NULL;
+        const char *service;
+        char *runlevel;
+        GPid pid;
+
+        service = g_getenv ("RC_SVCNAME");
+        if (service == NULL) {
+                g_debug ("GsmManager: not an OpenRC service, leaving the session services be");
+                return FALSE;
+        }
+
+        argv = g_ptr_array_new_with_free_func (g_free);
+        g_ptr_array_add (argv, g_strdup (LIBEXECDIR "/gnome-session-ctl"));
+        g_ptr_array_add (argv, g_strdup ("--shutdown"));
+        g_ptr_array_add (argv, g_strdup ("--keep"));
+        g_ptr_array_add (argv, g_strdup (service));
+
+        /* The session target has the runlevel's name */
+        runlevel = rc_runlevel_get ();
+        if (runlevel != NULL) {
+                g_ptr_array_add (argv, g_strdup ("--keep"));
+                g_ptr_array_add (argv, g_strdup (runlevel));
+                free (runlevel);
         }
+        g_ptr_array_add (argv, NULL);
 
-        g_dir_close (dir);
+        if (!g_spawn_async (NULL, (char **) argv->pdata, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                            NULL, NULL, &pid, &error)) {
+                g_warning ("GsmManager: failed to stop the session services: %s", error->message);
+                return FALSE;
+        }
 
+        g_child_watch_add (pid, on_session_services_stopped, manager);
         return TRUE;
 }
+#endif
 
 static void
 on_shutdown_prepared (GsmSystem  *system,
@@ -2435,17 +3455,43 @@ on_shutdown_prepared (GsmSystem  *system,
         g_debug ("GsmManager: on_shutdown_prepared, success: %d", success);
         g_signal_handlers_disconnect_by_func (system, on_shutdown_prepared, manager);
 
-        if (success) {
-                /* move to end-session phase */
-                g_assert (manager->phase == GSM_MANAGER_PHASE_QUERY_END_SESSION);
-                manager->phase++;
-                start_phase (manager);
-        } else {
-                disconnect_shell_dialog_signals (manager);
-                gsm_shell_close_end_session_dialog (manager->shell);
-                /* back to running phase */
-                cancel_end_session (manager);
+        if (!manager->shutdown_pipelined)
+                return;
+
+        if (!success) {
+                abort_shutdown_pipeline (manager);
+                return;
         }
+
+        shutdown_leg_done (manager, SHUTDOWN_LEG_PREPARE);
+
+#ifdef USE_OPENRC
+        if (!stop_session_services (manager))
+#endif
+                shutdown_leg_done (manager, SHUTDOWN_LEG_SERVICES);
+
+        /* move to end-session phase, which only ends once the services
+         * are down too */
+        g_assert (manager->phase == GSM_MANAGER_PHASE_QUERY_END_SESSION);
+        manager->phase++;
+        start_phase (manager);
+}
+
+static void
+begin_shutdown_pipeline (GsmManager *manager)
+{
+        manager->shutdown_pipelined = TRUE;
+        manager->shutdown_started = g_get_monotonic_time ();
+        memset (manager->shutdown_leg_done, 0, sizeof (manager->shutdown_leg_done));
+
+        manager->shutdown_timeout_id = g_timeout_add_seconds (SHUTDOWN_PIPELINE_TIMEOUT_SECONDS,
+                                                              on_shutdown_pipeline_timeout,
+                                                              manager);
+
+        g_signal_connect (manager->system, "shutdown-prepared",
+                          G_CALLBACK (on_shutdown_prepared), manager);
+        gsm_system_prepare_shutdown (manager->system,
+                                     manager->logout_type == GSM_MANAGER_LOGOUT_REBOOT);
 }
 
 static gboolean
@@ -2455,10 +3501,7 @@ do_query_end_session_exit (GsmManager *manager)
             manager->logout_type != GSM_MANAGER_LOGOUT_REBOOT)
                 return TRUE; /* Continue to end session phase */
 
-        g_signal_connect (manager->system, "shutdown-prepared",
-                          G_CALLBACK (on_shutdown_prepared), manager);
-        gsm_system_prepare_shutdown (manager->system,
-                                     manager->logout_type == GSM_MANAGER_LOGOUT_REBOOT);
+        begin_shutdown_pipeline (manager);
 
         return FALSE; /* don't leave query end session yet */
 }
@@ -0,0 +1,392 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <rc.h>
+
+#include "gsm-openrc.h"
+
+/*
+ * Startup trace
+ *
+ * Each line is "<monotonic usec> <event> <subject> [<detail>]". The leader
+ * truncates the file when a login begins; the leader and gnome-session-service
+ * then append to it independently. Lines are written with a single O_APPEND
+ * write so the two processes don't interleave.
+ */
+
+static int trace_fd = -1;
+
+char *
+gsm_openrc_trace_get_path (void)
+{
+        return g_build_filename (g_get_user_state_dir (),
+                                 "gnome-session",
+                                 "startup.trace",
+                                 NULL);
+}
+
+static int
+trace_open (int flags)
+{
+        g_autofree char *path = NULL;
+        g_autofree char *dir = NULL;
+
+        path = gsm_openrc_trace_get_path ();
+        dir = g_path_get_dirname (path);
+        if (g_mkdir_with_parents (dir, 0700) < 0) {
+                g_debug ("Couldn't create %s: %m", dir);
+                return -1;
+        }
+
+        return g_open (path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0600);
+}
+
+/**
+ * gsm_openrc_trace_begin:
+ *
+ * Starts a fresh trace for this login, discarding the previous one.
+ */
+void
+gsm_openrc_trace_begin (void)
+{
+        if (trace_fd >= 0)
+                g_close (trace_fd, NULL);
+
+        trace_fd = trace_open (O_TRUNC | O_APPEND);
+        gsm_openrc_trace (GSM_OPENRC_TRACE_LOGIN, g_get_user_name (), NULL);
+}
+
+void
+gsm_openrc_trace (const char *event,
+                  const char *subject,
+                  const char *detail)
+{
+        g_autofree char *line = NULL;
+
+        if (trace_fd < 0) {
+                trace_fd = trace_open (O_APPEND);
+                if (trace_fd < 0)
+                        return;
+        }
+
+        line = g_strdup_printf ("%" G_GINT64_FORMAT " %s %s%s%s\n",
+                                g_get_monotonic_time (),
+                                event,
+                                subject,
+                                detail != NULL ? " " : "",
+                                detail != NULL ? detail : "");
+
+        if (write (trace_fd, line, strlen (line)) < 0)
+                g_debug ("Couldn't write startup trace: %m");
+}
+
+/*
+ * Readiness notification
+ *
+ * supervise-daemon's notify="socket:ready" speaks the sd_notify datagram
+ * protocol: it sets NOTIFY_SOCKET for the daemon and only reports the
+ * service as started once it receives READY=1. libelogind's sd_notify()
+ * is a no-op, so we do it ourselves.
+ */
+
+static char *notify_socket = NULL;
+static gboolean notify_socket_checked = FALSE;
+
+gboolean
+gsm_openrc_notify (const char *state)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        socklen_t addr_len;
+        size_t path_len;
+        int fd;
+        gboolean ret;
+
+        if (!notify_socket_checked) {
+                notify_socket_checked = TRUE;
+                notify_socket = g_strdup (g_getenv ("NOTIFY_SOCKET"));
+
+                /* Don't leak the socket to the apps we spawn */
+                g_unsetenv ("NOTIFY_SOCKET");
+        }
+
+        if (notify_socket == NULL)
+                return FALSE;
+
+        path_len = strlen (notify_socket);
+        if (path_len == 0 || path_len >= sizeof (addr.sun_path) ||
+            (notify_socket[0] != '/' && notify_socket[0] != '@')) {
+                g_debug ("Ignoring invalid NOTIFY_SOCKET '%s'", notify_socket);
+                return FALSE;
+        }
+
+        memcpy (addr.sun_path, notify_socket, path_len);
+        if (addr.sun_path[0] == '@')
+                addr.sun_path[0] = '\0';
+        addr_len = offsetof (struct sockaddr_un, sun_path) + path_len;
+
+        fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                g_debug ("Couldn't create notify socket: %m");
+                return FALSE;
+        }
+
+        ret = sendto (fd, state, strlen (state), MSG_NOSIGNAL,
+                      (struct sockaddr *) &addr, addr_len) >= 0;
+        if (!ret)
+                g_debug ("Couldn't notify service manager: %m");
+
+        close (fd);
+
+        return ret;
+}
+
+/*
+ * Service control
+ *
+ * There is no librc entry point to start or stop a service; that is done
+ * by running the init script through openrc-run. What we can do is resolve
+ * each script once, fire off a whole batch of actions at the same time and
+ * reap every child through a child watch, so callers learn whether the
+ * actions actually succeeded and we don't leave zombies behind.
+ */
+
+typedef struct {
+        guint    n_pending;
+        GString *failures;
+} ServiceBatch;
+
+typedef struct {
+        GTask *task;
+        char  *service;
+} ServiceJob;
+
+static GHashTable *resolved_services = NULL;
+
+static const char *
+resolve_service (const char *service)
+{
+        char *path;
+
+        if (resolved_services == NULL)
+                resolved_services = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, g_free);
+
+        path = g_hash_table_lookup (resolved_services, service);
+        if (path != NULL)
+                return path;
+
+        path = rc_service_resolve (service);
+        if (path == NULL)
+                return NULL;
+
+        g_hash_table_insert (resolved_services, g_strdup (service), path);
+
+        return path;
+}
+
+static void
+service_batch_free (ServiceBatch *batch)
+{
+        g_string_free (batch->failures, TRUE);
+        g_free (batch);
+}
+
+static void
+service_batch_add_failure (ServiceBatch *batch,
+                           const char   *service,
+                           const char   *message)
+{
+        if (batch->failures->len > 0)
+                g_string_append (batch->failures, "; ");
+        g_string_append_printf (batch->failures, "%s: %s", service, message);
+}
+
+static void
+service_batch_complete (GTask *task)
+{
+        ServiceBatch *batch = g_task_get_task_data (task);
+
+        if (batch->n_pending > 0)
+                return;
+
+        if (g_task_return_error_if_cancelled (task))
+                return;
+
+        if (batch->failures->len > 0)
+                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                         "%s", batch->failures->str);
+        else
+                g_task_return_boolean (task, TRUE);
+}
+
+static void
+service_job_child_watch_cb (GPid     pid,
+                            gint     wait_status,
+                            gpointer user_data)
+{
+        ServiceJob *job = user_data;
+        ServiceBatch *batch = g_task_get_task_data (job->task);
+        g_autoptr (GError) error = NULL;
+
+        g_spawn_close_pid (pid);
+
+        if (!g_spawn_check_wait_status (wait_status, &error))
+                service_batch_add_failure (batch, job->service, error->message);
+
+        batch->n_pending--;
+        service_batch_complete (job->task);
+
+        g_object_unref (job->task);
+        g_free (job->service);
+        g_free (job);
+}
+
+static void
+service_batch_spawn (GTask       *task,
+                     const char  *name,
+                     char       **argv)
+{
+        ServiceBatch *batch = g_task_get_task_data (task);
+        g_autoptr (GError) error = NULL;
+        ServiceJob *job;
+        GPid pid;
+
+        if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                            NULL, NULL, &pid, &error)) {
+                service_batch_add_failure (batch, name, error->message);
+                return;
+        }
+
+        job = g_new0 (ServiceJob, 1);
+        job->task = g_object_ref (task);
+        job->service = g_strdup (name);
+
+        batch->n_pending++;
+        g_child_watch_add (pid, service_job_child_watch_cb, job);
+}
+
+static GTask *
+service_batch_new (gpointer             source_tag,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             user_data)
+{
+        GTask *task;
+        ServiceBatch *batch;
+
+        task = g_task_new (NULL, cancellable, callback, user_data);
+        g_task_set_source_tag (task, source_tag);
+
+        batch = g_new0 (ServiceBatch, 1);
+        batch->failures = g_string_new (NULL);
+        g_task_set_task_data (task, batch, (GDestroyNotify) service_batch_free);
+
+        return task;
+}
+
+/**
+ * gsm_openrc_services_action_async:
+ * @services: %NULL-terminated list of service names
+ * @action: the openrc-run action, e.g. "start" or "stop"
+ *
+ * Runs @action on all @services at once. The operation completes when
+ * every action has finished and fails if any of them did, naming each
+ * service that failed.
+ */
+void
+gsm_openrc_services_action_async (const char * const  *services,
+                                  const char          *action,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+        g_autoptr (GTask) task = NULL;
+
+        task = service_batch_new (gsm_openrc_services_action_async,
+                                  cancellable, callback, user_data);
+
+        for (guint i = 0; services[i] != NULL; i++) {
+                const char *path;
+
+                path = resolve_service (services[i]);
+                if (path == NULL) {
+                        service_batch_add_failure (g_task_get_task_data (task),
+                                                   services[i], "couldn't resolve service");
+                        continue;
+                }
+
+                gchar *argv[] = { (gchar *) path, "-U", (gchar *) action, NULL };
+
+                g_debug ("Running %s %s", services[i], action);
+                service_batch_spawn (task, services[i], argv);
+        }
+
+        service_batch_complete (task);
+}
+
+gboolean
+gsm_openrc_services_action_finish (GAsyncResult  *result,
+                                   GError       **error)
+{
+        g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+        return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * gsm_openrc_runlevel_async:
+ * @runlevel: the user runlevel to enter
+ *
+ * Switches the user's service manager to @runlevel, starting and stopping
+ * services as needed.
+ */
+void
+gsm_openrc_runlevel_async (const char          *runlevel,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+        g_autoptr (GTask) task = NULL;
+        gchar *argv[] = { "/usr/bin/openrc", "-U", (gchar *) runlevel, NULL };
+
+        task = service_batch_new (gsm_openrc_runlevel_async,
+                                  cancellable, callback, user_data);
+
+        // No way that i'm aware of to enter a user runlevel from librc :/
+        service_batch_spawn (task, runlevel, argv);
+        service_batch_complete (task);
+}
+
+gboolean
+gsm_openrc_runlevel_finish (GAsyncResult  *result,
+                            GError       **error)
+{
+        g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+        return g_task_propagate_boolean (G_TASK (result), error);
+}
@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GSM_OPENRC_H__
+#define __GSM_OPENRC_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Startup trace events, read back by `gnome-session-ctl --analyze` */
+#define GSM_OPENRC_TRACE_LOGIN    "login"
+#define GSM_OPENRC_TRACE_TARGET   "target"
+#define GSM_OPENRC_TRACE_NEED     "need"
+#define GSM_OPENRC_TRACE_REQUEST  "request"
+#define GSM_OPENRC_TRACE_START    "start"
+#define GSM_OPENRC_TRACE_READY    "ready"
+#define GSM_OPENRC_TRACE_FAIL     "fail"
+#define GSM_OPENRC_TRACE_PHASE    "phase"
+#define GSM_OPENRC_TRACE_STEP     "step"
+
+char *          gsm_openrc_trace_get_path (void);
+void            gsm_openrc_trace_begin    (void);
+void            gsm_openrc_trace          (const char *event,
+                                           const char *subject,
+                                           const char *detail);
+
+gboolean        gsm_openrc_notify         (const char *state);
+
+void            gsm_openrc_services_action_async  (const char * const  *services,
+                                                   const char          *action,
+                                                   GCancellable        *cancellable,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+gboolean        gsm_openrc_services_action_finish (GAsyncResult        *result,
+                                                   GError             **error);
+
+void            gsm_openrc_runlevel_async         (const char          *runlevel,
+                                                   GCancellable        *cancellable,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+gboolean        gsm_openrc_runlevel_finish        (GAsyncResult        *result,
+                                                   GError             **error);
+
+G_END_DECLS
+
+#endif /* __GSM_OPENRC_H__ */
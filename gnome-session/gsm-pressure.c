@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "gsm-pressure.h"
+
+/**
+ * gsm_pressure_read:
+ * @resource: "cpu", "io" or "memory"
+ * @avg10: (out): the "some avg10" percentage
+ *
+ * Returns: %FALSE if the kernel doesn't provide PSI for @resource.
+ */
+gboolean
+gsm_pressure_read (const char *resource,
+                   double     *avg10)
+{
+        g_autofree char *path = NULL;
+        g_autofree char *contents = NULL;
+        const char *value;
+
+        path = g_build_filename ("/proc/pressure", resource, NULL);
+        if (!g_file_get_contents (path, &contents, NULL, NULL))
+                return FALSE;
+
+        value = strstr (contents, "some avg10=");
+        if (value == NULL)
+                return FALSE;
+
+        *avg10 = g_ascii_strtod (value + strlen ("some avg10="), NULL);
+        return TRUE;
+}
+
+/**
+ * gsm_pressure_read_load:
+ * @load_per_cpu: (out): the 1 minute load average divided by the number
+ *   of CPUs
+ *
+ * A rougher measure than gsm_pressure_read(), for kernels without PSI.
+ */
+gboolean
+gsm_pressure_read_load (double *load_per_cpu)
+{
+        g_autofree char *contents = NULL;
+        char *end;
+        double load;
+
+        if (!g_file_get_contents ("/proc/loadavg", &contents, NULL, NULL))
+                return FALSE;
+
+        load = g_ascii_strtod (contents, &end);
+        if (end == contents)
+                return FALSE;
+
+        *load_per_cpu = load / g_get_num_processors ();
+        return TRUE;
+}
@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GSM_PRESSURE_H__
+#define __GSM_PRESSURE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean        gsm_pressure_read      (const char *resource,
+                                        double     *avg10);
+gboolean        gsm_pressure_read_load (double     *load_per_cpu);
+
+G_END_DECLS
+
+#endif /* __GSM_PRESSURE_H__ */
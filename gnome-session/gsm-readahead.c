@@ -0,0 +1,407 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "gsm-openrc.h"
+#include "gsm-readahead.h"
+
+/*
+ * Learned readahead
+ *
+ * Some time into a login, when the shell and the settings daemons are up,
+ * we look at the files mapped by the user's processes and use mincore() to
+ * see how much of each is actually in the page cache. That list is saved,
+ * and at the start of the next login a few threads ask the kernel to read
+ * those ranges back in with posix_fadvise(WILLNEED) while the leader is
+ * busy with the bus and the runlevel, so the daemons don't have to fault
+ * their libraries in one page at a time.
+ *
+ * The list is ordered by how many processes map a file, so shared libraries
+ * come first, and replay stops once GNOME_SESSION_READAHEAD_BUDGET MiB
+ * (default 128, 0 disables readahead) have been requested.
+ *
+ * Version, [(path, mtime, length)]
+ */
+#define LIST_VERSION 1
+#define LIST_TYPE "(ua(sxt))"
+
+#define DEFAULT_BUDGET_MB 128
+#define MAX_REPLAY_THREADS 4
+/* Files bigger than this are mapped for mincore() in pieces */
+#define MINCORE_CHUNK (64 * 1024 * 1024)
+
+typedef struct {
+        char    *path;
+        gint64   mtime;
+        guint64  length;
+        guint    n_mappers;
+} ReadaheadFile;
+
+static void
+readahead_file_free (ReadaheadFile *file)
+{
+        g_free (file->path);
+        g_free (file);
+}
+
+static char *
+get_list_path (void)
+{
+        return g_build_filename (g_get_user_cache_dir (),
+                                 "gnome-session",
+                                 "readahead.list",
+                                 NULL);
+}
+
+static guint64
+get_budget (void)
+{
+        const char *budget_string;
+
+        budget_string = g_getenv ("GNOME_SESSION_READAHEAD_BUDGET");
+        if (budget_string == NULL)
+                return (guint64) DEFAULT_BUDGET_MB * 1024 * 1024;
+
+        return g_ascii_strtoull (budget_string, NULL, 10) * 1024 * 1024;
+}
+
+static gint64
+stat_mtime (const struct stat *st)
+{
+        return (gint64) st->st_mtim.tv_sec * G_USEC_PER_SEC + st->st_mtim.tv_nsec / 1000;
+}
+
+/* Replay */
+
+static void
+replay_file (gpointer data,
+             gpointer user_data)
+{
+        ReadaheadFile *file = data;
+        struct stat st;
+        int fd;
+
+        fd = open (file->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                goto out;
+
+        /* Don't bother with files that changed since they were recorded,
+         * the pages we saw in the cache may not be the ones needed now. */
+        if (fstat (fd, &st) == 0 && stat_mtime (&st) == file->mtime)
+                posix_fadvise (fd, 0, (off_t) file->length, POSIX_FADV_WILLNEED);
+
+        close (fd);
+out:
+        readahead_file_free (file);
+}
+
+static gpointer
+replay_thread (gpointer user_data)
+{
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GMappedFile) mapped = NULL;
+        g_autoptr(GBytes) bytes = NULL;
+        g_autoptr(GVariant) root = NULL;
+        g_autoptr(GVariantIter) files = NULL;
+        g_autofree char *path = NULL;
+        g_autofree char *detail = NULL;
+        GThreadPool *pool;
+        const char *file_path;
+        guint64 budget;
+        guint64 requested = 0;
+        guint64 length;
+        gint64 mtime;
+        gint64 start;
+        guint32 version;
+        guint n_files = 0;
+
+        start = g_get_monotonic_time ();
+        budget = get_budget ();
+
+        path = get_list_path ();
+        mapped = g_mapped_file_new (path, FALSE, &error);
+        if (mapped == NULL) {
+                if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                        g_debug ("GsmReadahead: can't map %s: %s", path, error->message);
+                return NULL;
+        }
+
+        bytes = g_mapped_file_get_bytes (mapped);
+        root = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (LIST_TYPE),
+                                                             bytes, FALSE));
+        g_variant_get (root, "(ua(sxt))", &version, &files);
+        if (version != LIST_VERSION)
+                return NULL;
+
+        pool = g_thread_pool_new (replay_file, NULL, MAX_REPLAY_THREADS, FALSE, &error);
+        if (pool == NULL) {
+                g_warning ("Failed to start readahead: %s", error->message);
+                return NULL;
+        }
+
+        while (g_variant_iter_next (files, "(&sxt)", &file_path, &mtime, &length)) {
+                ReadaheadFile *file;
+
+                if (requested + length > budget)
+                        continue;
+                requested += length;
+
+                file = g_new0 (ReadaheadFile, 1);
+                file->path = g_strdup (file_path);
+                file->mtime = mtime;
+                file->length = length;
+                g_thread_pool_push (pool, file, NULL);
+                n_files++;
+        }
+
+        g_thread_pool_free (pool, FALSE, TRUE);
+
+        g_debug ("GsmReadahead: requested %" G_GUINT64_FORMAT " KiB in %u files",
+                 requested / 1024, n_files);
+
+        detail = g_strdup_printf ("%" G_GINT64_FORMAT, g_get_monotonic_time () - start);
+        gsm_openrc_trace (GSM_OPENRC_TRACE_STEP, "readahead", detail);
+
+        return NULL;
+}
+
+/**
+ * gsm_readahead_replay:
+ *
+ * Starts reading the files recorded during the previous login into the
+ * page cache, in the background.
+ */
+void
+gsm_readahead_replay (void)
+{
+        if (get_budget () == 0)
+                return;
+
+        g_thread_unref (g_thread_new ("gsm-readahead", replay_thread, NULL));
+}
+
+/* Recording */
+
+static guint64
+resident_length (int     fd,
+                 guint64 size)
+{
+        guint64 page_size = (guint64) sysconf (_SC_PAGESIZE);
+        g_autofree unsigned char *vec = NULL;
+        guint64 resident = 0;
+
+        vec = g_malloc (MINCORE_CHUNK / page_size);
+
+        for (guint64 offset = 0; offset < size; offset += MINCORE_CHUNK) {
+                guint64 len = MIN (size - offset, MINCORE_CHUNK);
+                guint64 n_pages = (len + page_size - 1) / page_size;
+                void *addr;
+
+                addr = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, (off_t) offset);
+                if (addr == MAP_FAILED)
+                        break;
+
+                if (mincore (addr, len, vec) == 0) {
+                        for (guint64 i = n_pages; i > 0; i--) {
+                                if (vec[i - 1] & 1) {
+                                        resident = offset + i * page_size;
+                                        break;
+                                }
+                        }
+                }
+
+                munmap (addr, len);
+        }
+
+        return MIN (resident, size);
+}
+
+/* Adds the regular files mapped by @pid to @files, counting each process
+ * only once per file. */
+static void
+collect_mappings (const char *pid,
+                  GHashTable *files)
+{
+        g_autofree char *maps_path = NULL;
+        g_autofree char *contents = NULL;
+        g_autoptr(GHashTable) seen = NULL;
+        g_auto(GStrv) lines = NULL;
+
+        maps_path = g_build_filename ("/proc", pid, "maps", NULL);
+        if (!g_file_get_contents (maps_path, &contents, NULL, NULL))
+                return;
+
+        seen = g_hash_table_new (g_str_hash, g_str_equal);
+        lines = g_strsplit (contents, "\n", -1);
+        for (guint i = 0; lines[i] != NULL; i++) {
+                ReadaheadFile *file;
+                const char *path;
+
+                /* address perms offset dev inode pathname */
+                path = strchr (lines[i], '/');
+                if (path == NULL || g_str_has_suffix (path, " (deleted)"))
+                        continue;
+                if (g_str_has_prefix (path, "/dev/") ||
+                    g_str_has_prefix (path, "/memfd:") ||
+                    g_str_has_prefix (path, "/run/") ||
+                    g_str_has_prefix (path, "/tmp/"))
+                        continue;
+                if (!g_hash_table_add (seen, (gpointer) path))
+                        continue;
+
+                file = g_hash_table_lookup (files, path);
+                if (file == NULL) {
+                        file = g_new0 (ReadaheadFile, 1);
+                        file->path = g_strdup (path);
+                        g_hash_table_insert (files, file->path, file);
+                }
+                file->n_mappers++;
+        }
+}
+
+static int
+compare_files (gconstpointer a,
+               gconstpointer b)
+{
+        const ReadaheadFile *fa = *(ReadaheadFile **) a;
+        const ReadaheadFile *fb = *(ReadaheadFile **) b;
+
+        if (fa->n_mappers != fb->n_mappers)
+                return fa->n_mappers > fb->n_mappers ? -1 : 1;
+        return strcmp (fa->path, fb->path);
+}
+
+static gpointer
+record_thread (gpointer user_data)
+{
+        g_autoptr(GHashTable) files = NULL;
+        g_autoptr(GPtrArray) sorted = NULL;
+        g_autoptr(GDir) proc = NULL;
+        g_autoptr(GVariant) root = NULL;
+        g_autoptr(GError) error = NULL;
+        g_autofree char *path = NULL;
+        g_autofree char *dirname = NULL;
+        GVariantBuilder builder;
+        GHashTableIter iter;
+        ReadaheadFile *file;
+        const char *name;
+        uid_t uid = getuid ();
+
+        files = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify) readahead_file_free);
+
+        proc = g_dir_open ("/proc", 0, NULL);
+        if (proc == NULL)
+                return NULL;
+
+        while ((name = g_dir_read_name (proc)) != NULL) {
+                g_autofree char *pid_dir = NULL;
+                struct stat st;
+
+                if (!g_ascii_isdigit (name[0]))
+                        continue;
+
+                pid_dir = g_build_filename ("/proc", name, NULL);
+                if (stat (pid_dir, &st) < 0 || st.st_uid != uid)
+                        continue;
+
+                collect_mappings (name, files);
+        }
+
+        sorted = g_ptr_array_new ();
+        g_hash_table_iter_init (&iter, files);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &file)) {
+                struct stat st;
+                int fd;
+
+                fd = open (file->path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                        continue;
+
+                if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0) {
+                        file->mtime = stat_mtime (&st);
+                        file->length = resident_length (fd, (guint64) st.st_size);
+                        if (file->length > 0)
+                                g_ptr_array_add (sorted, file);
+                }
+
+                close (fd);
+        }
+
+        g_ptr_array_sort (sorted, compare_files);
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sxt)"));
+        for (guint i = 0; i < sorted->len; i++) {
+                file = g_ptr_array_index (sorted, i);
+                g_variant_builder_add (&builder, "(sxt)", file->path, file->mtime, file->length);
+        }
+        root = g_variant_ref_sink (g_variant_new ("(ua(sxt))", LIST_VERSION, &builder));
+
+        path = get_list_path ();
+        dirname = g_path_get_dirname (path);
+        if (g_mkdir_with_parents (dirname, 0700) < 0) {
+                g_warning ("Failed to create %s: %s", dirname, g_strerror (errno));
+                return NULL;
+        }
+
+        if (!g_file_set_contents (path,
+                                  g_variant_get_data (root),
+                                  g_variant_get_size (root),
+                                  &error)) {
+                g_warning ("Failed to save readahead list: %s", error->message);
+                return NULL;
+        }
+
+        g_debug ("GsmReadahead: recorded %u files", sorted->len);
+
+        return NULL;
+}
+
+static gboolean
+record_timeout_cb (gpointer user_data)
+{
+        g_thread_unref (g_thread_new ("gsm-readahead-record", record_thread, NULL));
+
+        return G_SOURCE_REMOVE;
+}
+
+/**
+ * gsm_readahead_schedule_record:
+ * @delay_seconds: how long into the login to take the snapshot
+ *
+ * Records which files the session has paged in once @delay_seconds have
+ * passed, for gsm_readahead_replay() to use next time.
+ */
+void
+gsm_readahead_schedule_record (guint delay_seconds)
+{
+        if (get_budget () == 0)
+                return;
+
+        g_timeout_add_seconds (delay_seconds, record_timeout_cb, NULL);
+}
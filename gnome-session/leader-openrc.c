@@ -18,73 +18,695 @@
  */
 
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <config.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <glib.h>
 #include <glib-unix.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
-#include <sys/syslog.h>
+#include <sys/inotify.h>
 #include <rc.h>
 
+#include "gsm-deptree-cache.h"
+#include "gsm-log-ring.h"
+#include "gsm-openrc.h"
+#include "gsm-readahead.h"
+
+typedef struct _LeaderScheduler LeaderScheduler;
+
+typedef enum {
+        LEADER_MILESTONE_SHELL,
+        LEADER_MILESTONE_SETTINGS,
+} LeaderMilestone;
+
+typedef void (*LeaderMilestoneFunc) (LeaderMilestone milestone,
+                                     gpointer        user_data);
+
 typedef struct {
         GDBusConnection *session_bus;
         GMainLoop *loop;
         int fifo_fd;
-        GDBusProxy *awaiting_shutdown;
+        int state_fd;
+        int progress_fd;
+        GString *progress;
+        GHashTable *active_services;
+        LeaderScheduler *scheduler;
+        gint64 bus_requested;
+        gint64 fifo_requested;
+        gint64 target_requested;
+        guint manager_watch_id;
+        guint milestone_timeout_id;
+        gboolean shell_ready;
+        gboolean settings_ready;
+        gboolean milestones_timed_out;
+        gboolean manager_on_bus;
+        gboolean initialized_sent;
+        gboolean settings_sent;
 } Leader;
 
+static void leader_scheduler_free (LeaderScheduler *scheduler);
+static void leader_trace_step (const char *step,
+                               gint64      since);
+
 static void
 leader_clear (Leader *ctx)
 {
+        if (ctx->manager_watch_id != 0)
+                g_bus_unwatch_name (ctx->manager_watch_id);
+        g_clear_handle_id (&ctx->milestone_timeout_id, g_source_remove);
         g_clear_object (&ctx->session_bus);
         g_clear_pointer (&ctx->loop, g_main_loop_unref);
-        g_close (ctx->fifo_fd, NULL);
-        g_clear_object (&ctx->awaiting_shutdown);
+        if (ctx->fifo_fd >= 0)
+                g_close (ctx->fifo_fd, NULL);
+        if (ctx->state_fd >= 0)
+                g_close (ctx->state_fd, NULL);
+        if (ctx->progress_fd >= 0)
+                g_close (ctx->progress_fd, NULL);
+        if (ctx->progress != NULL)
+                g_string_free (ctx->progress, TRUE);
+        g_clear_pointer (&ctx->active_services, g_hash_table_unref);
+        g_clear_pointer (&ctx->scheduler, leader_scheduler_free);
 }
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (Leader, leader_clear);
 
-static gboolean
-async_run_cmd (gchar **argv, GError **error)
+/*
+ * Session start scheduler.
+ *
+ * Rather than handing the whole runlevel to `openrc -U <target>` and
+ * letting it walk the `need` chains one service at a time, we load the
+ * dependency graph for the session target ourselves and start every service
+ * whose needs are satisfied, up to a bounded number of concurrent jobs.
+ * Services that gnome-shell (transitively) needs are on the critical path and
+ * always go to the front of the queue.
+ */
+
+#define LEADER_DEFAULT_MAX_JOBS 4
+#define LEADER_MAX_MAX_JOBS     16
+
+/* How long a service that declares a bus name gets to take it once it's
+ * been spawned */
+#define LEADER_BUS_NAME_TIMEOUT 10
+
+/* Seconds into the login at which we look at what the session paged in */
+#define LEADER_READAHEAD_RECORD_DELAY 30
+
+typedef enum {
+        LEADER_SERVICE_WAITING,
+        LEADER_SERVICE_QUEUED,
+        LEADER_SERVICE_STARTING,
+        LEADER_SERVICE_STARTED,
+        LEADER_SERVICE_FAILED,
+} LeaderServiceState;
+
+typedef struct {
+        LeaderScheduler    *scheduler;
+        char               *name;
+        GPtrArray          *needs;      /* LeaderService, not owned */
+        GPtrArray          *dependents; /* LeaderService, not owned */
+        guint               n_unmet;
+        gboolean            critical;
+        gboolean            preexisting;
+        LeaderServiceState  state;
+        /* From session-services.conf: not ready until this is owned */
+        char               *bus_name;
+        guint               name_watch_id;
+        guint               name_timeout_id;
+} LeaderService;
+
+struct _LeaderScheduler {
+        char       *runlevel;
+        char       *target;
+        GHashTable *services;           /* name -> LeaderService */
+        GQueue      critical_queue;
+        GQueue      queue;
+        guint       n_running;
+        guint       n_pending;
+        guint       n_critical_pending;
+        guint       n_failed;
+        guint       max_jobs;
+        gboolean    finished;
+        LeaderMilestoneFunc milestone_func;
+        gpointer    milestone_data;
+};
+
+static void
+leader_service_free (LeaderService *service)
 {
-        return g_spawn_async(NULL,
-                             argv,
-                             NULL,
-                             G_SPAWN_DEFAULT,
-                             NULL,
-                             NULL,
-                             NULL,
-                             error);
+        if (service->name_watch_id != 0)
+                g_bus_unwatch_name (service->name_watch_id);
+        g_clear_handle_id (&service->name_timeout_id, g_source_remove);
+        g_free (service->bus_name);
+        g_free (service->name);
+        g_ptr_array_unref (service->needs);
+        g_ptr_array_unref (service->dependents);
+        g_free (service);
 }
 
-static gboolean
-openrc_unit_action (const char       *unit,
-                    const char       *action,
-                    GError          **error)
+static LeaderService *
+leader_scheduler_ensure_service (LeaderScheduler *scheduler,
+                                 const char      *name)
 {
-        g_autofree char *service = rc_service_resolve(unit);
-        if (!service)
-        {
-                g_debug ("Couldn't resolve service '%s'", unit);
-                return FALSE;
+        LeaderService *service;
+
+        service = g_hash_table_lookup (scheduler->services, name);
+        if (service != NULL)
+                return service;
+
+        service = g_new0 (LeaderService, 1);
+        service->scheduler = scheduler;
+        service->name = g_strdup (name);
+        service->needs = g_ptr_array_new ();
+        service->dependents = g_ptr_array_new ();
+        service->state = LEADER_SERVICE_WAITING;
+        g_hash_table_insert (scheduler->services, service->name, service);
+
+        return service;
+}
+
+static void
+leader_scheduler_free (LeaderScheduler *scheduler)
+{
+        g_queue_clear (&scheduler->critical_queue);
+        g_queue_clear (&scheduler->queue);
+        g_hash_table_unref (scheduler->services);
+        g_free (scheduler->runlevel);
+        g_free (scheduler->target);
+        g_free (scheduler);
+}
+
+static guint
+leader_get_max_jobs (void)
+{
+        const char *jobs_string;
+        guint jobs;
+
+        jobs_string = g_getenv ("GNOME_SESSION_MAX_JOBS");
+        if (jobs_string != NULL)
+                jobs = (guint) atoi (jobs_string);
+        else
+                jobs = MAX (g_get_num_processors (), LEADER_DEFAULT_MAX_JOBS);
+
+        return CLAMP (jobs, 1, LEADER_MAX_MAX_JOBS);
+}
+
+static void
+leader_service_mark_critical (LeaderService *service)
+{
+        if (service->critical)
+                return;
+
+        service->critical = TRUE;
+        for (guint i = 0; i < service->needs->len; i++)
+                leader_service_mark_critical (g_ptr_array_index (service->needs, i));
+}
+
+/*
+ * Resolves the services @target transitively needs with librc, in start
+ * order, each with the needs that are part of the same graph. This is the
+ * expensive part: OpenRC may have to rebuild its dependency tree first.
+ *
+ * Returns: a %GSM_DEPTREE_GRAPH_TYPE variant, or %NULL if the dependency
+ * tree can't be loaded.
+ */
+static GVariant *
+leader_resolve_graph (const char *runlevel,
+                      const char *target)
+{
+        RC_DEPTREE *deptree;
+        RC_STRINGLIST *types;
+        RC_STRINGLIST *targets;
+        RC_STRINGLIST *order;
+        RC_STRING *item;
+        g_autoptr (GPtrArray) names = NULL;
+        g_autoptr (GHashTable) in_graph = NULL;
+        GVariantBuilder builder;
+
+        if (rc_deptree_update_needed (NULL, NULL) && !rc_deptree_update ())
+                g_warning ("Failed to update the OpenRC dependency tree");
+
+        deptree = rc_deptree_load ();
+        if (deptree == NULL) {
+                g_warning ("Failed to load the OpenRC dependency tree");
+                return NULL;
         }
-        gchar *argv[] = { service, "-U", action, NULL };
-        gboolean res = async_run_cmd(argv, error);
-        return res;
+
+        types = rc_stringlist_new ();
+        rc_stringlist_add (types, "ineed");
+        targets = rc_stringlist_new ();
+        rc_stringlist_add (targets, target);
+
+        order = rc_deptree_depends (deptree, types, targets, runlevel,
+                                    RC_DEP_TRACE | RC_DEP_START);
+
+        names = g_ptr_array_new ();
+        in_graph = g_hash_table_new (g_str_hash, g_str_equal);
+
+        g_ptr_array_add (names, (gpointer) target);
+        g_hash_table_add (in_graph, (gpointer) target);
+        if (order != NULL) {
+                TAILQ_FOREACH (item, order, entries) {
+                        if (g_hash_table_add (in_graph, item->value))
+                                g_ptr_array_add (names, item->value);
+                }
+        }
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE (GSM_DEPTREE_GRAPH_TYPE));
+        for (guint i = 0; i < names->len; i++) {
+                const char *name = g_ptr_array_index (names, i);
+                RC_STRINGLIST *needs;
+                RC_STRING *need;
+
+                g_variant_builder_open (&builder, G_VARIANT_TYPE ("(sas)"));
+                g_variant_builder_add (&builder, "s", name);
+                g_variant_builder_open (&builder, G_VARIANT_TYPE ("as"));
+
+                needs = rc_deptree_depend (deptree, name, "ineed");
+                if (needs != NULL) {
+                        TAILQ_FOREACH (need, needs, entries) {
+                                /* Not part of the trace, so it's either already
+                                 * up or OpenRC will complain on its own. */
+                                if (g_hash_table_contains (in_graph, need->value))
+                                        g_variant_builder_add (&builder, "s", need->value);
+                        }
+                        rc_stringlist_free (needs);
+                }
+
+                g_variant_builder_close (&builder);
+                g_variant_builder_close (&builder);
+        }
+
+        if (order != NULL)
+                rc_stringlist_free (order);
+        rc_stringlist_free (targets);
+        rc_stringlist_free (types);
+        rc_deptree_free (deptree);
+
+        return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
-static gboolean
-openrc_start_unit (const char       *unit,
-                   GError          **error)
+/*
+ * A session service that owns a bus name can say so in session-services.conf
+ * with BusName=. supervise-daemon reports it started as soon as it has
+ * forked, so we only count it as ready, and start what needs it, once the
+ * name has an owner. Services with a Class aren't started by us, their
+ * BusName means something else.
+ */
+static void
+leader_scheduler_load_bus_names (LeaderScheduler *scheduler)
+{
+        g_autoptr (GKeyFile) keyfile = NULL;
+        g_autoptr (GError) error = NULL;
+        GHashTableIter iter;
+        LeaderService *service;
+
+        keyfile = g_key_file_new ();
+        if (!g_key_file_load_from_file (keyfile, DATA_DIR "/session-services.conf",
+                                        G_KEY_FILE_NONE, &error)) {
+                g_debug ("Not waiting for any bus names: %s", error->message);
+                return;
+        }
+
+        g_hash_table_iter_init (&iter, scheduler->services);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                if (g_key_file_has_key (keyfile, service->name, "Class", NULL))
+                        continue;
+
+                service->bus_name = g_key_file_get_string (keyfile, service->name,
+                                                           "BusName", NULL);
+                if (service->bus_name != NULL &&
+                    (!g_dbus_is_name (service->bus_name) || g_dbus_is_unique_name (service->bus_name))) {
+                        g_warning ("Ignoring invalid BusName %s of %s",
+                                   service->bus_name, service->name);
+                        g_clear_pointer (&service->bus_name, g_free);
+                }
+        }
+}
+
+/**
+ * leader_scheduler_new:
+ * @runlevel: the user runlevel the session is started in
+ * @target: the session target service, e.g. `gnome-session-wayland.gnome`
+ *
+ * Builds the start graph for @target, from the cached snapshot if none of
+ * the init scripts changed since it was taken and from the OpenRC dependency
+ * tree otherwise. Services which are already started (like the user's dbus)
+ * are treated as satisfied needs.
+ *
+ * Returns: the scheduler, or %NULL if the dependency tree can't be loaded.
+ */
+static LeaderScheduler *
+leader_scheduler_new (const char *runlevel,
+                      const char *target)
+{
+        g_autoptr (GVariant) fingerprint = NULL;
+        g_autoptr (GVariant) graph = NULL;
+        LeaderScheduler *scheduler;
+        GVariantIter graph_iter;
+        GHashTableIter iter;
+        LeaderService *service;
+        const char *name;
+        const char **needs;
+
+        graph = gsm_deptree_cache_lookup (runlevel, target, &fingerprint);
+        if (graph == NULL) {
+                graph = leader_resolve_graph (runlevel, target);
+                if (graph == NULL)
+                        return NULL;
+                gsm_deptree_cache_store (runlevel, target, fingerprint, graph);
+        }
+
+        scheduler = g_new0 (LeaderScheduler, 1);
+        scheduler->runlevel = g_strdup (runlevel);
+        scheduler->target = g_strdup (target);
+        scheduler->services = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     NULL, (GDestroyNotify) leader_service_free);
+        scheduler->max_jobs = leader_get_max_jobs ();
+        g_queue_init (&scheduler->critical_queue);
+        g_queue_init (&scheduler->queue);
+
+        g_variant_iter_init (&graph_iter, graph);
+        while (g_variant_iter_next (&graph_iter, "(&s@as)", &name, NULL))
+                leader_scheduler_ensure_service (scheduler, name);
+
+        g_variant_iter_init (&graph_iter, graph);
+        while (g_variant_iter_loop (&graph_iter, "(&s^a&s)", &name, &needs)) {
+                service = g_hash_table_lookup (scheduler->services, name);
+
+                for (guint i = 0; needs[i] != NULL; i++) {
+                        LeaderService *dep;
+
+                        dep = g_hash_table_lookup (scheduler->services, needs[i]);
+                        if (dep == NULL)
+                                continue;
+
+                        g_ptr_array_add (service->needs, dep);
+                        g_ptr_array_add (dep->dependents, service);
+                        gsm_openrc_trace (GSM_OPENRC_TRACE_NEED, service->name, dep->name);
+                }
+        }
+
+        g_hash_table_iter_init (&iter, scheduler->services);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                if (g_str_has_prefix (service->name, "gnome-shell-"))
+                        leader_service_mark_critical (service);
+        }
+
+        leader_scheduler_load_bus_names (scheduler);
+
+        g_hash_table_iter_init (&iter, scheduler->services);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                if (rc_service_state (service->name) & RC_SERVICE_STARTED) {
+                        service->state = LEADER_SERVICE_STARTED;
+                        service->preexisting = TRUE;
+                        gsm_openrc_trace (GSM_OPENRC_TRACE_READY, service->name, "already-started");
+                } else {
+                        scheduler->n_pending++;
+                        if (service->critical)
+                                scheduler->n_critical_pending++;
+                }
+        }
+
+        g_hash_table_iter_init (&iter, scheduler->services);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                for (guint i = 0; i < service->needs->len; i++) {
+                        LeaderService *dep = g_ptr_array_index (service->needs, i);
+                        if (dep->state != LEADER_SERVICE_STARTED)
+                                service->n_unmet++;
+                }
+        }
+
+        g_debug ("Scheduler: %u services to start for %s (%u jobs)",
+                 scheduler->n_pending, target, scheduler->max_jobs);
+
+        return scheduler;
+}
+
+static void leader_scheduler_pump (LeaderScheduler *scheduler);
+
+static void
+leader_scheduler_enqueue (LeaderScheduler *scheduler,
+                          LeaderService   *service)
+{
+        service->state = LEADER_SERVICE_QUEUED;
+        gsm_openrc_trace (GSM_OPENRC_TRACE_REQUEST, service->name,
+                          service->critical ? "critical" : NULL);
+        if (service->critical)
+                g_queue_push_tail (&scheduler->critical_queue, service);
+        else
+                g_queue_push_tail (&scheduler->queue, service);
+}
+
+static void
+leader_runlevel_entered_cb (GObject      *source_object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+        g_autoptr (GError) error = NULL;
+
+        if (!gsm_openrc_runlevel_finish (result, &error))
+                g_warning ("Failed to enter session runlevel: %s", error->message);
+        else
+                g_debug ("Entered session runlevel");
+}
+
+static void
+leader_scheduler_finish (LeaderScheduler *scheduler)
+{
+        if (scheduler->finished)
+                return;
+        scheduler->finished = TRUE;
+
+        g_debug ("Scheduler: all session services handled, entering runlevel %s",
+                 scheduler->runlevel);
+
+        if (scheduler->n_failed > 0)
+                g_warning ("%u session services failed to start", scheduler->n_failed);
+
+        if (scheduler->milestone_func != NULL)
+                scheduler->milestone_func (LEADER_MILESTONE_SETTINGS, scheduler->milestone_data);
+
+        /* Everything in the graph is up by now, so this only records the
+         * runlevel and picks up services we didn't know about. */
+        gsm_openrc_runlevel_async (scheduler->runlevel, NULL,
+                                   leader_runlevel_entered_cb, NULL);
+}
+
+static void
+leader_scheduler_critical_settled (LeaderScheduler *scheduler,
+                                   LeaderService   *service)
+{
+        if (!service->critical)
+                return;
+
+        if (--scheduler->n_critical_pending == 0 && scheduler->milestone_func != NULL)
+                scheduler->milestone_func (LEADER_MILESTONE_SHELL, scheduler->milestone_data);
+}
+
+static void
+leader_service_failed (LeaderService *service)
+{
+        LeaderScheduler *scheduler = service->scheduler;
+
+        if (service->state == LEADER_SERVICE_FAILED)
+                return;
+
+        service->state = LEADER_SERVICE_FAILED;
+        scheduler->n_pending--;
+        scheduler->n_failed++;
+        gsm_openrc_trace (GSM_OPENRC_TRACE_FAIL, service->name, NULL);
+        leader_scheduler_critical_settled (scheduler, service);
+
+        /* Nothing that needs us can start, skip them right away instead of
+         * letting OpenRC find out one by one */
+        for (guint i = 0; i < service->dependents->len; i++) {
+                LeaderService *dependent = g_ptr_array_index (service->dependents, i);
+
+                if (dependent->state == LEADER_SERVICE_WAITING) {
+                        g_warning ("Not starting %s: needed service %s failed",
+                                   dependent->name, service->name);
+                        leader_service_failed (dependent);
+                }
+        }
+}
+
+static void
+leader_service_started (LeaderService *service,
+                        const char    *detail)
+{
+        LeaderScheduler *scheduler = service->scheduler;
+
+        service->state = LEADER_SERVICE_STARTED;
+        scheduler->n_pending--;
+        gsm_openrc_trace (GSM_OPENRC_TRACE_READY, service->name, detail);
+        leader_scheduler_critical_settled (scheduler, service);
+
+        for (guint i = 0; i < service->dependents->len; i++) {
+                LeaderService *dependent = g_ptr_array_index (service->dependents, i);
+
+                if (dependent->state != LEADER_SERVICE_WAITING)
+                        continue;
+
+                if (--dependent->n_unmet == 0)
+                        leader_scheduler_enqueue (scheduler, dependent);
+        }
+}
+
+static void
+leader_service_stop_waiting_for_name (LeaderService *service)
 {
-        return openrc_unit_action (unit, "start", error);
+        if (service->name_watch_id != 0) {
+                g_bus_unwatch_name (service->name_watch_id);
+                service->name_watch_id = 0;
+        }
+        g_clear_handle_id (&service->name_timeout_id, g_source_remove);
+}
+
+static void
+leader_service_name_appeared_cb (GDBusConnection *connection,
+                                 const char      *name,
+                                 const char      *name_owner,
+                                 gpointer         user_data)
+{
+        LeaderService *service = user_data;
+
+        if (service->state != LEADER_SERVICE_STARTING)
+                return;
+
+        g_debug ("Scheduler: %s owns %s", service->name, name);
+        leader_service_stop_waiting_for_name (service);
+        leader_service_started (service, NULL);
+        leader_scheduler_pump (service->scheduler);
 }
 
 static gboolean
-openrc_stop_unit (const char       *unit,
-                  GError          **error)
+leader_service_name_timeout_cb (gpointer user_data)
+{
+        LeaderService *service = user_data;
+
+        service->name_timeout_id = 0;
+
+        /* Dependents may well cope without it, so don't hold them back
+         * any longer, but make it stand out in the trace */
+        g_warning ("%s didn't take %s within %d seconds of starting",
+                   service->name, service->bus_name, LEADER_BUS_NAME_TIMEOUT);
+        leader_service_stop_waiting_for_name (service);
+        leader_service_started (service, "no-bus-name");
+        leader_scheduler_pump (service->scheduler);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+leader_service_wait_for_name (LeaderService *service)
 {
-        return openrc_unit_action (unit, "stop", error);
+        g_debug ("Scheduler: %s started, waiting for it to take %s",
+                 service->name, service->bus_name);
+
+        service->name_watch_id = g_bus_watch_name (G_BUS_TYPE_SESSION,
+                                                   service->bus_name,
+                                                   G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                   leader_service_name_appeared_cb,
+                                                   NULL,
+                                                   service, NULL);
+        service->name_timeout_id = g_timeout_add_seconds (LEADER_BUS_NAME_TIMEOUT,
+                                                          leader_service_name_timeout_cb,
+                                                          service);
+}
+
+static void
+leader_service_started_cb (GObject      *source_object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+        LeaderService *service = user_data;
+        LeaderScheduler *scheduler = service->scheduler;
+        g_autoptr (GError) error = NULL;
+
+        scheduler->n_running--;
+
+        if (gsm_openrc_services_action_finish (result, &error)) {
+                /* Its job slot is free either way, the daemon is running */
+                if (service->bus_name != NULL) {
+                        leader_service_wait_for_name (service);
+                } else {
+                        g_debug ("Scheduler: %s started", service->name);
+                        leader_service_started (service, NULL);
+                }
+        } else {
+                g_warning ("Failed to start %s", error->message);
+                leader_service_failed (service);
+        }
+
+        leader_scheduler_pump (scheduler);
+}
+
+static void
+leader_service_spawn (LeaderService *service)
+{
+        LeaderScheduler *scheduler = service->scheduler;
+        const char *services[] = { service->name, NULL };
+
+        g_debug ("Scheduler: starting %s%s", service->name,
+                 service->critical ? " (critical)" : "");
+
+        service->state = LEADER_SERVICE_STARTING;
+        scheduler->n_running++;
+        gsm_openrc_trace (GSM_OPENRC_TRACE_START, service->name, NULL);
+
+        gsm_openrc_services_action_async (services, "start", NULL,
+                                          leader_service_started_cb, service);
+}
+
+static void
+leader_scheduler_pump (LeaderScheduler *scheduler)
+{
+        while (scheduler->n_running < scheduler->max_jobs) {
+                LeaderService *service;
+
+                service = g_queue_pop_head (&scheduler->critical_queue);
+                if (service == NULL)
+                        service = g_queue_pop_head (&scheduler->queue);
+                if (service == NULL)
+                        break;
+
+                leader_service_spawn (service);
+        }
+
+        if (scheduler->n_running == 0 && scheduler->n_pending == 0)
+                leader_scheduler_finish (scheduler);
+}
+
+/* @milestone_func is called with LEADER_MILESTONE_SHELL once gnome-shell and
+ * its needs have either started or failed, and with LEADER_MILESTONE_SETTINGS
+ * once every service in the graph has, before the runlevel is entered. */
+static void
+leader_scheduler_start (LeaderScheduler     *scheduler,
+                        LeaderMilestoneFunc  milestone_func,
+                        gpointer             user_data)
+{
+        GHashTableIter iter;
+        LeaderService *service;
+
+        scheduler->milestone_func = milestone_func;
+        scheduler->milestone_data = user_data;
+
+        if (scheduler->n_critical_pending == 0)
+                milestone_func (LEADER_MILESTONE_SHELL, user_data);
+
+        /* Seed the critical path first so it wins the first job slots */
+        g_hash_table_iter_init (&iter, scheduler->services);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                if (service->state == LEADER_SERVICE_WAITING && service->n_unmet == 0)
+                        leader_scheduler_enqueue (scheduler, service);
+        }
+
+        leader_scheduler_pump (scheduler);
 }
 
 static gboolean
@@ -94,6 +716,14 @@ leader_term_or_int_signal_cb (gpointer data)
 
         g_debug ("Session termination requested");
 
+        /* The FIFO is still being opened, so there's no monitor to hand the
+         * teardown to yet */
+        if (ctx->fifo_fd < 0) {
+                g_debug ("Session monitor not up yet, quitting");
+                g_main_loop_quit (ctx->loop);
+                return G_SOURCE_REMOVE;
+        }
+
         if (write (ctx->fifo_fd, "S", 1) < 0) {
                 g_warning ("Failed to signal shutdown to monitor: %m");
                 g_main_loop_quit (ctx->loop);
@@ -102,109 +732,689 @@ leader_term_or_int_signal_cb (gpointer data)
         return G_SOURCE_REMOVE;
 }
 
+#define LEADER_ACTIVE_STATES (RC_SERVICE_STARTED | RC_SERVICE_STARTING | \
+                              RC_SERVICE_STOPPING | RC_SERVICE_INACTIVE)
+
+/*
+ * Waiting for teardown
+ *
+ * OpenRC keeps a symlink per service in <svcdir>/{started,starting,stopping,
+ * inactive}, so an inotify watch on those directories tells us about every
+ * state change without having to poll. We only use the events as a wakeup
+ * and ask librc for the authoritative state of the service that changed.
+ */
+
+static GHashTable *
+leader_collect_session_services (Leader     *ctx,
+                                 const char *target)
+{
+        GHashTable *services;
+
+        services = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        if (ctx->scheduler != NULL) {
+                GHashTableIter iter;
+                LeaderService *service;
+
+                g_hash_table_iter_init (&iter, ctx->scheduler->services);
+                while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                        /* Things like the user's dbus were up before the session
+                         * and stay up after it, don't wait for them */
+                        if (!service->preexisting)
+                                g_hash_table_add (services, g_strdup (service->name));
+                }
+        } else {
+                g_hash_table_add (services, g_strdup (target));
+        }
+
+        return services;
+}
+
 static void
-graphical_session_pre_state_changed_cb (GDBusProxy  *proxy,
-                                        GVariant    *changed_properties,
-                                        char       **invalidated_properties,
-                                        gpointer     data)
+leader_check_service_stopped (Leader     *ctx,
+                              const char *name)
 {
-        Leader *ctx = data;
-        g_autoptr (GVariant) value = NULL;
-        const char *state;
+        if (!g_hash_table_contains (ctx->active_services, name))
+                return;
 
-        value = g_variant_lookup_value (changed_properties, "ActiveState", NULL);
-        if (value == NULL)
+        if (rc_service_state (name) & LEADER_ACTIVE_STATES)
                 return;
-        g_variant_get (value, "&s", &state);
 
-        if (g_strcmp0 (state, "inactive") == 0) {
-                g_debug ("Session services now inactive, quitting");
+        g_debug ("Session service %s stopped, %u left",
+                 name, g_hash_table_size (ctx->active_services) - 1);
+        g_hash_table_remove (ctx->active_services, name);
+
+        if (g_hash_table_size (ctx->active_services) == 0) {
+                g_debug ("Session services now stopped, quitting");
                 g_main_loop_quit (ctx->loop);
         }
 }
 
+static gboolean
+leader_state_dir_cb (int          fd,
+                     GIOCondition condition,
+                     gpointer     user_data)
+{
+        Leader *ctx = user_data;
+        char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        ssize_t len;
+
+        while ((len = read (fd, buf, sizeof (buf))) > 0) {
+                const struct inotify_event *event;
+
+                for (char *ptr = buf; ptr < buf + len;
+                     ptr += sizeof (struct inotify_event) + event->len) {
+                        event = (const struct inotify_event *) ptr;
+
+                        if (event->mask & IN_Q_OVERFLOW) {
+                                g_autoptr (GList) names = NULL;
+
+                                /* Lost events, recheck everything */
+                                names = g_hash_table_get_keys (ctx->active_services);
+                                for (GList *l = names; l != NULL; l = l->next)
+                                        leader_check_service_stopped (ctx, l->data);
+                        } else if (event->len > 0) {
+                                leader_check_service_stopped (ctx, event->name);
+                        }
+
+                        if (g_hash_table_size (ctx->active_services) == 0)
+                                return G_SOURCE_REMOVE;
+                }
+        }
+
+        if (len < 0 && errno != EAGAIN) {
+                g_warning ("Failed to read OpenRC state changes: %m");
+                g_main_loop_quit (ctx->loop);
+                return G_SOURCE_REMOVE;
+        }
+
+        return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+leader_watch_state_dir (Leader *ctx)
+{
+        const char *state_dirs[] = { "started", "starting", "stopping", "inactive" };
+        g_autoptr (GList) names = NULL;
+
+        ctx->state_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+        if (ctx->state_fd < 0) {
+                g_warning ("Failed to watch OpenRC state: inotify_init1 failed: %m");
+                return FALSE;
+        }
+
+        for (guint i = 0; i < G_N_ELEMENTS (state_dirs); i++) {
+                g_autofree char *path = g_build_filename (rc_svcdir (), state_dirs[i], NULL);
+
+                if (inotify_add_watch (ctx->state_fd, path,
+                                       IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0
+                    && errno != ENOENT)
+                        g_warning ("Failed to watch %s: %m", path);
+        }
+
+        g_unix_fd_add (ctx->state_fd, G_IO_IN, leader_state_dir_cb, ctx);
+
+        /* Anything that stopped before the watch was in place won't send
+         * us an event, so check the current state once now. */
+        names = g_hash_table_get_keys (ctx->active_services);
+        for (GList *l = names; l != NULL; l = l->next)
+                leader_check_service_stopped (ctx, l->data);
+
+        return TRUE;
+}
+
 static gboolean
 monitor_hangup_cb (int          fd,
                    GIOCondition condition,
                    gpointer     user_data)
 {
         Leader *ctx = user_data;
-        g_autoptr (GVariant) unit = NULL;
-        const char *unit_path = NULL;
-        g_autoptr (GDBusProxy) proxy = NULL;
-        g_autoptr (GVariant) value = NULL;
-        g_autoptr (GError) error = NULL;
 
         g_debug ("Services have begun stopping, waiting for them to finish stopping");
 
-        unit = g_dbus_connection_call_sync (ctx->session_bus,
-                                            "org.freedesktop.systemd1",
-                                            "/org/freedesktop/systemd1",
-                                            "org.freedesktop.systemd1.Manager",
-                                            "GetUnit",
-                                            g_variant_new ("(s)", "graphical-session-pre.target"),
-                                            G_VARIANT_TYPE ("(o)"),
-                                            G_DBUS_CALL_FLAGS_NONE,
-                                            -1,
-                                            NULL,
-                                            &error);
-        if (!unit) {
-                g_warning ("Could not get unit for graphical-session-pre.target: %s", error->message);
+        if (ctx->active_services == NULL ||
+            g_hash_table_size (ctx->active_services) == 0) {
+                g_debug ("No session services to wait for, quitting");
                 g_main_loop_quit (ctx->loop);
                 return G_SOURCE_REMOVE;
         }
 
-        g_variant_get (unit, "(&o)", &unit_path);
-
-        proxy = g_dbus_proxy_new_sync (ctx->session_bus,
-                                       G_DBUS_PROXY_FLAGS_NONE,
-                                       NULL,
-                                       "org.freedesktop.systemd1",
-                                       unit_path,
-                                       "org.freedesktop.systemd1.Unit",
-                                       NULL,
-                                       &error);
-        if (!proxy) {
-                g_warning ("Could not get proxy for graphical-session-pre.target unit: %s", error->message);
+        if (!leader_watch_state_dir (ctx))
                 g_main_loop_quit (ctx->loop);
-                return G_SOURCE_REMOVE;
+
+        return G_SOURCE_REMOVE;
+}
+
+/*
+ * Teardown progress.
+ *
+ * The monitor reports how stopping the session services goes, one
+ * "<event> <subject>" line at a time, through a second FIFO. We keep it
+ * open for reading and writing ourselves so it never hangs up, and the
+ * monitor simply skips reporting when we're not around.
+ */
+
+static void
+leader_progress_line (Leader *ctx,
+                      char   *line)
+{
+        const char *event = line;
+        char *subject;
+
+        subject = strchr (line, ' ');
+        if (subject == NULL)
+                return;
+        *subject++ = '\0';
+
+        if (g_str_equal (event, "done")) {
+                g_message ("Session services stopped in %s", subject);
+        } else if (g_str_equal (event, "stopped") ||
+                   g_str_equal (event, "abandoned") ||
+                   g_str_equal (event, "killed")) {
+                g_debug ("Teardown: %s %s", event, subject);
+                if (ctx->active_services != NULL)
+                        leader_check_service_stopped (ctx, subject);
+        } else {
+                g_debug ("Teardown: %s %s", event, subject);
         }
+}
 
-        value = g_dbus_proxy_get_cached_property (proxy, "ActiveState");
+static gboolean
+leader_progress_cb (int          fd,
+                    GIOCondition condition,
+                    gpointer     user_data)
+{
+        Leader *ctx = user_data;
+        char buf[512];
+        ssize_t len;
 
-        if (value) {
-                const char *state;
+        while ((len = read (fd, buf, sizeof (buf))) > 0) {
+                char *line, *end;
 
-                g_variant_get (value, "&s", &state);
+                g_string_append_len (ctx->progress, buf, len);
 
-                if (g_strcmp0 (state, "inactive") == 0) {
-                        g_debug ("State of graphical-session-pre.target unit already inactive quitting");
-                        g_main_loop_quit (ctx->loop);
-                        return G_SOURCE_REMOVE;
+                line = ctx->progress->str;
+                while ((end = strchr (line, '\n')) != NULL) {
+                        *end = '\0';
+                        leader_progress_line (ctx, line);
+                        line = end + 1;
                 }
-                g_debug ("State of graphical-session-pre.target unit is '%s', waiting for it to go inactive", state);
-        } else {
-                g_debug ("State of graphical-session-pre.target unit is unknown, waiting for it to go inactive");
+                g_string_erase (ctx->progress, 0, line - ctx->progress->str);
+        }
+
+        if (len < 0 && errno != EAGAIN) {
+                g_warning ("Failed to read teardown progress: %m");
+                return G_SOURCE_REMOVE;
         }
 
-        g_signal_connect (proxy,
-                          "g-properties-changed",
-                          G_CALLBACK (graphical_session_pre_state_changed_cb),
-                          ctx);
+        return G_SOURCE_CONTINUE;
+}
 
-        ctx->awaiting_shutdown = g_steal_pointer (&proxy);
+static void
+leader_watch_progress (Leader *ctx)
+{
+        g_autofree char *path = NULL;
+
+        path = g_build_filename (g_get_user_runtime_dir (),
+                                 "gnome-session-leader-progress",
+                                 NULL);
+        if (mkfifo (path, 0600) < 0 && errno != EEXIST) {
+                g_warning ("Failed to create teardown progress FIFO: %m");
+                return;
+        }
+
+        ctx->progress_fd = g_open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+        if (ctx->progress_fd < 0) {
+                g_warning ("Failed to open teardown progress FIFO: %m");
+                return;
+        }
+
+        ctx->progress = g_string_new (NULL);
+        g_unix_fd_add (ctx->progress_fd, G_IO_IN, leader_progress_cb, ctx);
+}
+
+static void
+open_fifo_thread (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+        const char *fifo_path = task_data;
+        int fd;
+
+        fd = g_open (fifo_path, O_WRONLY | O_CLOEXEC, 0666);
+        if (fd < 0) {
+                int errsv = errno;
+                g_task_return_new_error (task, G_IO_ERROR, g_io_error_from_errno (errsv),
+                                         "open failed: %s", g_strerror (errsv));
+                return;
+        }
+
+        g_task_return_int (task, fd);
+}
+
+static void
+fifo_opened_cb (GObject      *source_object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+        Leader *ctx = user_data;
+        g_autoptr (GError) error = NULL;
+        struct stat statbuf;
+
+        ctx->fifo_fd = g_task_propagate_int (G_TASK (result), &error);
+        if (ctx->fifo_fd < 0)
+                g_error ("Failed to watch openrc session: %s", error->message);
+        if (fstat (ctx->fifo_fd, &statbuf) < 0)
+                g_error ("Failed to watch openrc session: fstat failed: %m");
+        else if (!(statbuf.st_mode & S_IFIFO))
+                g_error ("Failed to watch openrc session: FD is not a FIFO");
+
+        g_unix_fd_add (ctx->fifo_fd, G_IO_HUP, (GUnixFDSourceFunc) monitor_hangup_cb, ctx);
+
+        leader_trace_step ("fifo", ctx->fifo_requested);
+}
+
+/*
+ * Session milestones
+ *
+ * gnome-session-service stays in its INITIALIZATION phase until it's called
+ * Initialized, and only starts autostart apps after that. We tell it as the
+ * session comes up, in two steps, so apps don't wait on the slowest settings
+ * daemon:
+ *
+ * - "shell": gnome-shell and everything it needs are up. Signalled with
+ *   Initialized, which starts the autostart apps.
+ * - "settings": every service the target needs is up, the settings daemons
+ *   included. Signalled with ReportMilestone(), which releases the apps
+ *   that asked to wait for them.
+ *
+ * Without a scheduler both are reached once OpenRC has entered the
+ * runlevel. Each is reported exactly once, in order, and anything not
+ * reached after LEADER_MILESTONE_TIMEOUT seconds is reported anyway. Either
+ * way gnome-session-service has to be on the bus to take the calls, so we
+ * watch for its name too.
+ */
+
+#define LEADER_MILESTONE_TIMEOUT 30
+
+#define GSM_SERVICE_DBUS   "org.gnome.SessionManager"
+#define GSM_PATH_DBUS      "/org/gnome/SessionManager"
+#define GSM_INTERFACE_DBUS "org.gnome.SessionManager"
+#define GSM_STARTUP_DBUS   "org.gnome.SessionManager.Startup"
+
+static void
+leader_initialized_cb (GObject      *source_object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+        Leader *ctx = user_data;
+        g_autoptr (GVariant) reply = NULL;
+        g_autoptr (GError) error = NULL;
+
+        reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+        if (reply == NULL) {
+                g_warning ("Failed to signal session initialization: %s", error->message);
+                return;
+        }
+
+        leader_trace_step ("initialized", ctx->target_requested);
+}
+
+static void
+leader_milestone_reported_cb (GObject      *source_object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+        g_autoptr (GVariant) reply = NULL;
+        g_autoptr (GError) error = NULL;
+
+        reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+        if (reply == NULL)
+                g_warning ("Failed to report the settings milestone: %s", error->message);
+}
+
+static void
+leader_report_milestones (Leader *ctx)
+{
+        if (!ctx->manager_on_bus)
+                return;
+
+        /* Calls on one connection are delivered in order, so the settings
+         * milestone can't overtake Initialized */
+        if (!ctx->initialized_sent && (ctx->shell_ready || ctx->milestones_timed_out)) {
+                ctx->initialized_sent = TRUE;
+
+                if (!ctx->shell_ready)
+                        g_warning ("Shell still not up after %d seconds, signalling initialization anyway",
+                                   LEADER_MILESTONE_TIMEOUT);
+                else
+                        g_debug ("Shell up, signalling initialization");
+
+                g_dbus_connection_call (ctx->session_bus,
+                                        GSM_SERVICE_DBUS,
+                                        GSM_PATH_DBUS,
+                                        GSM_INTERFACE_DBUS,
+                                        "Initialized",
+                                        NULL,
+                                        NULL,
+                                        G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                        -1, NULL,
+                                        leader_initialized_cb, ctx);
+        }
+
+        if (ctx->initialized_sent && !ctx->settings_sent &&
+            (ctx->settings_ready || ctx->milestones_timed_out)) {
+                ctx->settings_sent = TRUE;
+
+                if (!ctx->settings_ready)
+                        g_warning ("Session services still not ready after %d seconds, reporting them up anyway",
+                                   LEADER_MILESTONE_TIMEOUT);
+
+                g_dbus_connection_call (ctx->session_bus,
+                                        GSM_SERVICE_DBUS,
+                                        GSM_PATH_DBUS,
+                                        GSM_STARTUP_DBUS,
+                                        "ReportMilestone",
+                                        g_variant_new ("(s)", "settings"),
+                                        NULL,
+                                        G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                        -1, NULL,
+                                        leader_milestone_reported_cb, ctx);
+        }
+
+        if (ctx->settings_sent)
+                g_clear_handle_id (&ctx->milestone_timeout_id, g_source_remove);
+}
+
+static void
+leader_milestone_reached (LeaderMilestone milestone,
+                          gpointer        user_data)
+{
+        Leader *ctx = user_data;
+
+        switch (milestone) {
+        case LEADER_MILESTONE_SHELL:
+                if (ctx->shell_ready)
+                        return;
+                ctx->shell_ready = TRUE;
+                leader_trace_step ("shell", ctx->target_requested);
+                break;
+        case LEADER_MILESTONE_SETTINGS:
+                if (ctx->settings_ready)
+                        return;
+                /* Implies the shell, e.g. when it was up before we were */
+                ctx->shell_ready = TRUE;
+                ctx->settings_ready = TRUE;
+                leader_trace_step ("settings", ctx->target_requested);
+                break;
+        }
+
+        leader_report_milestones (ctx);
+}
+
+static gboolean
+leader_milestone_timeout_cb (gpointer user_data)
+{
+        Leader *ctx = user_data;
+
+        ctx->milestone_timeout_id = 0;
+        ctx->milestones_timed_out = TRUE;
+        leader_report_milestones (ctx);
 
         return G_SOURCE_REMOVE;
 }
 
 static void
-debug_logger (gchar const *log_domain,
-              GLogLevelFlags log_level,
-              gchar const *message,
-              gpointer user_data)
+leader_manager_appeared_cb (GDBusConnection *connection,
+                            const char      *name,
+                            const char      *name_owner,
+                            gpointer         user_data)
 {
-        printf ("%s\n", message);
-        syslog (LOG_INFO, "%s", message);
+        Leader *ctx = user_data;
+
+        ctx->manager_on_bus = TRUE;
+        leader_report_milestones (ctx);
+}
+
+static void
+leader_manager_vanished_cb (GDBusConnection *connection,
+                            const char      *name,
+                            gpointer         user_data)
+{
+        Leader *ctx = user_data;
+
+        ctx->manager_on_bus = FALSE;
+}
+
+/* Used instead of the scheduler's milestones when we had to hand the whole
+ * target to OpenRC */
+static void
+leader_target_entered_cb (GObject      *source_object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+        Leader *ctx = user_data;
+        g_autoptr (GError) error = NULL;
+
+        if (!gsm_openrc_runlevel_finish (result, &error))
+                g_warning ("Failed to enter session runlevel: %s", error->message);
+        else
+                g_debug ("Entered session runlevel");
+
+        leader_milestone_reached (LEADER_MILESTONE_SETTINGS, ctx);
+}
+
+/*
+ * Startup pipeline
+ *
+ * Connecting to the session bus, preparing the runlevel and loading the
+ * dependency tree, and opening the monitor FIFO don't depend on each other,
+ * so they all run at once: the bus connection and the FIFO are already
+ * asynchronous, and the librc calls, which hit the disk, go to a worker
+ * thread. Services are started as soon as the dependency tree is loaded.
+ * Each step's duration ends up in the startup trace.
+ */
+
+typedef struct {
+        char *target;
+        char *runlevel_dir;
+} LeaderPrepare;
+
+static void
+leader_prepare_free (LeaderPrepare *prepare)
+{
+        g_free (prepare->target);
+        g_free (prepare->runlevel_dir);
+        g_free (prepare);
+}
+
+static void
+leader_trace_step (const char *step,
+                   gint64      since)
+{
+        g_autofree char *detail = NULL;
+        gint64 elapsed;
+
+        elapsed = g_get_monotonic_time () - since;
+        detail = g_strdup_printf ("%" G_GINT64_FORMAT, elapsed);
+        gsm_openrc_trace (GSM_OPENRC_TRACE_STEP, step, detail);
+
+        g_debug ("Startup step %s took %" G_GINT64_FORMAT " ms", step, elapsed / 1000);
+}
+
+static void
+leader_bus_ready_cb (GObject      *source_object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+        Leader *ctx = user_data;
+        g_autoptr (GError) error = NULL;
+
+        ctx->session_bus = g_bus_get_finish (result, &error);
+        if (ctx->session_bus == NULL)
+                g_error ("Failed to obtain session bus: %s", error->message);
+
+        leader_trace_step ("bus", ctx->bus_requested);
+
+        ctx->manager_watch_id = g_bus_watch_name_on_connection (ctx->session_bus,
+                                                                GSM_SERVICE_DBUS,
+                                                                G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                                leader_manager_appeared_cb,
+                                                                leader_manager_vanished_cb,
+                                                                ctx, NULL);
+}
+
+/*
+ * Every session target gets a runlevel of its own, named after the target,
+ * which stacks "default" and contains nothing but the target. It's created
+ * the first time the target is used; later logins only check that it's still
+ * in place, so they don't write to ~/.config/rc or invalidate the dependency
+ * tree. Sharing one runlevel between targets also meant that entering it
+ * started every session type the user had ever logged into.
+ */
+static gboolean
+leader_runlevel_is_prepared (const char *runlevel,
+                             const char *target)
+{
+        RC_STRINGLIST *stacks;
+        gboolean stacked;
+
+        if (!rc_runlevel_exists (runlevel) ||
+            !rc_service_in_runlevel (target, runlevel))
+                return FALSE;
+
+        stacks = rc_runlevel_stacks (runlevel);
+        stacked = rc_stringlist_find (stacks, "default") != NULL;
+        rc_stringlist_free (stacks);
+
+        return stacked;
+}
+
+static void
+leader_prepare_runlevel (LeaderPrepare *prepare)
+{
+        if (leader_runlevel_is_prepared (prepare->target, prepare->target)) {
+                g_debug ("Runlevel %s is already set up", prepare->target);
+                return;
+        }
+
+        g_message ("Setting up runlevel %s in %s", prepare->target, prepare->runlevel_dir);
+
+        if (g_mkdir_with_parents (prepare->runlevel_dir, 0755) < 0)
+                g_warning ("Failed to create %s: %m", prepare->runlevel_dir);
+
+        if (!rc_runlevel_stack (prepare->target, "default"))
+                g_info ("Couldn't set runlevel stack");
+        if (!rc_runlevel_exists (prepare->target))
+                g_info ("No runlevel \"%s\" seen!", prepare->target); // next function will fail now, but librc error reporting sucks so we check this specifically
+        if (!rc_service_add (prepare->target, prepare->target))
+                g_info ("Couldn't add service to %s runlevel: %s", prepare->target, strerror (errno));
+}
+
+static void
+leader_prepare_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+        LeaderPrepare *prepare = task_data;
+        LeaderScheduler *scheduler;
+        RC_SERVICE state;
+        gint64 start;
+
+        start = g_get_monotonic_time ();
+
+        state = rc_service_state (prepare->target);
+        switch (state)
+        {
+        case RC_SERVICE_STARTED:
+        case RC_SERVICE_FAILED:
+                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                                         "Service manager is already running!");
+                return;
+        case RC_SERVICE_STOPPED:
+                break;
+        default:
+                g_debug ("Service in state: %d", state);
+        }
+
+        leader_prepare_runlevel (prepare);
+        leader_trace_step ("runlevel", start);
+
+        start = g_get_monotonic_time ();
+        scheduler = leader_scheduler_new (prepare->target, prepare->target);
+        leader_trace_step ("deptree", start);
+
+        /* A NULL scheduler isn't an error, we fall back to openrc -U */
+        g_task_return_pointer (task, scheduler, NULL);
+}
+
+static void
+leader_prepared_cb (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+        Leader *ctx = user_data;
+        LeaderPrepare *prepare = g_task_get_task_data (G_TASK (result));
+        g_autoptr (GError) error = NULL;
+
+        ctx->scheduler = g_task_propagate_pointer (G_TASK (result), &error);
+        if (error != NULL)
+                g_error ("%s", error->message);
+
+        g_message ("Starting GNOME session target: %s", prepare->target);
+
+        if (ctx->scheduler != NULL)
+                leader_scheduler_start (ctx->scheduler, leader_milestone_reached, ctx);
+        else
+                gsm_openrc_runlevel_async (prepare->target, NULL,
+                                           leader_target_entered_cb, ctx);
+
+        ctx->active_services = leader_collect_session_services (ctx, prepare->target);
+}
+
+/*
+ * The D-Bus .service files for on-demand services only apply to this
+ * session, so they aren't installed where every session bus would find
+ * them. The bus is already running by the time we are, so we link them
+ * into its transient service directory, $XDG_RUNTIME_DIR/dbus-1/services,
+ * which dbus-daemon watches, and remove them again on the way out.
+ */
+#define LEADER_ACTIVATION_DIR DATA_DIR "/openrc/dbus-1/services"
+
+static void
+leader_link_activation_files (gboolean install)
+{
+        g_autoptr (GDir) dir = NULL;
+        g_autofree char *runtime_dir = NULL;
+        const char *name;
+
+        dir = g_dir_open (LEADER_ACTIVATION_DIR, 0, NULL);
+        if (dir == NULL)
+                return;
+
+        runtime_dir = g_build_filename (g_get_user_runtime_dir (), "dbus-1", "services", NULL);
+        if (install && g_mkdir_with_parents (runtime_dir, 0700) < 0) {
+                g_warning ("Failed to create %s: %m", runtime_dir);
+                return;
+        }
+
+        while ((name = g_dir_read_name (dir)) != NULL) {
+                g_autofree char *source = g_build_filename (LEADER_ACTIVATION_DIR, name, NULL);
+                g_autofree char *dest = g_build_filename (runtime_dir, name, NULL);
+                g_autofree char *current = g_file_read_link (dest, NULL);
+
+                if (install) {
+                        if (g_strcmp0 (current, source) == 0)
+                                continue;
+                        g_unlink (dest);
+                        if (symlink (source, dest) < 0)
+                                g_warning ("Failed to link %s: %m", dest);
+                } else if (g_strcmp0 (current, source) == 0) {
+                        g_unlink (dest);
+                }
+        }
 }
 
 /**
@@ -231,11 +1441,11 @@ debug_logger (gchar const *log_domain,
  * - Leader process receives SIGTERM
  * - Leader sends single byte
  * - Monitor process receives byte and signals STOPPING=1
- * - Systemd user instance starts session teardown
- * - The last job that runs during session teardown is a stop job for the
- *   monitor process.
- * - Monitor process quits, closing FD in the process
- * - Leader process receives HUP and quits
+ * - Monitor stops the session services in reverse dependency order,
+ *   reporting each one on the progress FIFO
+ * - `openrc -U default` stops the monitor, closing FD in the process
+ * - Leader process receives HUP and watches the OpenRC state directory
+ * - Leader process quits once the last session service has stopped
  * - GDM sees the leader quit and cleans up its state in response.
  *
  * The result is that the session is stopped cleanly.
@@ -243,17 +1453,14 @@ debug_logger (gchar const *log_domain,
 int
 main (int argc, char **argv)
 {
-        // Hook into syslog, as on an openrc system it's probably more convenient
-        g_log_set_default_handler(debug_logger, NULL);
-        g_autoptr (GError) error = NULL;
-        g_auto (Leader) ctx = { .fifo_fd = -1 };
+        g_auto (Leader) ctx = { .fifo_fd = -1, .state_fd = -1, .progress_fd = -1 };
         const char *session_name = NULL;
-        const char *debug_string = NULL;
         g_autofree char *target = NULL;
         g_autofree char *fifo_path = NULL;
         g_autofree char *home_dir = NULL;
         g_autofree char *config_dir = NULL;
-        struct stat statbuf;
+        g_autoptr (GTask) prepare_task = NULL;
+        g_autoptr (GTask) fifo_task = NULL;
         
         if (argc < 2)
             g_error ("No session name was specified");
@@ -275,7 +1482,12 @@ main (int argc, char **argv)
                 g_setenv("HOME", home_dir, TRUE);
         }
         else
-                g_warning("The gdm-greeter-{1,2,3,4} user wasn't found. Expect stuff to break.")
+                g_warning("The gdm-greeter-{1,2,3,4} user wasn't found. Expect stuff to break.");
+
+        // Log to syslog, as on an openrc system it's probably more convenient,
+        // but from a background thread so logging stays off the startup path.
+        // This looks up the state dir, so it has to come after HOME is fixed up.
+        gsm_log_ring_init ("gnome-session-leader");
         
         // Finally, let's get started
         rc_set_user();
@@ -284,81 +1496,66 @@ main (int argc, char **argv)
         char const *home         = g_getenv("HOME");
         g_info("XDG_RUNTIME_DIR: %s", g_getenv("XDG_RUNTIME_DIR"));
         
-        // TODO what about custom XDG config directory?
-        g_autofree char *gnome_runlevel_dir = g_strdup_printf("%s/.config/rc/runlevels/gnome-session", home);
-        if (!g_mkdir_with_parents(gnome_runlevel_dir, 0755))
-                g_debug("Directory exists. OK");
-
-        g_debug("runlevel dir: %s", gnome_runlevel_dir);
+        LeaderPrepare *prepare = g_new0 (LeaderPrepare, 1);
 
-        debug_string = g_getenv ("GNOME_SESSION_DEBUG");
-        if (debug_string != NULL)
-                g_log_set_debug_enabled (atoi (debug_string) == 1);
-        else
-                g_log_set_debug_enabled(TRUE);
         g_debug("Hi! from leader-openrc.");
 
         ctx.loop = g_main_loop_new (NULL, TRUE);
 
-        ctx.session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
-        if (ctx.session_bus == NULL)
-                g_error ("Failed to obtain session bus: %s", error->message);
-
         /* XDG_SESSION_TYPE from the console is TTY which isn't a service and doesn't make
             too much sense anyway */
         if (session_type && strcmp(session_type, "tty") == 0)
                 session_type = "wayland"; 
         target = g_strdup_printf ("gnome-session-%s.%s",
                                   session_type ? session_type : "wayland", session_name);
+        prepare->target = g_strdup (target);
+        // TODO what about custom XDG config directory?
+        prepare->runlevel_dir = g_strdup_printf ("%s/.config/rc/runlevels/%s", home, target);
 
-        RC_SERVICE state = rc_service_state(target);
-        switch (state)
-        {
-        case RC_SERVICE_STARTED:
-        case RC_SERVICE_FAILED:
-                g_error("Service manager is already running!");
-                break;
-        case RC_SERVICE_STOPPED:
-                break;
-        default:
-                g_debug("Service in state: %d", state);
-        }
-        
-        if (!rc_runlevel_stack("gnome-session", "default"))
-                g_info("Couldn't set runlevel stack");
-        if (!rc_runlevel_exists("gnome-session"))
-                g_info("No runlevel \"gnome-session\" seen!"); // next function will fail now, but librc error reporting sucks so we check this specifically
-        if (!rc_service_add("gnome-session", target))
-        {
-                g_info("Couldn't add service to gnome-session runlevel: %s", strerror(errno));
-        }
+        gsm_openrc_trace_begin ();
+        gsm_openrc_trace (GSM_OPENRC_TRACE_TARGET, target, NULL);
 
-        g_message ("Starting GNOME session target: %s", target);
+        leader_link_activation_files (TRUE);
+
+        ctx.target_requested = g_get_monotonic_time ();
+        ctx.milestone_timeout_id = g_timeout_add_seconds (LEADER_MILESTONE_TIMEOUT,
+                                                          leader_milestone_timeout_cb,
+                                                          &ctx);
+
+        /* The disk is mostly idle until the first services get spawned */
+        gsm_readahead_replay ();
+        gsm_readahead_schedule_record (LEADER_READAHEAD_RECORD_DELAY);
+
+        ctx.bus_requested = g_get_monotonic_time ();
+        g_bus_get (G_BUS_TYPE_SESSION, NULL, leader_bus_ready_cb, &ctx);
+
+        prepare_task = g_task_new (NULL, NULL, leader_prepared_cb, &ctx);
+        g_task_set_task_data (prepare_task, prepare, (GDestroyNotify) leader_prepare_free);
+        g_task_run_in_thread (prepare_task, leader_prepare_thread);
 
-        // No way that i'm aware of to enter a user runlevel from librc :/
-        gchar *rl_argv[] = { "/usr/bin/openrc", "-U", "gnome-session", NULL };
-        if (!async_run_cmd(rl_argv, &error))
-                g_error("Failed to start unit %s: %s", target, error ? error->message : "(no message)");
-        
         fifo_path = g_build_filename (g_get_user_runtime_dir (),
                                       "gnome-session-leader-fifo",
                                       NULL);
+        ctx.fifo_requested = g_get_monotonic_time ();
         if (mkfifo (fifo_path, 0666) < 0 && errno != EEXIST)
                 g_warning ("Failed to create leader FIFO: %m");
 
-        ctx.fifo_fd = g_open (fifo_path, O_WRONLY | O_CLOEXEC, 0666);
-        if (ctx.fifo_fd < 0)
-                g_error ("Failed to watch openrc session: open failed: %m");
-        if (fstat (ctx.fifo_fd, &statbuf) < 0)
-                g_error ("Failed to watch openrc session: fstat failed: %m");
-        else if (!(statbuf.st_mode & S_IFIFO))
-                g_error ("Failed to watch openrc session: FD is not a FIFO");
+        /* Opening the write side blocks until the monitor service opens the
+         * read side, and the monitor is only spawned once the dependency tree
+         * is loaded and the scheduler gets to run on the main loop. */
+        fifo_task = g_task_new (NULL, NULL, fifo_opened_cb, &ctx);
+        g_task_set_task_data (fifo_task, g_steal_pointer (&fifo_path), g_free);
+        g_task_run_in_thread (fifo_task, open_fifo_thread);
+
+        leader_watch_progress (&ctx);
 
-        g_unix_fd_add (ctx.fifo_fd, G_IO_HUP, (GUnixFDSourceFunc) monitor_hangup_cb, &ctx);
         g_unix_signal_add (SIGHUP, leader_term_or_int_signal_cb, &ctx);
         g_unix_signal_add (SIGTERM, leader_term_or_int_signal_cb, &ctx);
         g_unix_signal_add (SIGINT, leader_term_or_int_signal_cb, &ctx);
 
         g_main_loop_run (ctx.loop);
+
+        leader_link_activation_files (FALSE);
+
         return 0;
 }
@@ -38,6 +38,10 @@
 
 #ifdef USE_OPENRC
 #       include <rc.h>
+#       include <signal.h>
+#       include <gio/gunixsocketaddress.h>
+
+#       include "gnome-session/gsm-openrc.h"
 #endif
 
 #define GSM_SERVICE_DBUS   "org.gnome.SessionManager"
@@ -61,7 +65,629 @@ async_run_cmd(gchar** argv, GError **error)
                              NULL,
                              error);
 }
+
+/*
+ * Session teardown
+ *
+ * Leaving the session runlevel with `openrc -U default` stops the session
+ * services in whatever order OpenRC walks them, one at a time, and waits
+ * as long as each of them takes. Instead we stop them ourselves first:
+ * everything that's running and not part of the default runlevel, in
+ * reverse dependency order, and each service as soon as nothing that
+ * needs it is left running. A service that hasn't stopped after
+ * TEARDOWN_TERM_SECONDS has its supervisor (or, unsupervised, its daemon)
+ * sent SIGTERM, then both get SIGKILL, and after TEARDOWN_ABANDON_SECONDS
+ * it's marked stopped regardless. Whatever
+ * is left at TEARDOWN_DEADLINE_SECONDS is killed at once. `openrc -U
+ * default` then only has to stop us.
+ *
+ * A forced teardown skips all of that: every daemon is killed and its
+ * service marked stopped at once.
+ *
+ * The session manager stops the services in parallel with ending its
+ * clients on reboot and shutdown. It keeps its own service and the session
+ * target, and what those need, running, and the runlevel is only left once
+ * the whole session is asked to go.
+ *
+ * Progress goes to the leader's progress FIFO, one "<event> <service>"
+ * line at a time, if the leader is listening.
+ */
+
+#define TEARDOWN_TERM_SECONDS     3
+#define TEARDOWN_KILL_SECONDS     5
+#define TEARDOWN_ABANDON_SECONDS  6
+#define TEARDOWN_DEADLINE_SECONDS 15
+#define TEARDOWN_PROGRESS_FIFO    "gnome-session-leader-progress"
+
+typedef void (*TeardownDoneFunc) (GError   *error,
+                                  gpointer  user_data);
+
+typedef struct {
+        char      *name;
+        GPtrArray *needs;        /* TeardownService, not owned */
+        guint      n_dependents; /* that are still running */
+        guint      wave;
+        GPid       stop_pid;
+        guint      timeout_id;
+        guint      escalation;
+        gboolean   stopped;
+} TeardownService;
+
+typedef struct {
+        TeardownDoneFunc func;
+        gpointer         user_data;
+        gboolean         settle; /* waits for the runlevel to be left */
+} TeardownWaiter;
+
+typedef struct {
+        GHashTable       *services;
+        /* Earlier rounds' services, whose stop actions may still be reaped */
+        GPtrArray        *old_services;
+        /* Whether this round left services running for a keep list */
+        gboolean          partial;
+        guint             n_running;
+        guint             deadline_id;
+        int               progress_fd;
+        gint64            started;
+        gboolean          force;
+        gboolean          finished;
+        /* Whether to leave the session runlevel once finished, and
+         * whether we did */
+        gboolean          settle;
+        gboolean          settle_force;
+        gboolean          settled;
+        GError           *settle_error;
+        GArray           *waiters;      /* TeardownWaiter */
+} Teardown;
+
+/* There's only ever one per process, and it lives until we exit: stop
+ * actions we gave up on may still be reaped after we're done. */
+static Teardown *teardown = NULL;
+
+static void teardown_service_stopped (TeardownService *service,
+                                      const char      *event);
+
+static void
+teardown_report (const char *event,
+                 const char *subject)
+{
+        g_autofree char *line = NULL;
+
+        g_debug ("Teardown: %s %s", event, subject);
+
+        if (teardown->progress_fd < 0)
+                return;
+
+        /* Shorter than PIPE_BUF, so this is written in one go or not at all */
+        line = g_strdup_printf ("%s %s\n", event, subject);
+        if (write (teardown->progress_fd, line, strlen (line)) < 0 && errno != EAGAIN)
+                g_debug ("Couldn't report teardown progress: %m");
+}
+
+static GPid
+teardown_read_pidfile (const char *path)
+{
+        g_autofree char *contents = NULL;
+
+        if (!g_file_get_contents (path, &contents, NULL, NULL))
+                return 0;
+
+        return (GPid) g_ascii_strtoll (contents, NULL, 10);
+}
+
+/* Under supervise-daemon the service's pidfile holds the supervisor and
+ * the daemon is recorded as child_pid; background daemons only have the
+ * pidfile, which our scripts name after the service. */
+static void
+teardown_service_get_pids (TeardownService *service,
+                           GPid            *supervisor,
+                           GPid            *daemon)
+{
+        g_autofree char *default_pidfile = NULL;
+        char *child_pid;
+        char *pidfile;
+
+        *supervisor = 0;
+        *daemon = 0;
+
+        default_pidfile = g_strdup_printf ("%s/%s.pid", g_get_user_runtime_dir (), service->name);
+        pidfile = rc_service_value_get (service->name, "pidfile");
+        child_pid = rc_service_value_get (service->name, "child_pid");
+
+        if (child_pid != NULL) {
+                *daemon = (GPid) g_ascii_strtoll (child_pid, NULL, 10);
+                *supervisor = teardown_read_pidfile (pidfile != NULL ? pidfile : default_pidfile);
+        } else {
+                *daemon = teardown_read_pidfile (pidfile != NULL ? pidfile : default_pidfile);
+        }
+
+        free (child_pid);
+        free (pidfile);
+}
+
+static void
+teardown_kill_pid (TeardownService *service,
+                   GPid             pid,
+                   int              signum)
+{
+        if (pid > 1 && kill (pid, signum) < 0 && errno != ESRCH)
+                g_debug ("Couldn't signal %s (%d): %m", service->name, pid);
+}
+
+/* The supervisor always goes first: on SIGTERM it stops the daemon itself,
+ * and a supervisor that sees its daemon die any other way respawns it. */
+static void
+teardown_service_kill (TeardownService *service,
+                       int              signum)
+{
+        GPid supervisor, daemon;
+
+        teardown_service_get_pids (service, &supervisor, &daemon);
+
+        if (supervisor > 1) {
+                teardown_kill_pid (service, supervisor, signum);
+                if (signum != SIGKILL)
+                        return;
+        }
+
+        teardown_kill_pid (service, daemon, signum);
+}
+
+static void
+teardown_service_abandon (TeardownService *service,
+                          const char      *event)
+{
+        teardown_service_kill (service, SIGKILL);
+        if (service->stop_pid > 0)
+                kill (service->stop_pid, SIGKILL);
+
+        rc_service_mark (service->name, RC_SERVICE_STOPPED);
+        teardown_service_stopped (service, event);
+}
+
+static gboolean
+teardown_service_timeout_cb (gpointer user_data)
+{
+        TeardownService *service = user_data;
+
+        service->timeout_id = 0;
+        service->escalation++;
+
+        switch (service->escalation) {
+        case 1:
+                g_warning ("%s is taking long to stop, sending SIGTERM", service->name);
+                teardown_report ("term", service->name);
+                teardown_service_kill (service, SIGTERM);
+                service->timeout_id = g_timeout_add_seconds (TEARDOWN_KILL_SECONDS - TEARDOWN_TERM_SECONDS,
+                                                             teardown_service_timeout_cb, service);
+                break;
+        case 2:
+                g_warning ("%s still hasn't stopped, sending SIGKILL", service->name);
+                teardown_report ("kill", service->name);
+                teardown_service_kill (service, SIGKILL);
+                service->timeout_id = g_timeout_add_seconds (TEARDOWN_ABANDON_SECONDS - TEARDOWN_KILL_SECONDS,
+                                                             teardown_service_timeout_cb, service);
+                break;
+        default:
+                g_warning ("Giving up on stopping %s", service->name);
+                teardown_service_abandon (service, "abandoned");
+                break;
+        }
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+teardown_service_stop_cb (GPid     pid,
+                          gint     wait_status,
+                          gpointer user_data)
+{
+        TeardownService *service = user_data;
+        g_autoptr(GError) error = NULL;
+
+        g_spawn_close_pid (pid);
+        service->stop_pid = 0;
+
+        if (service->stopped)
+                return;
+
+        if (!g_spawn_check_wait_status (wait_status, &error))
+                g_warning ("Failed to stop %s: %s", service->name, error->message);
+
+        teardown_service_stopped (service, "stopped");
+}
+
+static void
+teardown_service_stop (TeardownService *service)
+{
+        g_autoptr(GError) error = NULL;
+        g_autofree char *wave = NULL;
+        char *path;
+
+        path = rc_service_resolve (service->name);
+        if (path != NULL) {
+                char *argv[] = { path, "-U", "stop", NULL };
+
+                g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                               NULL, NULL, &service->stop_pid, &error);
+                free (path);
+        } else {
+                g_set_error (&error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                             "couldn't resolve service");
+        }
+
+        if (error != NULL) {
+                g_warning ("Failed to stop %s: %s", service->name, error->message);
+                teardown_service_abandon (service, "abandoned");
+                return;
+        }
+
+        wave = g_strdup_printf ("%s %u", service->name, service->wave);
+        teardown_report ("stopping", wave);
+        g_child_watch_add (service->stop_pid, teardown_service_stop_cb, service);
+        service->timeout_id = g_timeout_add_seconds (TEARDOWN_TERM_SECONDS,
+                                                     teardown_service_timeout_cb, service);
+}
+
+static void
+teardown_settle (void)
+{
+        gchar *rl_argv[] = { "/usr/bin/openrc", "-U", "default", NULL };
+
+        if (!teardown->settle || teardown->settled)
+                return;
+        teardown->settled = TRUE;
+
+        /* Everything else is down, so this only stops what was kept
+         * running, records the runlevel and stops us */
+        async_run_cmd (rl_argv, &teardown->settle_error);
+}
+
+/* Waiters that asked to leave the runlevel are only notified once that's
+ * been done, when @settled is set */
+static void
+teardown_notify_waiters (gboolean settled)
+{
+        g_autoptr(GArray) waiters = g_steal_pointer (&teardown->waiters);
+
+        teardown->waiters = g_array_new (FALSE, FALSE, sizeof (TeardownWaiter));
+        for (guint i = 0; i < waiters->len; i++) {
+                TeardownWaiter *waiter = &g_array_index (waiters, TeardownWaiter, i);
+
+                if (waiter->settle && !settled)
+                        g_array_append_val (teardown->waiters, *waiter);
+                else
+                        waiter->func (teardown->settle_error, waiter->user_data);
+        }
+}
+
+static void
+teardown_add_waiter (TeardownDoneFunc done_func,
+                     gpointer         user_data,
+                     gboolean         settle)
+{
+        TeardownWaiter waiter = { done_func, user_data, settle };
+
+        if (done_func != NULL)
+                g_array_append_val (teardown->waiters, waiter);
+}
+
+static void teardown_begin_round (gboolean            force,
+                                  const char * const *keep_services);
+
+static void
+teardown_finish (void)
+{
+        g_autofree char *elapsed = NULL;
+
+        g_clear_handle_id (&teardown->deadline_id, g_source_remove);
+
+        elapsed = g_strdup_printf ("%" G_GINT64_FORMAT "ms",
+                                   (g_get_monotonic_time () - teardown->started) / 1000);
+        teardown_report ("done", elapsed);
+        if (teardown->progress_fd >= 0) {
+                close (teardown->progress_fd);
+                teardown->progress_fd = -1;
+        }
+
+        teardown->finished = TRUE;
+        teardown_notify_waiters (FALSE);
+
+        /* Leaving the runlevel would stop what this round kept one at a
+         * time and without a deadline, so take those down properly first */
+        if (teardown->settle && teardown->partial) {
+                teardown_begin_round (teardown->settle_force, NULL);
+                return;
+        }
+
+        teardown_settle ();
+        teardown_notify_waiters (TRUE);
+}
+
+static void
+teardown_service_stopped (TeardownService *service,
+                          const char      *event)
+{
+        if (service->stopped)
+                return;
+
+        service->stopped = TRUE;
+        g_clear_handle_id (&service->timeout_id, g_source_remove);
+        teardown_report (event, service->name);
+
+        for (guint i = 0; i < service->needs->len; i++) {
+                TeardownService *need = g_ptr_array_index (service->needs, i);
+
+                need->wave = MAX (need->wave, service->wave + 1);
+                if (--need->n_dependents == 0 && !need->stopped && !teardown->force)
+                        teardown_service_stop (need);
+        }
+
+        if (--teardown->n_running == 0)
+                teardown_finish ();
+}
+
+static void
+teardown_kill_remaining (const char *event)
+{
+        g_autoptr(GList) services = NULL;
+
+        services = g_hash_table_get_values (teardown->services);
+        for (GList *l = services; l != NULL && teardown->n_running > 0; l = l->next) {
+                TeardownService *service = l->data;
+
+                if (!service->stopped)
+                        teardown_service_abandon (service, event);
+        }
+}
+
+static gboolean
+teardown_deadline_cb (gpointer user_data)
+{
+        teardown->deadline_id = 0;
+
+        g_warning ("Session services still running after %d seconds, killing them",
+                   TEARDOWN_DEADLINE_SECONDS);
+
+        /* Don't start any more stop actions either */
+        teardown->force = TRUE;
+        teardown_kill_remaining ("abandoned");
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+teardown_service_free (TeardownService *service)
+{
+        g_free (service->name);
+        g_ptr_array_unref (service->needs);
+        g_free (service);
+}
+
+static void
+teardown_add_running (GHashTable    *services,
+                      RC_SERVICE     state,
+                      RC_STRINGLIST *keep)
+{
+        RC_STRINGLIST *list;
+        RC_STRING *item;
+
+        list = rc_services_in_state (state);
+        TAILQ_FOREACH (item, list, entries) {
+                TeardownService *service;
+
+                if (rc_stringlist_find (keep, item->value) != NULL)
+                        continue;
+
+                service = g_new0 (TeardownService, 1);
+                service->name = g_strdup (item->value);
+                service->needs = g_ptr_array_new ();
+                g_hash_table_insert (services, service->name, service);
+        }
+        rc_stringlist_free (list);
+}
+
+/* Everything that's up and not needed by the default runlevel, us or
+ * @keep_services, with the needs between them */
+static GHashTable *
+teardown_collect_services (const char * const *keep_services)
+{
+        const char *self;
+        RC_DEPTREE *deptree;
+        RC_STRINGLIST *types;
+        RC_STRINGLIST *kept;
+        RC_STRINGLIST *keep;
+        RC_STRING *item;
+        GHashTable *services;
+        GHashTableIter iter;
+        TeardownService *service;
+
+        services = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify) teardown_service_free);
+
+        rc_set_user ();
+
+        deptree = rc_deptree_load ();
+        if (deptree == NULL) {
+                g_warning ("Failed to load the OpenRC dependency tree");
+                return services;
+        }
+
+        types = rc_stringlist_new ();
+        rc_stringlist_add (types, "ineed");
+        rc_stringlist_add (types, "iuse");
+        rc_stringlist_add (types, "iwant");
+
+        kept = rc_services_in_runlevel_stacked ("default");
+        rc_stringlist_add (kept, "gnome-session-monitor");
+        rc_stringlist_add (kept, "gnome-session-shutdown");
+        self = g_getenv ("RC_SVCNAME");
+        if (self != NULL)
+                rc_stringlist_add (kept, self);
+        for (guint i = 0; keep_services != NULL && keep_services[i] != NULL; i++)
+                rc_stringlist_add (kept, keep_services[i]);
+
+        keep = rc_deptree_depends (deptree, types, kept, "default",
+                                   RC_DEP_TRACE | RC_DEP_START);
+        if (keep == NULL)
+                keep = rc_stringlist_new ();
+        TAILQ_FOREACH (item, kept, entries)
+                rc_stringlist_add (keep, item->value);
+
+        teardown_add_running (services, RC_SERVICE_STARTED, keep);
+        teardown_add_running (services, RC_SERVICE_INACTIVE, keep);
+
+        g_hash_table_iter_init (&iter, services);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &service)) {
+                RC_STRINGLIST *needs;
+                RC_STRING *need;
+
+                needs = rc_deptree_depend (deptree, service->name, "ineed");
+                if (needs == NULL)
+                        continue;
+
+                TAILQ_FOREACH (need, needs, entries) {
+                        TeardownService *dep = g_hash_table_lookup (services, need->value);
+
+                        if (dep == NULL || dep == service)
+                                continue;
+
+                        g_ptr_array_add (service->needs, dep);
+                        dep->n_dependents++;
+                }
+                rc_stringlist_free (needs);
+        }
+
+        rc_stringlist_free (keep);
+        rc_stringlist_free (kept);
+        rc_stringlist_free (types);
+        rc_deptree_free (deptree);
+
+        return services;
+}
+
+static void
+shutdown_teardown_done_cb (GError   *error,
+                           gpointer  user_data)
+{
+        GMainLoop *loop = user_data;
+
+        if (error != NULL)
+                g_error ("Failed to stop session services: %s", error->message);
+
+        g_main_loop_quit (loop);
+}
+
+static void
+teardown_begin_round (gboolean            force,
+                      const char * const *keep_services)
+{
+        g_autofree char *progress_path = NULL;
+        g_autoptr(GList) services = NULL;
+        g_autofree char *count = NULL;
+
+        teardown->started = g_get_monotonic_time ();
+        teardown->force = force;
+        teardown->finished = FALSE;
+        teardown->partial = keep_services != NULL;
+
+        progress_path = g_build_filename (g_get_user_runtime_dir (),
+                                          TEARDOWN_PROGRESS_FIFO, NULL);
+        teardown->progress_fd = g_open (progress_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC, 0);
+
+        if (teardown->services != NULL)
+                g_ptr_array_add (teardown->old_services, g_steal_pointer (&teardown->services));
+        teardown->services = teardown_collect_services (keep_services);
+        teardown->n_running = g_hash_table_size (teardown->services);
+
+        count = g_strdup_printf ("%u", teardown->n_running);
+        teardown_report ("begin", count);
+
+        if (teardown->n_running == 0) {
+                teardown_finish ();
+                return;
+        }
+
+        if (force) {
+                teardown_kill_remaining ("killed");
+                return;
+        }
+
+        teardown->deadline_id = g_timeout_add_seconds (TEARDOWN_DEADLINE_SECONDS,
+                                                       teardown_deadline_cb, NULL);
+
+        /* The first wave: everything nothing else in the session needs */
+        services = g_hash_table_get_values (teardown->services);
+        for (GList *l = services; l != NULL; l = l->next) {
+                TeardownService *service = l->data;
+
+                if (service->n_dependents == 0)
+                        teardown_service_stop (service);
+        }
+}
+
+/**
+ * teardown_session:
+ * @force: kill the services rather than stopping them
+ * @keep_services: (nullable): services to leave running, with what they
+ *   need; the session runlevel is left in place too
+ * @done_func: (nullable): called once the services are down and
+ *   `openrc -U default` has been spawned if needed, or failed to
+ *
+ * Stops the session services as described above. If a teardown is
+ * already under way, this joins it: it turns it into a forced one and
+ * has it leave the runlevel, if asked to. Leaving the runlevel after a
+ * teardown that kept services first stops those in another round.
+ */
+static void
+teardown_session (gboolean            force,
+                  const char * const *keep_services,
+                  TeardownDoneFunc    done_func,
+                  gpointer            user_data)
+{
+        if (teardown != NULL) {
+                g_debug ("Session teardown already under way");
+
+                if (keep_services == NULL) {
+                        teardown->settle = TRUE;
+                        teardown->settle_force |= force;
+                }
+                teardown_add_waiter (done_func, user_data, keep_services == NULL);
+
+                if (!teardown->finished) {
+                        if (force && !teardown->force) {
+                                teardown->force = TRUE;
+                                teardown_kill_remaining ("killed");
+                        }
+                } else if (teardown->settle && teardown->partial) {
+                        teardown_begin_round (teardown->settle_force, NULL);
+                } else {
+                        teardown_settle ();
+                        teardown_notify_waiters (teardown->settled);
+                }
+                return;
+        }
+
+        teardown = g_new0 (Teardown, 1);
+        teardown->settle = keep_services == NULL;
+        teardown->settle_force = force && keep_services == NULL;
+        teardown->old_services = g_ptr_array_new ();
+        teardown->waiters = g_array_new (FALSE, FALSE, sizeof (TeardownWaiter));
+        teardown_add_waiter (done_func, user_data, keep_services == NULL);
+
+        teardown_begin_round (force, keep_services);
+}
+#endif
+
+static void
+notify_service_manager (const char *state)
+{
+#ifdef USE_OPENRC
+        gsm_openrc_notify (state);
+#else
+        sd_notify (0, state);
 #endif
+}
 
 static GDBusConnection *
 get_session_bus (void)
@@ -101,6 +727,8 @@ do_signal_init (void)
         if (error != NULL)
                 g_warning ("Failed to call signal initialization: %s",
                            error->message);
+        else
+                notify_service_manager ("READY=1");
 }
 
 static void
@@ -174,6 +802,21 @@ leader_term_or_int_signal_cb (gpointer user_data)
         return G_SOURCE_REMOVE;
 }
 
+#ifdef USE_OPENRC
+static void
+leader_teardown_done_cb (GError   *error,
+                         gpointer  user_data)
+{
+        MonitorLeader *data = (MonitorLeader*) user_data;
+
+        /* Otherwise OpenRC stops us */
+        if (error != NULL) {
+                g_warning ("Failed to stop session services: %s", error->message);
+                g_main_loop_quit (data->loop);
+        }
+}
+#endif
+
 static gboolean
 leader_fifo_io_cb (gint fd,
                    GIOCondition condition,
@@ -181,8 +824,22 @@ leader_fifo_io_cb (gint fd,
 {
         MonitorLeader *data = (MonitorLeader*) user_data;
 
-        sd_notify (0, "STOPPING=1");
+        notify_service_manager ("STOPPING=1");
+
+#ifdef USE_OPENRC
+        /* We run under supervise-daemon, so exiting here would only get us
+         * respawned. Start the teardown instead and let OpenRC stop us as
+         * part of it; the leader sees us go away then. */
+        if (condition & G_IO_IN) {
+                char buf[1];
+                read (data->fifo_fd, buf, 1);
+        }
+
+        g_debug ("Session leader asked for shutdown, stopping session services");
+        teardown_session (FALSE, NULL, leader_teardown_done_cb, data);
 
+        return G_SOURCE_REMOVE;
+#else
         if (condition & G_IO_IN) {
                 char buf[1];
                 read (data->fifo_fd, buf, 1);
@@ -194,53 +851,70 @@ leader_fifo_io_cb (gint fd,
         }
 
         return G_SOURCE_CONTINUE;
+#endif
 }
 
-/**
- * do_monitor_leader:
- *
- * Function to monitor the leader to ensure clean session shutdown and
- * propagation of this information to/from loginctl/GDM.
- * See main.c systemd_leader_run() for more information.
- */
+/* Opens the read side of the leader FIFO, which blocks until the leader has
+ * opened the write side, and signals readiness once it's being watched. */
 static void
-do_monitor_leader (void)
+monitor_leader_watch_fifo (MonitorLeader *data)
 {
-        MonitorLeader data;
         g_autofree char *fifo_name = NULL;
         int res;
 
-        data.loop = g_main_loop_new (NULL, TRUE);
-
         fifo_name = g_strdup_printf ("%s/gnome-session-leader-fifo",
                                      g_get_user_runtime_dir ());
         res = mkfifo (fifo_name, 0666);
         if (res < 0 && errno != EEXIST)
                 g_warning ("Error creating FIFO: %m");
 
-        data.fifo_fd = g_open (fifo_name, O_RDONLY | O_CLOEXEC, 0666);
-        if (data.fifo_fd >= 0) {
+        data->fifo_fd = g_open (fifo_name, O_RDONLY | O_CLOEXEC, 0666);
+        if (data->fifo_fd >= 0) {
                 struct stat buf;
 
-                res = fstat (data.fifo_fd, &buf);
+                res = fstat (data->fifo_fd, &buf);
                 if (res < 0) {
+                        g_autofree char *status = NULL;
+
+                        status = g_strdup_printf ("STATUS=Unable to monitor session leader: FD is not a FIFO %s",
+                                                  g_strerror (errno));
                         g_warning ("Unable to monitor session leader: stat failed with error %m");
-                        sd_notifyf (0, "STATUS=Unable to monitor session leader: FD is not a FIFO %m");
-                        close (data.fifo_fd);
-                        data.fifo_fd = -1;
+                        notify_service_manager (status);
+                        close (data->fifo_fd);
+                        data->fifo_fd = -1;
                 } else if (!(buf.st_mode & S_IFIFO)) {
                         g_warning ("Unable to monitor session leader: FD is not a FIFO");
-                        sd_notify (0, "STATUS=Unable to monitor session leader: FD is not a FIFO");
-                        close (data.fifo_fd);
-                        data.fifo_fd = -1;
+                        notify_service_manager ("STATUS=Unable to monitor session leader: FD is not a FIFO");
+                        close (data->fifo_fd);
+                        data->fifo_fd = -1;
                 } else {
-                        sd_notify (0, "STATUS=Watching session leader");
-                        g_unix_fd_add (data.fifo_fd, G_IO_HUP | G_IO_IN, leader_fifo_io_cb, &data);
+                        notify_service_manager ("READY=1\nSTATUS=Watching session leader");
+                        g_unix_fd_add (data->fifo_fd, G_IO_HUP | G_IO_IN, leader_fifo_io_cb, data);
                 }
         } else {
+                g_autofree char *status = NULL;
+
+                status = g_strdup_printf ("STATUS=Unable to monitor session leader: Opening FIFO failed with %s",
+                                          g_strerror (errno));
                 g_warning ("Unable to monitor session leader: Opening FIFO failed with %m");
-                sd_notifyf (0, "STATUS=Unable to monitor session leader: Opening FIFO failed with %m");
+                notify_service_manager (status);
         }
+}
+
+/**
+ * do_monitor_leader:
+ *
+ * Function to monitor the leader to ensure clean session shutdown and
+ * propagation of this information to/from loginctl/GDM.
+ * See main.c systemd_leader_run() for more information.
+ */
+static void
+do_monitor_leader (void)
+{
+        MonitorLeader data;
+
+        data.loop = g_main_loop_new (NULL, TRUE);
+        monitor_leader_watch_fifo (&data);
 
         g_unix_signal_add (SIGTERM, leader_term_or_int_signal_cb, &data);
         g_unix_signal_add (SIGINT, leader_term_or_int_signal_cb, &data);
@@ -251,6 +925,870 @@ do_monitor_leader (void)
         /* FD is closed with the application. */
 }
 
+#ifdef USE_OPENRC
+/*
+ * Session agent
+ *
+ * Under OpenRC, `gnome-session-ctl --agent` runs for the whole session as
+ * the gnome-session-monitor service. It watches the leader FIFO like
+ * --monitor does, and carries out --signal-init and --shutdown on behalf
+ * of those short-lived invocations, which only pass the request on over a
+ * control socket in the runtime dir. The session then has one process and
+ * one bus connection for all three roles. Signalling initialization also
+ * no longer needs a supervised process that gets respawned after it exits.
+ *
+ * The client sends one command line per connection ("signal-init",
+ * "shutdown", "shutdown-force", or "stop-services" and "kill-services"
+ * followed by the services to keep); the
+ * agent answers "ok" or "error <message>", for the teardown commands
+ * once the services are down.
+ */
+
+#define AGENT_SOCKET_NAME            "gnome-session-agent.socket"
+#define AGENT_INIT_TIMEOUT_SECONDS   30
+#define AGENT_CLIENT_TIMEOUT_SECONDS 60
+
+typedef struct {
+        MonitorLeader    monitor;
+        GDBusConnection *connection;
+        GSocketService  *service;
+        char            *socket_path;
+        gboolean         initialized;
+        gboolean         init_in_flight;
+        GPtrArray       *init_waiters;  /* GSocketConnection */
+        guint            init_watch_id;
+        guint            init_timeout_id;
+} Agent;
+
+typedef struct {
+        Agent             *agent;
+        GSocketConnection *connection;
+        GDataInputStream  *input;
+} AgentRequest;
+
+static char *
+agent_get_socket_path (void)
+{
+        return g_build_filename (g_get_user_runtime_dir (), AGENT_SOCKET_NAME, NULL);
+}
+
+static void
+agent_reply (GSocketConnection *connection,
+             const char        *reply)
+{
+        g_autofree char *line = g_strdup_printf ("%s\n", reply);
+        g_autoptr(GError) error = NULL;
+        GOutputStream *output;
+
+        output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+        if (!g_output_stream_write_all (output, line, strlen (line), NULL, NULL, &error))
+                g_debug ("Couldn't answer agent client: %s", error->message);
+
+        g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+}
+
+static void
+agent_finish_init (Agent      *agent,
+                   const char *error_message)
+{
+        g_autofree char *reply = NULL;
+
+        g_clear_handle_id (&agent->init_timeout_id, g_source_remove);
+        if (agent->init_watch_id != 0) {
+                g_bus_unwatch_name (agent->init_watch_id);
+                agent->init_watch_id = 0;
+        }
+        agent->init_in_flight = FALSE;
+
+        if (error_message == NULL) {
+                agent->initialized = TRUE;
+                notify_service_manager ("STATUS=Session initialized");
+        }
+
+        reply = error_message ? g_strdup_printf ("error %s", error_message) : g_strdup ("ok");
+        for (guint i = 0; i < agent->init_waiters->len; i++)
+                agent_reply (g_ptr_array_index (agent->init_waiters, i), reply);
+        g_ptr_array_set_size (agent->init_waiters, 0);
+}
+
+static void
+on_initialized_reply (GObject      *source_object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+        Agent *agent = user_data;
+        g_autoptr(GVariant) reply = NULL;
+        g_autoptr(GError) error = NULL;
+
+        reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+        if (reply == NULL)
+                g_warning ("Failed to call signal initialization: %s", error->message);
+
+        agent_finish_init (agent, error ? error->message : NULL);
+}
+
+static void
+on_session_manager_appeared (GDBusConnection *connection,
+                             const char      *name,
+                             const char      *name_owner,
+                             gpointer         user_data)
+{
+        Agent *agent = user_data;
+
+        if (agent->init_in_flight)
+                return;
+        agent->init_in_flight = TRUE;
+
+        g_dbus_connection_call (connection,
+                                GSM_SERVICE_DBUS,
+                                GSM_PATH_DBUS,
+                                GSM_INTERFACE_DBUS,
+                                "Initialized",
+                                NULL,
+                                NULL,
+                                G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                -1, NULL,
+                                on_initialized_reply, agent);
+}
+
+static gboolean
+on_agent_init_timeout (gpointer user_data)
+{
+        Agent *agent = user_data;
+
+        agent->init_timeout_id = 0;
+
+        /* The call itself will time out on its own */
+        if (agent->init_in_flight)
+                return G_SOURCE_REMOVE;
+
+        agent_finish_init (agent, "timed out waiting for " GSM_SERVICE_DBUS);
+        return G_SOURCE_REMOVE;
+}
+
+/* Waits for gnome-session-service to be on the bus instead of failing
+ * straight away, which is what supervise-daemon's respawning used to be
+ * good for. */
+static void
+agent_signal_init (Agent             *agent,
+                   GSocketConnection *connection)
+{
+        if (agent->initialized) {
+                agent_reply (connection, "ok");
+                return;
+        }
+
+        if (agent->connection == NULL) {
+                agent_reply (connection, "error not connected to the session bus");
+                return;
+        }
+
+        g_ptr_array_add (agent->init_waiters, g_object_ref (connection));
+        if (agent->init_watch_id != 0 || agent->init_in_flight)
+                return;
+
+        agent->init_watch_id = g_bus_watch_name_on_connection (agent->connection,
+                                                               GSM_SERVICE_DBUS,
+                                                               G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                               on_session_manager_appeared,
+                                                               NULL,
+                                                               agent, NULL);
+        agent->init_timeout_id = g_timeout_add_seconds (AGENT_INIT_TIMEOUT_SECONDS,
+                                                        on_agent_init_timeout, agent);
+}
+
+static void
+agent_request_free (AgentRequest *request)
+{
+        g_object_unref (request->input);
+        g_object_unref (request->connection);
+        g_free (request);
+}
+
+static void
+agent_teardown_done_cb (GError   *error,
+                        gpointer  user_data)
+{
+        AgentRequest *request = user_data;
+
+        if (error != NULL) {
+                g_autofree char *reply = g_strdup_printf ("error %s", error->message);
+
+                g_warning ("Failed to stop session services: %s", error->message);
+                agent_reply (request->connection, reply);
+                g_main_loop_quit (request->agent->monitor.loop);
+        } else {
+                agent_reply (request->connection, "ok");
+        }
+
+        agent_request_free (request);
+}
+
+static void
+on_agent_request_read (GObject      *source_object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+        AgentRequest *request = user_data;
+        g_autoptr(GError) error = NULL;
+        g_autofree char *command = NULL;
+
+        command = g_data_input_stream_read_line_finish (G_DATA_INPUT_STREAM (source_object),
+                                                        result, NULL, &error);
+        if (command == NULL) {
+                if (error != NULL)
+                        g_debug ("Couldn't read agent request: %s", error->message);
+                agent_request_free (request);
+                return;
+        }
+
+        g_strstrip (command);
+        g_debug ("Agent request: %s", command);
+
+        if (g_str_equal (command, "signal-init")) {
+                agent_signal_init (request->agent, request->connection);
+        } else if (g_str_equal (command, "shutdown") ||
+                   g_str_equal (command, "shutdown-force")) {
+                /* Answered once the services are down */
+                teardown_session (g_str_equal (command, "shutdown-force"), NULL,
+                                  agent_teardown_done_cb, request);
+                return;
+        } else if (g_str_has_prefix (command, "stop-services ") ||
+                   g_str_has_prefix (command, "kill-services ")) {
+                g_auto(GStrv) keep = g_strsplit (strchr (command, ' ') + 1, " ", -1);
+
+                teardown_session (g_str_has_prefix (command, "kill-services "),
+                                  (const char * const *) keep,
+                                  agent_teardown_done_cb, request);
+                return;
+        } else {
+                agent_reply (request->connection, "error unknown command");
+        }
+
+        agent_request_free (request);
+}
+
+static gboolean
+on_agent_incoming (GSocketService    *service,
+                   GSocketConnection *connection,
+                   GObject           *source_object,
+                   gpointer           user_data)
+{
+        AgentRequest *request;
+
+        request = g_new0 (AgentRequest, 1);
+        request->agent = user_data;
+        request->connection = g_object_ref (connection);
+        request->input = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+
+        g_data_input_stream_read_line_async (request->input, G_PRIORITY_DEFAULT, NULL,
+                                             on_agent_request_read, request);
+
+        return TRUE;
+}
+
+static void
+do_agent (void)
+{
+        Agent agent = { .monitor.fifo_fd = -1 };
+        g_autoptr(GSocketAddress) address = NULL;
+        g_autoptr(GError) error = NULL;
+
+        agent.monitor.loop = g_main_loop_new (NULL, TRUE);
+        agent.connection = get_session_bus ();
+        agent.init_waiters = g_ptr_array_new_with_free_func (g_object_unref);
+
+        /* Listen before blocking on the FIFO so early requests just queue up */
+        agent.socket_path = agent_get_socket_path ();
+        g_unlink (agent.socket_path);
+        address = g_unix_socket_address_new (agent.socket_path);
+        agent.service = g_socket_service_new ();
+        if (!g_socket_listener_add_address (G_SOCKET_LISTENER (agent.service), address,
+                                            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                            NULL, NULL, &error))
+                g_warning ("Unable to listen on %s: %s", agent.socket_path, error->message);
+        g_signal_connect (agent.service, "incoming", G_CALLBACK (on_agent_incoming), &agent);
+        g_socket_service_start (agent.service);
+
+        monitor_leader_watch_fifo (&agent.monitor);
+
+        g_unix_signal_add (SIGTERM, leader_term_or_int_signal_cb, &agent.monitor);
+        g_unix_signal_add (SIGINT, leader_term_or_int_signal_cb, &agent.monitor);
+
+        g_main_loop_run (agent.monitor.loop);
+
+        g_socket_service_stop (agent.service);
+        g_socket_listener_close (G_SOCKET_LISTENER (agent.service));
+        g_unlink (agent.socket_path);
+
+        g_clear_handle_id (&agent.init_timeout_id, g_source_remove);
+        if (agent.init_watch_id != 0)
+                g_bus_unwatch_name (agent.init_watch_id);
+        g_ptr_array_unref (agent.init_waiters);
+        g_object_unref (agent.service);
+        g_free (agent.socket_path);
+        g_clear_object (&agent.connection);
+        g_main_loop_unref (agent.monitor.loop);
+}
+
+/**
+ * agent_request:
+ * @command: what the agent should do
+ * @reached: (out): whether there was an agent to ask
+ *
+ * Returns: %TRUE if the agent carried out @command.
+ */
+static gboolean
+agent_request (const char  *command,
+               gboolean    *reached,
+               GError     **error)
+{
+        g_autoptr(GSocketClient) client = NULL;
+        g_autoptr(GSocketAddress) address = NULL;
+        g_autoptr(GSocketConnection) connection = NULL;
+        g_autoptr(GDataInputStream) input = NULL;
+        g_autoptr(GError) connect_error = NULL;
+        g_autofree char *socket_path = NULL;
+        g_autofree char *line = NULL;
+        g_autofree char *reply = NULL;
+
+        socket_path = agent_get_socket_path ();
+        address = g_unix_socket_address_new (socket_path);
+
+        client = g_socket_client_new ();
+        g_socket_client_set_timeout (client, AGENT_CLIENT_TIMEOUT_SECONDS);
+
+        connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (address),
+                                              NULL, &connect_error);
+        *reached = connection != NULL;
+        if (connection == NULL) {
+                g_debug ("No session agent at %s: %s", socket_path, connect_error->message);
+                return FALSE;
+        }
+
+        line = g_strdup_printf ("%s\n", command);
+        if (!g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+                                        line, strlen (line), NULL, NULL, error))
+                return FALSE;
+
+        input = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+        reply = g_data_input_stream_read_line (input, NULL, NULL, error);
+        if (reply == NULL) {
+                if (error != NULL && *error == NULL)
+                        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+                                             "The session agent hung up");
+                return FALSE;
+        }
+
+        if (g_str_equal (reply, "ok"))
+                return TRUE;
+
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             g_str_has_prefix (reply, "error ") ? reply + strlen ("error ") : reply);
+        return FALSE;
+}
+#endif
+
+#ifdef USE_OPENRC
+/*
+ * Startup analysis
+ *
+ * Reads the trace written by the leader and gnome-session-service (see
+ * gnome-session/gsm-openrc.c) and prints the critical chain to the session
+ * target plus a chart of when each service was requested, started and ready.
+ */
+
+#define ANALYZE_CHART_WIDTH 60
+#define ANALYZE_SVG_ROW     20
+#define ANALYZE_SVG_WIDTH   1000
+#define ANALYZE_SVG_LABEL   260
+
+typedef struct {
+        char      *name;
+        gint64     request;
+        gint64     start;
+        gint64     ready;
+        gboolean   failed;
+        gboolean   critical;
+        /* Never took the bus name it declared, see session-services.conf */
+        gboolean   no_bus_name;
+        GPtrArray *needs;
+} AnalyzeService;
+
+typedef struct {
+        char   *name;
+        gint64  time;
+} AnalyzePhase;
+
+typedef struct {
+        char   *name;
+        gint64  end;
+        gint64  duration;
+} AnalyzeStep;
+
+typedef struct {
+        gint64      login;
+        gint64      end;
+        char       *target;
+        GHashTable *services;
+        GPtrArray  *order;
+        GPtrArray  *phases;
+        GPtrArray  *steps;
+} AnalyzeTrace;
+
+static void
+analyze_service_free (AnalyzeService *service)
+{
+        g_free (service->name);
+        g_ptr_array_unref (service->needs);
+        g_free (service);
+}
+
+static void
+analyze_phase_free (AnalyzePhase *phase)
+{
+        g_free (phase->name);
+        g_free (phase);
+}
+
+static void
+analyze_step_free (AnalyzeStep *step)
+{
+        g_free (step->name);
+        g_free (step);
+}
+
+static void
+analyze_trace_free (AnalyzeTrace *trace)
+{
+        g_free (trace->target);
+        g_ptr_array_unref (trace->order);
+        g_ptr_array_unref (trace->phases);
+        g_ptr_array_unref (trace->steps);
+        g_hash_table_unref (trace->services);
+        g_free (trace);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (AnalyzeTrace, analyze_trace_free);
+
+static AnalyzeService *
+analyze_trace_ensure_service (AnalyzeTrace *trace,
+                              const char   *name)
+{
+        AnalyzeService *service;
+
+        service = g_hash_table_lookup (trace->services, name);
+        if (service != NULL)
+                return service;
+
+        service = g_new0 (AnalyzeService, 1);
+        service->name = g_strdup (name);
+        service->request = service->start = service->ready = -1;
+        service->needs = g_ptr_array_new_with_free_func (g_free);
+        g_hash_table_insert (trace->services, service->name, service);
+        g_ptr_array_add (trace->order, service);
+
+        return service;
+}
+
+static AnalyzeTrace *
+analyze_trace_load (GError **error)
+{
+        g_autoptr(AnalyzeTrace) trace = NULL;
+        g_autofree char *path = NULL;
+        g_autofree char *contents = NULL;
+        g_auto(GStrv) lines = NULL;
+
+        path = gsm_openrc_trace_get_path ();
+        if (!g_file_get_contents (path, &contents, NULL, error))
+                return NULL;
+
+        trace = g_new0 (AnalyzeTrace, 1);
+        trace->login = -1;
+        trace->services = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 NULL, (GDestroyNotify) analyze_service_free);
+        trace->order = g_ptr_array_new ();
+        trace->phases = g_ptr_array_new_with_free_func ((GDestroyNotify) analyze_phase_free);
+        trace->steps = g_ptr_array_new_with_free_func ((GDestroyNotify) analyze_step_free);
+
+        lines = g_strsplit (contents, "\n", -1);
+        for (guint i = 0; lines[i] != NULL; i++) {
+                g_auto(GStrv) fields = NULL;
+                AnalyzeService *service;
+                const char *event;
+                const char *subject;
+                gint64 time;
+
+                fields = g_strsplit (lines[i], " ", 4);
+                if (g_strv_length (fields) < 3)
+                        continue;
+
+                time = g_ascii_strtoll (fields[0], NULL, 10);
+                event = fields[1];
+                subject = fields[2];
+
+                if (trace->login < 0)
+                        trace->login = time;
+                trace->end = MAX (trace->end, time);
+
+                if (g_str_equal (event, "login")) {
+                        trace->login = time;
+                } else if (g_str_equal (event, "target")) {
+                        g_free (trace->target);
+                        trace->target = g_strdup (subject);
+                } else if (g_str_equal (event, "phase")) {
+                        AnalyzePhase *phase = g_new0 (AnalyzePhase, 1);
+
+                        phase->name = g_strdup (subject);
+                        phase->time = time;
+                        g_ptr_array_add (trace->phases, phase);
+                } else if (g_str_equal (event, "step")) {
+                        AnalyzeStep *step;
+
+                        if (fields[3] == NULL)
+                                continue;
+                        step = g_new0 (AnalyzeStep, 1);
+                        step->name = g_strdup (subject);
+                        step->end = time;
+                        step->duration = g_ascii_strtoll (fields[3], NULL, 10);
+                        g_ptr_array_add (trace->steps, step);
+                } else if (g_str_equal (event, "need")) {
+                        if (fields[3] == NULL)
+                                continue;
+                        service = analyze_trace_ensure_service (trace, subject);
+                        g_ptr_array_add (service->needs, g_strdup (fields[3]));
+                } else if (g_str_equal (event, "request")) {
+                        service = analyze_trace_ensure_service (trace, subject);
+                        service->request = time;
+                        service->critical = g_strcmp0 (fields[3], "critical") == 0;
+                } else if (g_str_equal (event, "start")) {
+                        service = analyze_trace_ensure_service (trace, subject);
+                        service->start = time;
+                } else if (g_str_equal (event, "ready")) {
+                        service = analyze_trace_ensure_service (trace, subject);
+                        service->ready = time;
+                        service->no_bus_name = g_strcmp0 (fields[3], "no-bus-name") == 0;
+                } else if (g_str_equal (event, "fail")) {
+                        service = analyze_trace_ensure_service (trace, subject);
+                        service->failed = TRUE;
+                }
+        }
+
+        if (trace->login < 0) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                             "Startup trace %s is empty", path);
+                return NULL;
+        }
+
+        return g_steal_pointer (&trace);
+}
+
+static double
+analyze_seconds (AnalyzeTrace *trace,
+                 gint64        time)
+{
+        return (double) (time - trace->login) / G_USEC_PER_SEC;
+}
+
+static void
+analyze_print_chain (AnalyzeTrace   *trace,
+                     AnalyzeService *service,
+                     guint           depth,
+                     GHashTable     *visited)
+{
+        AnalyzeService *latest = NULL;
+
+        if (!g_hash_table_add (visited, service->name))
+                return;
+
+        g_print ("%*s%s%s", (int) depth * 2, "", depth > 0 ? "└─" : "", service->name);
+        if (service->failed)
+                g_print (" (failed)");
+        else if (service->ready >= 0 && service->start >= 0)
+                g_print (" @%.3fs +%.3fs",
+                         analyze_seconds (trace, service->ready),
+                         (double) (service->ready - service->start) / G_USEC_PER_SEC);
+        else if (service->ready >= 0)
+                g_print (" @%.3fs", analyze_seconds (trace, service->ready));
+        if (service->no_bus_name)
+                g_print (" (never took its bus name)");
+        g_print ("\n");
+
+        /* The need that became ready last is the one that held us up */
+        for (guint i = 0; i < service->needs->len; i++) {
+                AnalyzeService *dep;
+
+                dep = g_hash_table_lookup (trace->services,
+                                           g_ptr_array_index (service->needs, i));
+                if (dep == NULL || dep->ready < 0)
+                        continue;
+                if (latest == NULL || dep->ready > latest->ready)
+                        latest = dep;
+        }
+
+        if (latest != NULL)
+                analyze_print_chain (trace, latest, depth + 1, visited);
+}
+
+static int
+analyze_compare_start (gconstpointer a,
+                       gconstpointer b)
+{
+        const AnalyzeService *sa = *(AnalyzeService **) a;
+        const AnalyzeService *sb = *(AnalyzeService **) b;
+        gint64 ta = sa->request >= 0 ? sa->request : sa->ready;
+        gint64 tb = sb->request >= 0 ? sb->request : sb->ready;
+
+        return (ta > tb) - (ta < tb);
+}
+
+static guint
+analyze_column (AnalyzeTrace *trace,
+                gint64        time)
+{
+        gint64 span = MAX (trace->end - trace->login, 1);
+
+        return (guint) ((time - trace->login) * (ANALYZE_CHART_WIDTH - 1) / span);
+}
+
+static void
+analyze_print_chart (AnalyzeTrace *trace,
+                     GPtrArray    *sorted)
+{
+        g_print ("\n'.' waiting for a job slot, '=' starting, '!' failed, '*' critical path\n\n");
+
+        for (guint i = 0; i < sorted->len; i++) {
+                AnalyzeService *service = g_ptr_array_index (sorted, i);
+                char bar[ANALYZE_CHART_WIDTH + 1];
+                gint64 end;
+
+                if (service->request < 0)
+                        continue;
+
+                end = service->ready >= 0 ? service->ready : trace->end;
+                memset (bar, ' ', ANALYZE_CHART_WIDTH);
+                bar[ANALYZE_CHART_WIDTH] = '\0';
+
+                for (guint c = analyze_column (trace, service->request);
+                     c <= analyze_column (trace, end); c++) {
+                        if (service->start < 0 || c < analyze_column (trace, service->start))
+                                bar[c] = '.';
+                        else
+                                bar[c] = service->failed ? '!' : '=';
+                }
+
+                g_print ("%c %-32s |%s| %.3fs\n",
+                         service->critical ? '*' : ' ',
+                         service->name, bar,
+                         analyze_seconds (trace, end));
+        }
+
+        for (guint i = 0; i < trace->phases->len; i++) {
+                AnalyzePhase *phase = g_ptr_array_index (trace->phases, i);
+
+                g_print ("  %-32s  %*s^ %.3fs\n",
+                         phase->name,
+                         (int) analyze_column (trace, phase->time), "",
+                         analyze_seconds (trace, phase->time));
+        }
+}
+
+static gboolean
+analyze_write_svg (AnalyzeTrace  *trace,
+                   GPtrArray     *sorted,
+                   const char    *filename,
+                   GError       **error)
+{
+        g_autoptr(GString) svg = NULL;
+        double span = MAX (trace->end - trace->login, 1);
+        double scale = (ANALYZE_SVG_WIDTH - ANALYZE_SVG_LABEL) / span;
+        guint height = (sorted->len + trace->phases->len + 2) * ANALYZE_SVG_ROW;
+        guint row = 0;
+
+        svg = g_string_new (NULL);
+        g_string_append_printf (svg,
+                                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%u\" font-family=\"sans-serif\" font-size=\"12\">\n",
+                                ANALYZE_SVG_WIDTH, height);
+
+        for (guint i = 0; i < sorted->len; i++) {
+                AnalyzeService *service = g_ptr_array_index (sorted, i);
+                g_autofree char *name = NULL;
+                gint64 start, end;
+                double y;
+
+                if (service->request < 0)
+                        continue;
+
+                start = service->start >= 0 ? service->start : service->request;
+                end = service->ready >= 0 ? service->ready : trace->end;
+                y = row++ * ANALYZE_SVG_ROW;
+                name = g_markup_escape_text (service->name, -1);
+
+                g_string_append_printf (svg,
+                                        "  <text x=\"4\" y=\"%.0f\"%s>%s</text>\n",
+                                        y + 14, service->critical ? " font-weight=\"bold\"" : "", name);
+                g_string_append_printf (svg,
+                                        "  <rect x=\"%.1f\" y=\"%.0f\" width=\"%.1f\" height=\"16\" fill=\"#deddda\"/>\n",
+                                        ANALYZE_SVG_LABEL + (service->request - trace->login) * scale, y + 2,
+                                        MAX ((start - service->request) * scale, 0.5));
+                g_string_append_printf (svg,
+                                        "  <rect x=\"%.1f\" y=\"%.0f\" width=\"%.1f\" height=\"16\" fill=\"%s\"/>\n",
+                                        ANALYZE_SVG_LABEL + (start - trace->login) * scale, y + 2,
+                                        MAX ((end - start) * scale, 0.5),
+                                        service->failed ? "#e01b24" : service->critical ? "#1c71d8" : "#62a0ea");
+        }
+
+        for (guint i = 0; i < trace->phases->len; i++) {
+                AnalyzePhase *phase = g_ptr_array_index (trace->phases, i);
+                double x = ANALYZE_SVG_LABEL + (phase->time - trace->login) * scale;
+                g_autofree char *name = g_markup_escape_text (phase->name, -1);
+
+                g_string_append_printf (svg,
+                                        "  <line x1=\"%.1f\" y1=\"0\" x2=\"%.1f\" y2=\"%u\" stroke=\"#c64600\" stroke-dasharray=\"4\"/>\n"
+                                        "  <text x=\"%.1f\" y=\"%u\" fill=\"#c64600\">%s %.3fs</text>\n",
+                                        x, x, height,
+                                        x + 2, (row + 1 + i) * ANALYZE_SVG_ROW,
+                                        name, analyze_seconds (trace, phase->time));
+        }
+
+        g_string_append (svg, "</svg>\n");
+
+        return g_file_set_contents (filename, svg->str, svg->len, error);
+}
+
+static gboolean
+do_analyze (const char *svg_filename)
+{
+        g_autoptr(AnalyzeTrace) trace = NULL;
+        g_autoptr(GPtrArray) sorted = NULL;
+        g_autoptr(GHashTable) visited = NULL;
+        g_autoptr(GError) error = NULL;
+        AnalyzeService *target;
+
+        trace = analyze_trace_load (&error);
+        if (trace == NULL) {
+                g_printerr ("Unable to read startup trace: %s\n", error->message);
+                return FALSE;
+        }
+
+        g_print ("The time when a service became ready is printed after the \"@\" character.\n"
+                 "The time the service took to start is printed after the \"+\" character.\n\n");
+
+        target = trace->target ? g_hash_table_lookup (trace->services, trace->target) : NULL;
+        if (target != NULL) {
+                visited = g_hash_table_new (g_str_hash, g_str_equal);
+                analyze_print_chain (trace, target, 0, visited);
+        } else {
+                g_print ("No session target recorded in the startup trace\n");
+        }
+
+        if (trace->steps->len > 0) {
+                g_print ("\nSession steps:\n");
+                for (guint i = 0; i < trace->steps->len; i++) {
+                        AnalyzeStep *step = g_ptr_array_index (trace->steps, i);
+
+                        g_print ("  %-17s +%.3fs @%.3fs\n", step->name,
+                                 step->duration / (double) G_USEC_PER_SEC,
+                                 analyze_seconds (trace, step->end));
+                }
+        }
+
+        for (guint i = 0, n = 0; i < trace->order->len; i++) {
+                AnalyzeService *service = g_ptr_array_index (trace->order, i);
+
+                if (!service->no_bus_name)
+                        continue;
+                if (n++ == 0)
+                        g_print ("\nServices that never took their bus name:\n");
+                g_print ("  %s\n", service->name);
+        }
+
+        sorted = g_ptr_array_copy (trace->order, NULL, NULL);
+        g_ptr_array_sort (sorted, analyze_compare_start);
+        analyze_print_chart (trace, sorted);
+
+        if (svg_filename != NULL) {
+                if (!analyze_write_svg (trace, sorted, svg_filename, &error)) {
+                        g_printerr ("Unable to write %s: %s\n", svg_filename, error->message);
+                        return FALSE;
+                }
+                g_print ("\nChart written to %s\n", svg_filename);
+        }
+
+        return TRUE;
+}
+
+/*
+ * Reports how often the leader could reuse its snapshot of the session's
+ * dependency graph (see gnome-session/gsm-deptree-cache.c) instead of
+ * resolving it through OpenRC, and when it last couldn't.
+ */
+static gboolean
+do_deptree_stats (void)
+{
+        g_autoptr(GKeyFile) keyfile = NULL;
+        g_autoptr(GError) error = NULL;
+        g_autofree char *path = NULL;
+        g_auto(GStrv) runlevels = NULL;
+
+        path = g_build_filename (g_get_user_state_dir (),
+                                 "gnome-session",
+                                 "deptree-cache.ini",
+                                 NULL);
+        keyfile = g_key_file_new ();
+        if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, &error)) {
+                if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+                        g_print ("No session has been started with the dependency tree cache yet\n");
+                        return TRUE;
+                }
+                g_printerr ("Unable to read %s: %s\n", path, error->message);
+                return FALSE;
+        }
+
+        runlevels = g_key_file_get_groups (keyfile, NULL);
+        for (guint i = 0; runlevels[i] != NULL; i++) {
+                g_autofree char *hits_name = NULL;
+                g_autofree char *hits_path = NULL;
+                g_autofree char *last_miss = NULL;
+                g_autofree char *since = NULL;
+                guint64 hits = 0;
+                guint64 misses;
+                GStatBuf st;
+
+                /* One byte per hit */
+                hits_name = g_strdup_printf ("deptree-%s.hits", runlevels[i]);
+                hits_path = g_build_filename (g_get_user_state_dir (),
+                                              "gnome-session",
+                                              hits_name,
+                                              NULL);
+                if (g_stat (hits_path, &st) == 0)
+                        hits = st.st_size;
+
+                misses = g_key_file_get_uint64 (keyfile, runlevels[i], "Misses", NULL);
+                last_miss = g_key_file_get_string (keyfile, runlevels[i], "LastMiss", NULL);
+                if (g_key_file_has_key (keyfile, runlevels[i], "LastMissTime", NULL)) {
+                        g_autoptr(GDateTime) time = NULL;
+
+                        time = g_date_time_new_from_unix_local (
+                                g_key_file_get_int64 (keyfile, runlevels[i], "LastMissTime", NULL));
+                        if (time != NULL)
+                                since = g_date_time_format (time, "%c");
+                }
+
+                g_print ("%s: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+                         runlevels[i], hits, misses);
+                if (last_miss != NULL && since != NULL)
+                        g_print (" (last miss: %s, %s)", last_miss, since);
+                else if (last_miss != NULL)
+                        g_print (" (last miss: %s)", last_miss);
+                g_print ("\n");
+        }
+
+        return TRUE;
+}
+#endif
+
 int
 main (int argc, char *argv[])
 {
@@ -260,6 +1798,12 @@ main (int argc, char *argv[])
         static gboolean   opt_signal_init;
         static gboolean   opt_restart_dbus;
         static gboolean   opt_exec_stop_check;
+        static gboolean   opt_analyze;
+        static gboolean   opt_deptree_stats;
+        static gboolean   opt_agent;
+        static gboolean   opt_force;
+        static char     **opt_keep;
+        static char      *opt_svg;
         int     conflicting_options;
         GOptionContext *ctx;
         static const GOptionEntry options[] = {
@@ -269,6 +1813,13 @@ main (int argc, char *argv[])
 #ifndef USE_OPENRC
                 { "restart-dbus", '\0', 0, G_OPTION_ARG_NONE, &opt_restart_dbus, N_("Restart dbus service if it is running"), NULL },
                 { "exec-stop-check", '\0', 0, G_OPTION_ARG_NONE, &opt_exec_stop_check, N_("Run from ExecStopPost to start gnome-session-shutdown service on service failure"), NULL },
+#else
+                { "analyze", '\0', 0, G_OPTION_ARG_NONE, &opt_analyze, N_("Show how the session services of the current or last login started"), NULL },
+                { "svg", '\0', 0, G_OPTION_ARG_FILENAME, &opt_svg, N_("Also write the --analyze chart as SVG to FILE"), N_("FILE") },
+                { "deptree-stats", '\0', 0, G_OPTION_ARG_NONE, &opt_deptree_stats, N_("Show how often the cached session dependency graph was reused"), NULL },
+                { "agent", '\0', 0, G_OPTION_ARG_NONE, &opt_agent, N_("Monitor the session leader and serve --signal-init and --shutdown for the whole session"), NULL },
+                { "force", '\0', 0, G_OPTION_ARG_NONE, &opt_force, N_("With --shutdown, kill the session services instead of stopping them"), NULL },
+                { "keep", '\0', 0, G_OPTION_ARG_STRING_ARRAY, &opt_keep, N_("With --shutdown, leave SERVICE and the session runlevel up, and return once the other services are down; can be repeated"), N_("SERVICE") },
 #endif
                 { NULL },
         };
@@ -298,12 +1849,63 @@ main (int argc, char *argv[])
                 conflicting_options++;
         if (opt_exec_stop_check)
                 conflicting_options++;
+        if (opt_analyze)
+                conflicting_options++;
+        if (opt_deptree_stats)
+                conflicting_options++;
+        if (opt_agent)
+                conflicting_options++;
         if (conflicting_options != 1) {
                 g_printerr (_("Program needs exactly one parameter"));
                 exit (1);
         }
+        if ((opt_force || opt_keep != NULL) && !opt_shutdown) {
+                g_printerr (_("--force and --keep only apply to --shutdown"));
+                exit (1);
+        }
+
+#ifdef USE_OPENRC
+        if (opt_analyze)
+                return do_analyze (opt_svg) ? 0 : 1;
+        if (opt_deptree_stats)
+                return do_deptree_stats () ? 0 : 1;
+
+        if (opt_agent) {
+                do_agent ();
+                return 0;
+        }
+
+        if (opt_signal_init || opt_shutdown) {
+                g_autofree char *command = NULL;
+                gboolean reached = FALSE;
 
-        sd_notify (0, "READY=1");
+                if (opt_signal_init)
+                        command = g_strdup ("signal-init");
+                else if (opt_keep != NULL) {
+                        g_autofree char *keep = g_strjoinv (" ", opt_keep);
+
+                        command = g_strdup_printf ("%s %s", opt_force ? "kill-services" : "stop-services",
+                                                   keep);
+                }
+                else
+                        command = g_strdup (opt_force ? "shutdown-force" : "shutdown");
+
+                if (agent_request (command, &reached, &error))
+                        return 0;
+
+                if (reached) {
+                        g_warning ("Session agent failed: %s", error->message);
+                        return 1;
+                }
+
+                /* No agent, e.g. when run by hand outside a session; do it ourselves */
+        }
+#endif
+
+#ifndef USE_OPENRC
+        /* Under OpenRC readiness is only signalled once the role is set up */
+        notify_service_manager ("READY=1");
+#endif
 
 
         if (opt_signal_init) {
@@ -312,9 +1914,11 @@ main (int argc, char *argv[])
                 do_restart_dbus ();
         } else if (opt_shutdown) {
 #ifdef USE_OPENRC
-                gchar *rl_argv[] = { "/usr/bin/openrc", "-U", "default", NULL };
-                if (!async_run_cmd(rl_argv, &error))
-                        g_error("Failed to start unit");
+                g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+
+                teardown_session (opt_force, (const char * const *) opt_keep,
+                                  shutdown_teardown_done_cb, loop);
+                g_main_loop_run (loop);
 #else
                 do_start_unit ("gnome-session-shutdown.target", "replace-irreversibly");
 #endif